@@ -3,17 +3,22 @@
 #include "preamble.h"
 
 #include <stdatomic.h>
+#include <stdint.h>
+#ifdef __APPLE__
 #include <malloc/malloc.h>
+#endif
 
-#define ALLOCATOR_DEBUG
+// Define ALLOCATOR_DEBUG to name the allocators, count the bytes allocated
+// from the system and trace every allocation. Without it, the allocation
+// functions call straight into the allocator.
 #ifdef ALLOCATOR_DEBUG
 #define ALLOCATOR_DEBUG_BLOCK(...) __VA_ARGS__
 #else
-#define ALLOCATOR_DEBUG_BLOCK(code)
+#define ALLOCATOR_DEBUG_BLOCK(...)
 #endif
 
 
-#if !defined(_Atomic) || __STDC_VERSION__ < 201112L
+#if __STDC_VERSION__ < 201112L || defined(__STDC_NO_ATOMICS__)
 #define _Atomic
 #endif
 
@@ -25,6 +30,9 @@ static inline size_t round_up_to_nearest_power_of_2(size_t v) {
     v |= v >> 4;
     v |= v >> 8;
     v |= v >> 16;
+#if SIZE_MAX > 0xFFFFFFFF
+    v |= v >> 32;
+#endif
     v++;
 
     return v;
@@ -93,7 +101,6 @@ enum AllocatorMode {
 };
 
 
-#ifdef ALLOCATOR_DEBUG
 static inline enum AllocatorMode allocator_mode(size_t size, void* memory, size_t old_size) {
     if (size != 0 && memory == NULL && old_size == 0)  return ALLOCATOR_MODE_ALLOCATE;
     else if (size != 0 && memory != NULL && old_size == 0)  return /* Special */  -1;
@@ -109,6 +116,7 @@ static inline enum AllocatorMode allocator_mode(size_t size, void* memory, size_
 }
 
 
+#ifdef ALLOCATOR_DEBUG
 struct SourceLocation {
     const char* file;
     const char* func;
@@ -116,14 +124,393 @@ struct SourceLocation {
 };
 
 
-static _Atomic int total_allocated = 0;
-static _Atomic int total_reallocated = 0;
-static _Atomic int total_deallocated = 0;
-
 /// Used to give each allocator a unique id. 0 is reserved for the system allocator.
 static _Atomic int allocator_id = 1;
 
 
+// The statistics and the async trace keep their data per thread, in nodes
+// that are found through a thread-local pointer and linked into a list for
+// whoever sums or drains them. The nodes are never freed, as they may be read
+// at any time, but the node of a thread that has exited goes to the next
+// thread that needs one.
+//
+// Requires POSIX threads and the GCC/Clang `__atomic` builtins.
+#include <pthread.h>
+#include <stdint.h>
+
+#if __STDC_VERSION__ >= 201112L
+#define ALLOCATOR_THREAD_LOCAL _Thread_local
+#else
+#define ALLOCATOR_THREAD_LOCAL __thread
+#endif
+
+struct AllocatorThreadNode {
+    struct AllocatorThreadNode* next;
+    int owned;
+};
+
+static void allocator_thread_exit(void* node) {
+    __atomic_store_n(&((struct AllocatorThreadNode*)node)->owned, 0, __ATOMIC_RELEASE);
+}
+
+/// Gives the calling thread a node of `size` bytes from the list, either
+/// one left behind by a thread that has exited or a new zeroed one.
+static struct AllocatorThreadNode* allocator_thread_claim(struct AllocatorThreadNode** list, pthread_key_t key, size_t size) {
+    struct AllocatorThreadNode* node = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    for (; node != NULL; node = node->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&node->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (node == NULL) {
+        node = calloc(1, size);
+        if (node == NULL)
+            return NULL;
+        node->owned = 1;
+        node->next  = __atomic_load_n(list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(list, &node->next, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(key, node);
+    return node;
+}
+
+
+/// The number of allocator ids with statistics of their own. Allocators
+/// with a larger id share the statistics of the last one.
+#ifndef ALLOCATOR_STATS_MAX_ALLOCATORS
+#define ALLOCATOR_STATS_MAX_ALLOCATORS 256
+#endif
+#define ALLOCATOR_STATS_BUCKETS 40
+
+/// The memory statistics of an allocator. A reallocation counts as both an
+/// allocation and a deallocation, and resetting or releasing the allocator
+/// counts as deallocating everything that's still live.
+struct AllocatorStats {
+    uint64_t live;
+    /// The high-water mark of the live bytes. It's exact if only one thread
+    /// uses the allocator, and otherwise the sum of the high-water marks of
+    /// each thread, which is an upper bound.
+    uint64_t peak;
+    uint64_t allocated;
+    uint64_t deallocated;
+    uint64_t allocations;
+    uint64_t deallocations;
+    /// The number of allocations of `[2^i, 2^(i+1))` bytes. The last
+    /// bucket also counts everything larger.
+    uint64_t histogram[ALLOCATOR_STATS_BUCKETS];
+};
+
+/// The statistics of every allocator, as counted by one thread. Only the
+/// owning thread writes them, so the counters are bumped without any
+/// read-modify-write. The live bytes of a thread wrap around when it frees
+/// what another thread allocated, but the sum over the threads doesn't.
+struct AllocatorStatsThread {
+    struct AllocatorThreadNode node;
+    struct AllocatorStats stats[ALLOCATOR_STATS_MAX_ALLOCATORS];
+};
+
+static struct AllocatorThreadNode* allocator_stats_threads = NULL;
+static ALLOCATOR_THREAD_LOCAL struct AllocatorStatsThread* allocator_stats_thread = NULL;
+
+static pthread_once_t allocator_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  allocator_stats_key;
+
+static void allocator_stats_init(void) {
+    pthread_key_create(&allocator_stats_key, allocator_thread_exit);
+}
+
+static inline struct AllocatorStats* allocator_stats_local(int id) {
+    struct AllocatorStatsThread* thread = allocator_stats_thread;
+    if (thread == NULL) {
+        pthread_once(&allocator_stats_once, allocator_stats_init);
+        thread = (struct AllocatorStatsThread*) allocator_thread_claim(&allocator_stats_threads, allocator_stats_key, sizeof(struct AllocatorStatsThread));
+        if (thread == NULL)
+            return NULL;
+        allocator_stats_thread = thread;
+    }
+    if (id < 0 || id >= ALLOCATOR_STATS_MAX_ALLOCATORS)
+        id = ALLOCATOR_STATS_MAX_ALLOCATORS - 1;
+    return &thread->stats[id];
+}
+
+static inline void allocator_stats_bump(uint64_t* counter, uint64_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/// Counts an allocation of `size` bytes and a deallocation of `old_size`
+/// bytes, either of which may be 0.
+static inline void allocator_stats_count(int id, size_t size, size_t old_size) {
+    struct AllocatorStats* stats = allocator_stats_local(id);
+    if (stats == NULL)
+        return;
+
+    if (size != 0) {
+        size_t bucket = 0;
+        while (bucket + 1 < ALLOCATOR_STATS_BUCKETS && (size >> (bucket + 1)) != 0)
+            ++bucket;
+        allocator_stats_bump(&stats->allocated, size);
+        allocator_stats_bump(&stats->allocations, 1);
+        allocator_stats_bump(&stats->histogram[bucket], 1);
+    }
+    if (old_size != 0) {
+        allocator_stats_bump(&stats->deallocated, old_size);
+        allocator_stats_bump(&stats->deallocations, 1);
+    }
+
+    uint64_t live = stats->live + size - old_size;
+    __atomic_store_n(&stats->live, live, __ATOMIC_RELAXED);
+    if ((int64_t)live > (int64_t)stats->peak)
+        __atomic_store_n(&stats->peak, live, __ATOMIC_RELAXED);
+}
+
+/// Sums the statistics of the allocator with the id over all threads.
+static struct AllocatorStats allocator_stats_of(int id) {
+    struct AllocatorStats result = { 0 };
+    if (id < 0 || id >= ALLOCATOR_STATS_MAX_ALLOCATORS)
+        id = ALLOCATOR_STATS_MAX_ALLOCATORS - 1;
+
+    struct AllocatorThreadNode* node = __atomic_load_n(&allocator_stats_threads, __ATOMIC_ACQUIRE);
+    for (; node != NULL; node = node->next) {
+        struct AllocatorStats* stats = &((struct AllocatorStatsThread*)node)->stats[id];
+        result.live          += __atomic_load_n(&stats->live,          __ATOMIC_RELAXED);
+        result.peak          += __atomic_load_n(&stats->peak,          __ATOMIC_RELAXED);
+        result.allocated     += __atomic_load_n(&stats->allocated,     __ATOMIC_RELAXED);
+        result.deallocated   += __atomic_load_n(&stats->deallocated,   __ATOMIC_RELAXED);
+        result.allocations   += __atomic_load_n(&stats->allocations,   __ATOMIC_RELAXED);
+        result.deallocations += __atomic_load_n(&stats->deallocations, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < ALLOCATOR_STATS_BUCKETS; ++i)
+            result.histogram[i] += __atomic_load_n(&stats->histogram[i], __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+/// Returns the statistics of the allocator, summed over all threads.
+static inline struct AllocatorStats allocator_stats(const struct Allocator* allocator) {
+    return allocator_stats_of(allocator->id);
+}
+
+/// Counts everything that's still live in the allocator as deallocated.
+static inline void allocator_stats_clear(int id) {
+    struct AllocatorStats* stats = allocator_stats_local(id);
+    if (stats == NULL)
+        return;
+
+    uint64_t live = allocator_stats_of(id).live;
+    allocator_stats_bump(&stats->deallocated, live);
+    __atomic_store_n(&stats->live, stats->live - live, __ATOMIC_RELAXED);
+}
+
+
+/// Everything needed to print a line of the allocation trace later. The
+/// strings are the literals of the allocator names and source locations.
+struct AllocatorLogRecord {
+    enum AllocatorMode    mode;
+    int                   id;
+    const char*           name;
+    size_t                size;
+    void*                 memory;
+    size_t                old_size;
+    void*                 result;
+    struct SourceLocation location;
+};
+
+static void allocator_log_print(const struct AllocatorLogRecord* r) {
+    const char* file = r->location.file;
+    int         line = r->location.line;
+    switch (r->mode) {
+        case ALLOCATOR_MODE_ALLOCATE:
+            logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, file, line, "%s-%d in '%s' allocated %zu at %p\n", r->name, r->id, r->location.func, r->size, r->result);
+            break;
+        case ALLOCATOR_MODE_REALLOCATE:
+            logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, file, line, "%s-%d in '%s' reallocated from %zu to %zu at %p to %p\n", r->name, r->id, r->location.func, r->old_size, r->size, r->memory, r->result);
+            break;
+        case ALLOCATOR_MODE_DEALLOCATE:
+            logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, file, line, "%s-%d in '%s' deallocated %zu at %p\n", r->name, r->id, r->location.func, r->old_size, r->memory);
+            break;
+        case ALLOCATOR_MODE_RESERVE_ALL:
+            logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, file, line, "%s-%d in '%s' reserved all at %p\n", r->name, r->id, r->location.func, r->result);
+            break;
+        case ALLOCATOR_MODE_RESET_ALL:
+            logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, file, line, "%s-%d in '%s' reset all (%zu bytes)\n", r->name, r->id, r->location.func, (size_t) r->result);
+            break;
+        case ALLOCATOR_MODE_RELEASE:
+            logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, file, line, "'%s' released all (%zu bytes)\n", r->location.func, (size_t) r->result);
+            break;
+    }
+}
+
+
+#ifdef ALLOCATOR_LOG_ASYNC
+// With ALLOCATOR_LOG_ASYNC, the trace is written to a ring buffer of the
+// calling thread instead of being printed. Pushing a record is a copy and a
+// release store, and a full ring drops the record rather than waiting.
+// The rings are printed by `allocator_log_drain`, or by the background
+// thread of `allocator_log_start`.
+//
+// Requires POSIX threads and the GCC/Clang `__atomic` builtins.
+#include <time.h>
+#include <sched.h>
+
+// The background thread sleeps with nanosleep, which glibc only declares
+// when _POSIX_C_SOURCE (or _DEFAULT_SOURCE or _GNU_SOURCE) is defined before
+// the first system header is included, as it is by -std=gnu99. Under a strict
+// -std=c99 without them, the thread yields between empty drains instead of
+// sleeping, and ALLOCATOR_LOG_SLEEP_AVAILABLE is 0.
+#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 199309L) || defined(__APPLE__)
+#define ALLOCATOR_LOG_SLEEP_AVAILABLE 1
+#else
+#define ALLOCATOR_LOG_SLEEP_AVAILABLE 0
+#endif
+
+/// The number of records in the ring of each thread. Must be a power of 2.
+#ifndef ALLOCATOR_LOG_RING_SIZE
+#define ALLOCATOR_LOG_RING_SIZE 4096
+#endif
+
+struct AllocatorLogRing {
+    struct AllocatorThreadNode node;
+    struct AllocatorLogRecord records[ALLOCATOR_LOG_RING_SIZE];
+
+    /// Only the owning thread writes `head` and `dropped`,
+    /// and only the draining thread writes `tail`.
+    size_t head;
+    size_t tail;
+    size_t dropped;
+    size_t reported;
+};
+
+static struct AllocatorThreadNode* allocator_log_rings = NULL;
+static ALLOCATOR_THREAD_LOCAL struct AllocatorLogRing* allocator_log_ring = NULL;
+
+static pthread_once_t  allocator_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   allocator_log_key;
+static pthread_mutex_t allocator_log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t       allocator_log_thread;
+static int             allocator_log_running = 0;
+static unsigned        allocator_log_interval_ms = 0;
+
+static void allocator_log_init(void) {
+    pthread_key_create(&allocator_log_key, allocator_thread_exit);
+}
+
+static struct AllocatorLogRing* allocator_log_ring_claim(void) {
+    pthread_once(&allocator_log_once, allocator_log_init);
+    allocator_log_ring = (struct AllocatorLogRing*) allocator_thread_claim(&allocator_log_rings, allocator_log_key, sizeof(struct AllocatorLogRing));
+    return allocator_log_ring;
+}
+
+static inline void allocator_log_push(const struct AllocatorLogRecord* record) {
+    struct AllocatorLogRing* ring = allocator_log_ring;
+    if (ring == NULL && (ring = allocator_log_ring_claim()) == NULL)
+        return;
+
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ALLOCATOR_LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring->records[head & (ALLOCATOR_LOG_RING_SIZE - 1)] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/// Prints the records of every ring, and returns how many were printed.
+static size_t allocator_log_drain(void) {
+    size_t total = 0;
+
+    pthread_mutex_lock(&allocator_log_drain_lock);
+    struct AllocatorThreadNode* node = __atomic_load_n(&allocator_log_rings, __ATOMIC_ACQUIRE);
+    for (; node != NULL; node = node->next) {
+        struct AllocatorLogRing* ring = (struct AllocatorLogRing*) node;
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; ++tail, ++total)
+            allocator_log_print(&ring->records[tail & (ALLOCATOR_LOG_RING_SIZE - 1)]);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        size_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            warnf(LOG_ID_ALLOCATOR, "Allocation trace dropped %zu records\n", dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+    pthread_mutex_unlock(&allocator_log_drain_lock);
+
+    fflush(stdout);
+    return total;
+}
+
+static void* allocator_log_thread_main(void* data) {
+    (void)data;
+#if ALLOCATOR_LOG_SLEEP_AVAILABLE
+    struct timespec interval = {
+            .tv_sec  = allocator_log_interval_ms / 1000,
+            .tv_nsec = (long)(allocator_log_interval_ms % 1000) * 1000000L,
+    };
+#endif
+    while (__atomic_load_n(&allocator_log_running, __ATOMIC_ACQUIRE)) {
+        if (allocator_log_drain() == 0) {
+#if ALLOCATOR_LOG_SLEEP_AVAILABLE
+            nanosleep(&interval, NULL);
+#else
+            sched_yield();
+#endif
+        }
+    }
+    return NULL;
+}
+
+/// Starts a background thread that drains the rings, and sleeps for
+/// `interval_ms` whenever they're empty (or yields, without
+/// ALLOCATOR_LOG_SLEEP_AVAILABLE). Returns 0 on failure.
+static int allocator_log_start(unsigned interval_ms) {
+    if (allocator_log_running)
+        return 1;
+    allocator_log_interval_ms = interval_ms;
+    __atomic_store_n(&allocator_log_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&allocator_log_thread, NULL, allocator_log_thread_main, NULL) != 0) {
+        allocator_log_running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/// Stops the background thread, and prints whatever it left behind.
+static void allocator_log_stop(void) {
+    if (!allocator_log_running)
+        return;
+    __atomic_store_n(&allocator_log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(allocator_log_thread, NULL);
+    allocator_log_drain();
+}
+#endif
+
+
+static inline
+void allocator_log(enum AllocatorMode mode, struct Allocator* allocator, struct SourceLocation location, size_t size, void* memory, size_t old_size, void* result) {
+    if (!log_filter_passes(LOG_INFO, LOG_ID_ALLOCATOR))
+        return;
+
+    struct AllocatorLogRecord record = {
+            .mode     = mode,
+            .id       = allocator->id,
+            .name     = allocator->name,
+            .size     = size,
+            .memory   = memory,
+            .old_size = old_size,
+            .result   = result,
+            .location = location,
+    };
+#ifdef ALLOCATOR_LOG_ASYNC
+    allocator_log_push(&record);
+#else
+    allocator_log_print(&record);
+#endif
+}
 
 
 #define allocate(allocator, size)                     allocate_debug(allocator, size, (struct SourceLocation) { __FILE__, __func__, __LINE__ })
@@ -137,77 +524,89 @@ static _Atomic int allocator_id = 1;
 static inline
 void* allocate_debug(struct Allocator* allocator, size_t size, struct SourceLocation location) {
     void* result = allocator->alloc(allocator->data, size, NULL, 0);
-    logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, location.file, location.line, "%s-%d in '%s' allocated %zu at %p\n", allocator->name, allocator->id, location.func, size, result);
+    if (result != NULL)
+        allocator_stats_count(allocator->id, size, 0);
+    allocator_log(ALLOCATOR_MODE_ALLOCATE, allocator, location, size, NULL, 0, result);
     return result;
 }
 
 static inline
 void* reallocate_debug(struct Allocator* allocator, size_t size, void* memory, size_t old_size, struct SourceLocation location) {
-    void* old_memory = memory;
     void* result = allocator->alloc(allocator->data, size, memory, old_size);
-    logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, location.file, location.line, "%s-%d in '%s' reallocated from %zu to %zu at %p to %p\n", allocator->name, allocator->id, location.func, old_size, size, old_memory, result);
+    if (result != NULL)
+        allocator_stats_count(allocator->id, size, old_size);
+    allocator_log(ALLOCATOR_MODE_REALLOCATE, allocator, location, size, memory, old_size, result);
     return result;
 }
 
 static inline
 void* deallocate_debug(struct Allocator* allocator, void* memory, size_t old_size, struct SourceLocation location) {
     void* result = allocator->alloc(allocator->data, 0, memory, old_size);
-    logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, location.file, location.line, "%s-%d in '%s' deallocated %zu at %p\n", allocator->name, allocator->id, location.func, old_size, memory);
+    allocator_stats_count(allocator->id, 0, old_size);
+    allocator_log(ALLOCATOR_MODE_DEALLOCATE, allocator, location, 0, memory, old_size, result);
     return result;
 }
 
 static inline
 void* reserve_all_debug(struct Allocator* allocator, struct SourceLocation location) {
     void* result = allocator->alloc(allocator->data, 0, NULL, 0);
-    logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, location.file, location.line, "%s-%d in '%s' reserved all at %p\n", allocator->name, allocator->id, location.func, result);
+    allocator_log(ALLOCATOR_MODE_RESERVE_ALL, allocator, location, 0, NULL, 0, result);
     return result;
 }
 
 static inline
 void* reset_all_debug(struct Allocator* allocator, struct SourceLocation location) {
     void* result = allocator->alloc(allocator->data, 0, NULL, 1);
-    logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, location.file, location.line, "%s-%d in '%s' reset all (%zu bytes)\n", allocator->name, allocator->id, location.func, (size_t) result);
+    allocator_stats_clear(allocator->id);
+    allocator_log(ALLOCATOR_MODE_RESET_ALL, allocator, location, 0, NULL, 1, result);
     return result;
 }
 
 static inline
 void* release_debug(struct Allocator* allocator, struct SourceLocation location) {
     void* result = allocator->alloc(allocator->data, 0, (void*)1, 0);
-    logf_at_source(LOG_INFO, LOG_ID_ALLOCATOR, location.file, location.line, "'%s' released all (%zu bytes)\n", location.func, (size_t) result);
+    allocator_stats_clear(allocator->id);
+    allocator_log(ALLOCATOR_MODE_RELEASE, allocator, location, 0, (void*)1, 0, result);
     *allocator = (struct Allocator) { 0 };
     return result;
 }
 
 
 
+/// Asserts that everything allocated from the system allocator has been deallocated.
 static inline void allocator_assert_no_memory_leak(void) {
-    int total = total_allocated - total_deallocated + total_reallocated;
-    assertf(LOG_ID_ALLOCATOR, total == 0,
+    struct AllocatorStats stats = allocator_stats_of(0);
+    assertf(LOG_ID_ALLOCATOR, stats.live == 0,
             "Memory leak detected:\n"
-            "   +%d bytes allocated\n"
-            "   -%d bytes deallocated\n"
-            "   %d bytes reallocated\n"
-            "   = %d bytes\n",
-            total_allocated, total_deallocated, total_reallocated, total);
+            "   +%llu bytes allocated\n"
+            "   -%llu bytes deallocated\n"
+            "   = %llu bytes\n",
+            (unsigned long long) stats.allocated, (unsigned long long) stats.deallocated, (unsigned long long) stats.live);
 }
 
-#define allocator_report_memory_usage() infof(LOG_ID_ALLOCATOR, "current usage is %d\n", total_allocated - total_deallocated + total_reallocated)
+static inline void allocator_report_stats(const char* name, int id) {
+    struct AllocatorStats stats = allocator_stats_of(id);
+    infof(LOG_ID_ALLOCATOR, "%s-%d: %llu bytes live (%llu peak), %llu allocations, %llu deallocations\n",
+          name, id, (unsigned long long) stats.live, (unsigned long long) stats.peak,
+          (unsigned long long) stats.allocations, (unsigned long long) stats.deallocations);
+    for (size_t i = 0; i < ALLOCATOR_STATS_BUCKETS; ++i) {
+        if (stats.histogram[i] != 0)
+            infof(LOG_ID_ALLOCATOR, "    %20llu bytes or more: %llu\n", 1ULL << i, (unsigned long long) stats.histogram[i]);
+    }
+}
 
+/// Reports the memory usage of the system allocator.
+static inline void allocator_report_memory_usage(void) {
+    allocator_report_stats("allocator_system", 0);
+}
 
-#else
-static inline enum AllocatorMode allocator_mode(size_t size, void* memory, size_t old_size) {
-    if (old_size == 0) {
-        return ALLOCATOR_MODE_ALLOCATE;
-    } else if (size != 0 && old_size != 0) {
-        return ALLOCATOR_MODE_REALLOCATE;
-    } else if (size == 0) {
-        return ALLOCATOR_MODE_DEALLOCATE;
-    } else {
-        errorf("Invalid allocator call with size=%zu, memory=%p, old_size=%zu", size, memory, old_size);
-        return -1;
-    }
+/// Reports the memory usage of any allocator.
+static inline void allocator_report_memory_usage_of(const struct Allocator* allocator) {
+    allocator_report_stats(allocator->name, allocator->id);
 }
 
+
+#else
 static inline
 void* allocate(struct Allocator* allocator, size_t size) {
     return allocator->alloc(allocator->data, size, NULL, 0);
@@ -223,8 +622,26 @@ void* deallocate(struct Allocator* allocator, void* memory, size_t old_size) {
     return allocator->alloc(allocator->data, 0, memory, old_size);
 }
 
+static inline
+void* allocator_reserve_all(struct Allocator* allocator) {
+    return allocator->alloc(allocator->data, 0, NULL, 0);
+}
+
+static inline
+void* allocator_reset_all(struct Allocator* allocator) {
+    return allocator->alloc(allocator->data, 0, NULL, 1);
+}
+
+static inline
+void* allocator_release(struct Allocator* allocator) {
+    void* result = allocator->alloc(allocator->data, 0, (void*)1, 0);
+    *allocator = (struct Allocator) { 0 };
+    return result;
+}
+
 #define allocator_assert_no_memory_leak()
 #define allocator_report_memory_usage()
+#define allocator_report_memory_usage_of(allocator)
 
 #endif
 
@@ -234,13 +651,10 @@ void* allocator_system_alloc(void* data, size_t size, void* memory, size_t old_s
     (void)data;
     switch (allocator_mode(size, memory, old_size)) {
         case ALLOCATOR_MODE_ALLOCATE:
-            total_allocated += size;
             return malloc(size);
         case ALLOCATOR_MODE_REALLOCATE:
-            total_reallocated += size - old_size;
             return realloc(memory, size);
         case ALLOCATOR_MODE_DEALLOCATE: {
-            total_deallocated += old_size;
             free(memory);
             return (void*) old_size;
         }
@@ -304,9 +718,21 @@ void* allocator_stack_alloc(void* data, size_t size, void* memory, size_t old_si
             allocator->top->size += size;
             return result;
         }
-        case ALLOCATOR_MODE_REALLOCATE:
-            errorf(LOG_ID_ALLOCATOR, "Not implemented");
-            break;
+        case ALLOCATOR_MODE_REALLOCATE: {
+            unsigned char* end = (unsigned char*)(allocator->top->data) + allocator->top->size;
+            if (memory == NULL || (unsigned char*)memory + old_size != end) {
+                // Anything below the top already fits when it shrinks, but can't grow.
+                // Returning NULL lets the caller fall back to allocating and copying.
+                return (memory != NULL && size <= old_size) ? memory : NULL;
+            }
+
+            // The top allocation grows or shrinks in place, as long as it fits the chunk.
+            size_t start = allocator->top->size - old_size;
+            if (start + size >= allocator->max_size)
+                return NULL;
+            allocator->top->size = start + size;
+            return memory;
+        }
         case ALLOCATOR_MODE_DEALLOCATE:
             assertf(LOG_ID_ALLOCATOR, allocator->top->size >= old_size, "Stack allocator can't deallocate more than %zu bytes (%zu bytes requested)", allocator->top->size, old_size);
             allocator->top->size -= old_size;
@@ -317,11 +743,23 @@ void* allocator_stack_alloc(void* data, size_t size, void* memory, size_t old_si
             }
             return (void*) old_size;
         case ALLOCATOR_MODE_RESERVE_ALL:
-            errorf(LOG_ID_ALLOCATOR, "Not implemented");
-            break;
-        case ALLOCATOR_MODE_RESET_ALL:
+            // The rest of the top chunk, which stays free until it's
+            // allocated. The next allocation that fits starts here.
+            return (unsigned char*)(allocator->top->data) + allocator->top->size;
+        case ALLOCATOR_MODE_RESET_ALL: {
+            // Everything becomes free again, and the chunks after
+            // the first one go back to the parent.
+            size_t total_size = 0;
+            while (allocator->top->previous != NULL) {
+                struct AllocatorStackChunk* previous = allocator->top->previous;
+                total_size += allocator->top->size;
+                deallocate(allocator->parent, allocator->top, sizeof(struct AllocatorStackChunk) + allocator->max_size);
+                allocator->top = previous;
+            }
+            total_size += allocator->top->size;
             allocator->top->size = 0;
-            break;
+            return (void*) total_size;
+        }
         case ALLOCATOR_MODE_RELEASE: {
             size_t total_size = 0;
             while (allocator->top != NULL) {
@@ -365,13 +803,712 @@ struct Allocator allocator_stack_new(struct Allocator* parent, size_t max_size)
 
 
 
+/// The smallest block the pool hands out is `1 << ALLOCATOR_POOL_MIN_SHIFT`
+/// bytes, and each size class is twice as large as the one before it.
+#define ALLOCATOR_POOL_MIN_SHIFT 4
+#define ALLOCATOR_POOL_CLASSES   16
+
+/// Size classes are carved out of slabs of at least this size. Blocks larger
+/// than the last size class are allocated from the parent one by one.
+#define ALLOCATOR_POOL_SLAB_SIZE (64 * 1024)
+
+struct AllocatorPool {
+    struct Allocator* parent;
+
+    /// The freed blocks of each size class, linked through their first bytes.
+    struct AllocatorPoolBlock {
+        struct AllocatorPoolBlock* next;
+    }* free[ALLOCATOR_POOL_CLASSES];
+
+    struct AllocatorPoolSlab {
+        struct AllocatorPoolSlab* next;
+        size_t size;
+        size_t size_class;
+        size_t padding;
+    }* slabs;
+
+    /// Blocks larger than the size classes, which are
+    /// tracked so they can be released all at once.
+    struct AllocatorPoolLarge {
+        struct AllocatorPoolLarge* next;
+        struct AllocatorPoolLarge* previous;
+        size_t size;
+        size_t padding;
+    }* large;
+};
+
+static inline size_t allocator_pool_size_class(size_t size) {
+    size_t size_class = 0;
+    while (((size_t)1 << (size_class + ALLOCATOR_POOL_MIN_SHIFT)) < size)
+        ++size_class;
+    return size_class;
+}
+
+static inline size_t allocator_pool_block_size(size_t size_class) {
+    return (size_t)1 << (size_class + ALLOCATOR_POOL_MIN_SHIFT);
+}
+
+/// Threads all blocks of the slab onto the free list of its size class.
+static inline void allocator_pool_thread_slab(struct AllocatorPool* allocator, struct AllocatorPoolSlab* slab) {
+    size_t block_size = allocator_pool_block_size(slab->size_class);
+    size_t count      = (slab->size - sizeof(struct AllocatorPoolSlab)) / block_size;
+    unsigned char* blocks = (unsigned char*)(slab + 1);
+
+    for (size_t i = count; i > 0; --i) {
+        struct AllocatorPoolBlock* block = (struct AllocatorPoolBlock*)(blocks + (i - 1) * block_size);
+        block->next = allocator->free[slab->size_class];
+        allocator->free[slab->size_class] = block;
+    }
+}
+
+static void* allocator_pool_allocate(struct AllocatorPool* allocator, size_t size) {
+    size_t size_class = allocator_pool_size_class(size);
+
+    if (size_class >= ALLOCATOR_POOL_CLASSES) {
+        struct AllocatorPoolLarge* large = allocate(allocator->parent, sizeof(struct AllocatorPoolLarge) + size);
+        if (large == NULL)
+            return NULL;
+
+        large->next     = allocator->large;
+        large->previous = NULL;
+        large->size     = size;
+        if (allocator->large != NULL)
+            allocator->large->previous = large;
+        allocator->large = large;
+        return large + 1;
+    }
+
+    if (allocator->free[size_class] == NULL) {
+        size_t block_size = allocator_pool_block_size(size_class);
+        size_t slab_size  = sizeof(struct AllocatorPoolSlab) + (block_size < ALLOCATOR_POOL_SLAB_SIZE ? ALLOCATOR_POOL_SLAB_SIZE : block_size);
+
+        struct AllocatorPoolSlab* slab = allocate(allocator->parent, slab_size);
+        if (slab == NULL)
+            return NULL;
+
+        slab->next       = allocator->slabs;
+        slab->size       = slab_size;
+        slab->size_class = size_class;
+        allocator->slabs = slab;
+        allocator_pool_thread_slab(allocator, slab);
+    }
+
+    struct AllocatorPoolBlock* block = allocator->free[size_class];
+    allocator->free[size_class] = block->next;
+    return block;
+}
+
+static void allocator_pool_deallocate(struct AllocatorPool* allocator, void* memory, size_t size) {
+    size_t size_class = allocator_pool_size_class(size);
+
+    if (size_class >= ALLOCATOR_POOL_CLASSES) {
+        struct AllocatorPoolLarge* large = (struct AllocatorPoolLarge*)memory - 1;
+        if (large->previous != NULL)
+            large->previous->next = large->next;
+        else
+            allocator->large = large->next;
+        if (large->next != NULL)
+            large->next->previous = large->previous;
+        deallocate(allocator->parent, large, sizeof(struct AllocatorPoolLarge) + large->size);
+        return;
+    }
+
+    struct AllocatorPoolBlock* block = (struct AllocatorPoolBlock*)memory;
+    block->next = allocator->free[size_class];
+    allocator->free[size_class] = block;
+}
+
+/// Deallocates the large blocks, and returns how much memory they used.
+static size_t allocator_pool_release_large(struct AllocatorPool* allocator) {
+    size_t total_size = 0;
+    while (allocator->large != NULL) {
+        struct AllocatorPoolLarge* next = allocator->large->next;
+        total_size += sizeof(struct AllocatorPoolLarge) + allocator->large->size;
+        deallocate(allocator->parent, allocator->large, sizeof(struct AllocatorPoolLarge) + allocator->large->size);
+        allocator->large = next;
+    }
+    return total_size;
+}
+
+void* allocator_pool_alloc(void* data, size_t size, void* memory, size_t old_size) {
+    struct AllocatorPool* allocator = (struct AllocatorPool*) data;
+
+    switch (allocator_mode(size, memory, old_size)) {
+        case ALLOCATOR_MODE_ALLOCATE:
+            return allocator_pool_allocate(allocator, size);
+        case ALLOCATOR_MODE_REALLOCATE: {
+            // Blocks in the same size class already fit.
+            size_t size_class = allocator_pool_size_class(size);
+            if (size_class < ALLOCATOR_POOL_CLASSES && size_class == allocator_pool_size_class(old_size))
+                return memory;
+
+            void* result = allocator_pool_allocate(allocator, size);
+            if (result == NULL)
+                return NULL;
+            memcpy(result, memory, size < old_size ? size : old_size);
+            allocator_pool_deallocate(allocator, memory, old_size);
+            return result;
+        }
+        case ALLOCATOR_MODE_DEALLOCATE:
+            allocator_pool_deallocate(allocator, memory, old_size);
+            return (void*) old_size;
+        case ALLOCATOR_MODE_RESERVE_ALL:
+            errorf(LOG_ID_ALLOCATOR, "Not implemented");
+            break;
+        case ALLOCATOR_MODE_RESET_ALL: {
+            // Everything in the slabs becomes free again, but the
+            // slabs are kept around to be reused.
+            size_t total_size = allocator_pool_release_large(allocator);
+            memset(allocator->free, 0, sizeof(allocator->free));
+            for (struct AllocatorPoolSlab* slab = allocator->slabs; slab != NULL; slab = slab->next) {
+                allocator_pool_thread_slab(allocator, slab);
+                total_size += slab->size;
+            }
+            return (void*) total_size;
+        }
+        case ALLOCATOR_MODE_RELEASE: {
+            size_t total_size = allocator_pool_release_large(allocator);
+            while (allocator->slabs != NULL) {
+                struct AllocatorPoolSlab* next = allocator->slabs->next;
+                total_size += allocator->slabs->size;
+                deallocate(allocator->parent, allocator->slabs, allocator->slabs->size);
+                allocator->slabs = next;
+            }
+            total_size += (size_t) deallocate(allocator->parent, allocator, sizeof(struct AllocatorPool));
+            return (void*) total_size;
+        }
+    }
+    errorf(LOG_ID_ALLOCATOR, "Not implemented");
+    return NULL;
+}
+
+struct Allocator allocator_pool_new(struct Allocator* parent) {
+    struct AllocatorPool* result = allocate(parent, sizeof(struct AllocatorPool));
+    if (result != NULL) {
+        memset(result, 0, sizeof(struct AllocatorPool));
+        result->parent = parent;
+    }
+
+    return (struct Allocator) {
+            .data = result,
+            .alloc = result != NULL ? allocator_pool_alloc : NULL,
+            ALLOCATOR_DEBUG_BLOCK(
+                    .name = "allocator_pool",
+                    .id = allocator_id++,
+            )
+    };
+}
+
+
+
+/// Allocations from an arena are rounded up to this alignment.
+#define ALLOCATOR_ARENA_ALIGNMENT 16
 
+/// An arena that gives each thread its own chunks, taken from a shared parent.
+///
+/// Each thread gets a handle of its own with `allocator_arena_thread`, and
+/// only ever allocates through that handle. Allocating is a pointer bump in
+/// the chunk of the thread, and resetting the handle makes all of its chunks
+/// free again in O(1), without returning them to the parent. Only refilling
+/// a thread with a new chunk takes the lock of the arena.
+///
+/// The arena itself can't allocate. Resetting or releasing it resets or
+/// releases every thread, so it must only be done when the threads are idle.
+struct AllocatorArena {
+    struct Allocator* parent;
+    size_t chunk_size;
 
+    /// Guards the parent and the list of threads.
+    atomic_flag lock;
+    struct AllocatorArenaThread* threads;
+};
 
+struct AllocatorArenaThread {
+    struct AllocatorArena* arena;
+    struct AllocatorArenaThread* next;
 
+    /// The chunks of the thread. Those after `current` are
+    /// unused and kept around to be reused after a reset.
+    struct AllocatorArenaChunk {
+        struct AllocatorArenaChunk* next;
+        size_t size;
+    }* first;
+    struct AllocatorArenaChunk* current;
+    size_t used;
+};
 
+static inline void allocator_arena_lock(struct AllocatorArena* arena) {
+    while (atomic_flag_test_and_set_explicit(&arena->lock, memory_order_acquire))
+        ;
+}
 
+static inline void allocator_arena_unlock(struct AllocatorArena* arena) {
+    atomic_flag_clear_explicit(&arena->lock, memory_order_release);
+}
+
+static inline size_t allocator_arena_align(size_t size) {
+    return (size + ALLOCATOR_ARENA_ALIGNMENT - 1) & ~(size_t)(ALLOCATOR_ARENA_ALIGNMENT - 1);
+}
 
+static inline unsigned char* allocator_arena_chunk_data(struct AllocatorArenaChunk* chunk) {
+    return (unsigned char*)chunk + allocator_arena_align(sizeof(struct AllocatorArenaChunk));
+}
+
+/// Moves the thread on to a chunk with room for `size` bytes, reusing the
+/// next chunk if it's large enough, and otherwise taking one from the parent.
+static void* allocator_arena_refill(struct AllocatorArenaThread* thread, size_t size) {
+    struct AllocatorArenaChunk* next = thread->current->next;
 
+    if (next == NULL || next->size < size) {
+        struct AllocatorArena* arena = thread->arena;
+        size_t chunk_size = size < arena->chunk_size ? arena->chunk_size : size;
 
+        allocator_arena_lock(arena);
+        next = allocate(arena->parent, allocator_arena_align(sizeof(struct AllocatorArenaChunk)) + chunk_size);
+        allocator_arena_unlock(arena);
+        if (next == NULL)
+            return NULL;
+
+        next->next = thread->current->next;
+        next->size = chunk_size;
+        thread->current->next = next;
+    }
+
+    thread->current = next;
+    thread->used    = size;
+    return allocator_arena_chunk_data(next);
+}
+
+static inline void* allocator_arena_allocate(struct AllocatorArenaThread* thread, size_t size) {
+    size = allocator_arena_align(size);
+    if (thread->used + size > thread->current->size)
+        return allocator_arena_refill(thread, size);
+
+    void* result = allocator_arena_chunk_data(thread->current) + thread->used;
+    thread->used += size;
+    return result;
+}
+
+/// Returns whether the memory is the most recent allocation of the thread.
+static inline int allocator_arena_is_top(struct AllocatorArenaThread* thread, void* memory, size_t size) {
+    return (unsigned char*)memory + allocator_arena_align(size) == allocator_arena_chunk_data(thread->current) + thread->used;
+}
+
+/// Returns the chunks of the thread to the parent, and returns how
+/// much memory they used. The arena must be locked.
+static size_t allocator_arena_release_chunks(struct AllocatorArena* arena, struct AllocatorArenaThread* thread) {
+    size_t total_size = 0;
+    while (thread->first != NULL) {
+        struct AllocatorArenaChunk* next = thread->first->next;
+        total_size += (size_t) deallocate(arena->parent, thread->first, allocator_arena_align(sizeof(struct AllocatorArenaChunk)) + thread->first->size);
+        thread->first = next;
+    }
+    return total_size;
+}
+
+void* allocator_arena_thread_alloc(void* data, size_t size, void* memory, size_t old_size) {
+    struct AllocatorArenaThread* thread = (struct AllocatorArenaThread*) data;
+
+    switch (allocator_mode(size, memory, old_size)) {
+        case ALLOCATOR_MODE_ALLOCATE:
+            return allocator_arena_allocate(thread, size);
+        case ALLOCATOR_MODE_REALLOCATE: {
+            // The most recent allocation can grow or shrink in place.
+            if (memory != NULL && allocator_arena_is_top(thread, memory, old_size)) {
+                size_t start = (size_t)((unsigned char*)memory - allocator_arena_chunk_data(thread->current));
+                if (start + allocator_arena_align(size) <= thread->current->size) {
+                    thread->used = start + allocator_arena_align(size);
+                    return memory;
+                }
+            }
+
+            void* result = allocator_arena_allocate(thread, size);
+            if (result != NULL && memory != NULL)
+                memcpy(result, memory, size < old_size ? size : old_size);
+            return result;
+        }
+        case ALLOCATOR_MODE_DEALLOCATE:
+            // Only the most recent allocation is given back,
+            // everything else is freed by the next reset.
+            if (allocator_arena_is_top(thread, memory, old_size))
+                thread->used -= allocator_arena_align(old_size);
+            return (void*) old_size;
+        case ALLOCATOR_MODE_RESERVE_ALL:
+            errorf(LOG_ID_ALLOCATOR, "Not implemented");
+            break;
+        case ALLOCATOR_MODE_RESET_ALL: {
+            size_t total_size = 0;
+            for (struct AllocatorArenaChunk* chunk = thread->first; chunk != thread->current; chunk = chunk->next)
+                total_size += chunk->size;
+            total_size += thread->used;
+
+            thread->current = thread->first;
+            thread->used    = 0;
+            return (void*) total_size;
+        }
+        case ALLOCATOR_MODE_RELEASE: {
+            struct AllocatorArena* arena = thread->arena;
+
+            allocator_arena_lock(arena);
+            struct AllocatorArenaThread** link = &arena->threads;
+            while (*link != thread)
+                link = &(*link)->next;
+            *link = thread->next;
+
+            size_t total_size = allocator_arena_release_chunks(arena, thread);
+            total_size += (size_t) deallocate(arena->parent, thread, sizeof(struct AllocatorArenaThread));
+            allocator_arena_unlock(arena);
+            return (void*) total_size;
+        }
+    }
+    errorf(LOG_ID_ALLOCATOR, "Not implemented");
+    return NULL;
+}
+
+void* allocator_arena_alloc(void* data, size_t size, void* memory, size_t old_size) {
+    struct AllocatorArena* arena = (struct AllocatorArena*) data;
+
+    switch (allocator_mode(size, memory, old_size)) {
+        case ALLOCATOR_MODE_ALLOCATE:
+        case ALLOCATOR_MODE_REALLOCATE:
+        case ALLOCATOR_MODE_DEALLOCATE:
+            errorf(LOG_ID_ALLOCATOR, "Allocate from the handle returned by allocator_arena_thread");
+            return NULL;
+        case ALLOCATOR_MODE_RESERVE_ALL:
+            errorf(LOG_ID_ALLOCATOR, "Not implemented");
+            break;
+        case ALLOCATOR_MODE_RESET_ALL: {
+            size_t total_size = 0;
+            for (struct AllocatorArenaThread* thread = arena->threads; thread != NULL; thread = thread->next)
+                total_size += (size_t) allocator_arena_thread_alloc(thread, 0, NULL, 1);
+            return (void*) total_size;
+        }
+        case ALLOCATOR_MODE_RELEASE: {
+            size_t total_size = 0;
+            while (arena->threads != NULL) {
+                struct AllocatorArenaThread* next = arena->threads->next;
+                total_size += allocator_arena_release_chunks(arena, arena->threads);
+                total_size += (size_t) deallocate(arena->parent, arena->threads, sizeof(struct AllocatorArenaThread));
+                arena->threads = next;
+            }
+            total_size += (size_t) deallocate(arena->parent, arena, sizeof(struct AllocatorArena));
+            return (void*) total_size;
+        }
+    }
+    errorf(LOG_ID_ALLOCATOR, "Not implemented");
+    return NULL;
+}
+
+/// The parent must be safe to use from the thread that calls `allocator_arena_thread`
+/// and whichever thread refills, as the arena only serializes its own calls to it.
+struct Allocator allocator_arena_new(struct Allocator* parent, size_t chunk_size) {
+    struct AllocatorArena* result = allocate(parent, sizeof(struct AllocatorArena));
+    if (result != NULL) {
+        result->parent     = parent;
+        result->chunk_size = chunk_size;
+        result->threads    = NULL;
+        atomic_flag_clear(&result->lock);
+    }
+
+    return (struct Allocator) {
+            .data = result,
+            .alloc = result != NULL ? allocator_arena_alloc : NULL,
+            ALLOCATOR_DEBUG_BLOCK(
+                    .name = "allocator_arena",
+                    .id = allocator_id++,
+            )
+    };
+}
+
+/// Returns a handle for the calling thread to allocate from the arena with.
+/// The handle must not be shared between threads.
+struct Allocator allocator_arena_thread(struct Allocator* allocator) {
+    struct AllocatorArena* arena = (struct AllocatorArena*) allocator->data;
+
+    allocator_arena_lock(arena);
+    struct AllocatorArenaThread* result = allocate(arena->parent, sizeof(struct AllocatorArenaThread));
+    struct AllocatorArenaChunk*  chunk  = result != NULL ? allocate(arena->parent, allocator_arena_align(sizeof(struct AllocatorArenaChunk)) + arena->chunk_size) : NULL;
+    if (result != NULL && chunk == NULL) {
+        deallocate(arena->parent, result, sizeof(struct AllocatorArenaThread));
+        result = NULL;
+    }
+    if (result != NULL) {
+        chunk->next = NULL;
+        chunk->size = arena->chunk_size;
+        *result = (struct AllocatorArenaThread) {
+                .arena   = arena,
+                .next    = arena->threads,
+                .first   = chunk,
+                .current = chunk,
+                .used    = 0,
+        };
+        arena->threads = result;
+    }
+    allocator_arena_unlock(arena);
+
+    return (struct Allocator) {
+            .data = result,
+            .alloc = result != NULL ? allocator_arena_thread_alloc : NULL,
+            ALLOCATOR_DEBUG_BLOCK(
+                    .name = "allocator_arena_thread",
+                    .id = allocator_id++,
+            )
+    };
+}
+
+
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+// The virtual allocator needs anonymous mappings, which glibc only declares
+// (like madvise and syscall) when _DEFAULT_SOURCE or _GNU_SOURCE is defined
+// before the first system header is included, as it is by -std=gnu99. Under
+// a strict -std=c99 without them, the allocator is left out, and
+// ALLOCATOR_VIRTUAL_AVAILABLE is 0.
+#if (defined(__unix__) || defined(__APPLE__)) && defined(MAP_ANONYMOUS)
+#define ALLOCATOR_VIRTUAL_AVAILABLE 1
+#else
+#define ALLOCATOR_VIRTUAL_AVAILABLE 0
+#endif
+
+#if ALLOCATOR_VIRTUAL_AVAILABLE
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+enum AllocatorVirtualFlags {
+    ALLOCATOR_VIRTUAL_NONE       = 0,
+    /// Ask for transparent huge pages with `MADV_HUGEPAGE`.
+    ALLOCATOR_VIRTUAL_HUGEPAGES  = 1 << 0,
+    /// Back the reservation by the preallocated huge pages of `MAP_HUGETLB`,
+    /// falling back to regular pages if there aren't enough of them.
+    ALLOCATOR_VIRTUAL_HUGETLB    = 1 << 1,
+    /// Put the pages on the NUMA node of the thread that touches them first.
+    ALLOCATOR_VIRTUAL_NUMA_LOCAL = 1 << 2,
+};
+
+/// The reservation is committed in steps of this size, which is the
+/// size of a huge page on most systems, or of the huge pages if
+/// they're larger with `ALLOCATOR_VIRTUAL_HUGETLB`.
+#define ALLOCATOR_VIRTUAL_COMMIT_SIZE (2 * 1024 * 1024)
+#define ALLOCATOR_VIRTUAL_ALIGNMENT   16
+
+/// An allocator that reserves a range of virtual memory up front and
+/// commits it in steps as the allocations reach into it.
+///
+/// Allocations are bumped from the start of the range, so the most recent
+/// one can grow in place until the reservation runs out. A hashmap that's
+/// the last thing allocated therefore grows without ever being copied.
+/// Only the most recent allocation is given back by DEALLOCATE, and
+/// RESET_ALL returns the physical pages to the system but keeps the range.
+///
+/// The allocator lives at the start of its own range.
+struct AllocatorVirtual {
+    unsigned char* base;
+    size_t reserved;
+    size_t committed;
+    size_t used;
+    /// The size of the pages the range is mapped with, which
+    /// every range given to mprotect and madvise is aligned to.
+    size_t page_size;
+    int    flags;
+};
+
+static inline size_t allocator_virtual_align(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/// Returns the size of the huge pages of `MAP_HUGETLB`, which is the
+/// default huge page size of the system, or 0 if it can't be told.
+static size_t allocator_virtual_huge_page_size(void) {
+#if defined(__linux__)
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file == NULL)
+        return 0;
+
+    char   line[128];
+    size_t kilobytes = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kilobytes) == 1)
+            break;
+    }
+    fclose(file);
+    return kilobytes * 1024;
+#else
+    return 0;
+#endif
+}
+
+/// Makes sure the first `size` bytes of the range are committed.
+static int allocator_virtual_commit(struct AllocatorVirtual* allocator, size_t size) {
+    if (size <= allocator->committed)
+        return 1;
+    if (size > allocator->reserved)
+        return 0;
+
+    size_t step      = (allocator->page_size > ALLOCATOR_VIRTUAL_COMMIT_SIZE) ? allocator->page_size : ALLOCATOR_VIRTUAL_COMMIT_SIZE;
+    size_t committed = allocator_virtual_align(size, step);
+    if (committed > allocator->reserved)
+        committed = allocator->reserved;
+
+    unsigned char* start  = allocator->base + allocator->committed;
+    size_t         length = committed - allocator->committed;
+    if (mprotect(start, length, PROT_READ | PROT_WRITE) != 0) {
+        warnf(LOG_ID_ALLOCATOR, "Virtual allocator failed to commit %zu bytes", length);
+        return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    if (allocator->flags & ALLOCATOR_VIRTUAL_HUGEPAGES)
+        madvise(start, length, MADV_HUGEPAGE);
+#endif
+
+    allocator->committed = committed;
+    return 1;
+}
+
+static void* allocator_virtual_allocate(struct AllocatorVirtual* allocator, size_t size) {
+    size_t start = allocator_virtual_align(allocator->used, ALLOCATOR_VIRTUAL_ALIGNMENT);
+    if (size > allocator->reserved - start || !allocator_virtual_commit(allocator, start + size)) {
+        warnf(LOG_ID_ALLOCATOR, "Virtual allocator can't allocate %zu bytes (%zu of %zu bytes used)", size, allocator->used, allocator->reserved);
+        return NULL;
+    }
+
+    allocator->used = start + size;
+    return allocator->base + start;
+}
+
+void* allocator_virtual_alloc(void* data, size_t size, void* memory, size_t old_size) {
+    struct AllocatorVirtual* allocator = (struct AllocatorVirtual*) data;
+
+    switch (allocator_mode(size, memory, old_size)) {
+        case ALLOCATOR_MODE_ALLOCATE:
+            return allocator_virtual_allocate(allocator, size);
+        case ALLOCATOR_MODE_REALLOCATE: {
+            // The most recent allocation grows or shrinks in place.
+            if (memory != NULL && (unsigned char*)memory + old_size == allocator->base + allocator->used) {
+                size_t start = (size_t)((unsigned char*)memory - allocator->base);
+                if (size > allocator->reserved - start || !allocator_virtual_commit(allocator, start + size))
+                    return NULL;
+                allocator->used = start + size;
+                return memory;
+            }
+            if (memory != NULL && size <= old_size)
+                return memory;
+
+            void* result = allocator_virtual_allocate(allocator, size);
+            if (result != NULL && memory != NULL)
+                memcpy(result, memory, old_size);
+            return result;
+        }
+        case ALLOCATOR_MODE_DEALLOCATE:
+            if ((unsigned char*)memory + old_size == allocator->base + allocator->used)
+                allocator->used -= old_size;
+            return (void*) old_size;
+        case ALLOCATOR_MODE_RESERVE_ALL:
+            // The rest of the reservation, which stays free until it's allocated.
+            return allocator->base + allocator_virtual_align(allocator->used, ALLOCATOR_VIRTUAL_ALIGNMENT);
+        case ALLOCATOR_MODE_RESET_ALL: {
+            // Everything after the page of the allocator itself goes back to
+            // the system, but stays committed, so the range is zero-filled on
+            // next touch. Both ends are aligned to the (huge) pages, as hugetlb
+            // mappings can only be decommitted in whole pages.
+            size_t total_size = allocator->used - sizeof(struct AllocatorVirtual);
+            size_t keep       = allocator_virtual_align(sizeof(struct AllocatorVirtual), allocator->page_size);
+            if (allocator->committed > keep) {
+                unsigned char* start  = allocator->base + keep;
+                size_t         length = allocator->committed - keep;
+#ifdef MADV_DONTNEED
+                madvise(start, length, MADV_DONTNEED);
+#else
+                // Mapping fresh pages over the range drops the old ones.
+                int hugetlb = 0;
+#ifdef MAP_HUGETLB
+                hugetlb = (allocator->flags & ALLOCATOR_VIRTUAL_HUGETLB) ? MAP_HUGETLB : 0;
+#endif
+                mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | hugetlb, -1, 0);
+#endif
+            }
+            allocator->used = sizeof(struct AllocatorVirtual);
+            return (void*) total_size;
+        }
+        case ALLOCATOR_MODE_RELEASE: {
+            size_t total_size = allocator->reserved;
+            munmap(allocator->base, allocator->reserved);
+            return (void*) total_size;
+        }
+    }
+    errorf(LOG_ID_ALLOCATOR, "Not implemented");
+    return NULL;
+}
+
+/// Reserves `reserve_size` bytes of virtual memory, without using any
+/// physical memory until the allocations are touched.
+struct Allocator allocator_virtual_new(size_t reserve_size, int flags) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    void*  base      = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    size_t huge_page_size = (flags & ALLOCATOR_VIRTUAL_HUGETLB) ? allocator_virtual_huge_page_size() : 0;
+    if (huge_page_size != 0) {
+        // Without MAP_NORESERVE, the huge pages are claimed up front, so
+        // running out of them fails here instead of faulting on touch.
+        size_t huge_reserve_size = allocator_virtual_align(reserve_size, huge_page_size);
+        base = mmap(NULL, huge_reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            page_size    = huge_page_size;
+            reserve_size = huge_reserve_size;
+        }
+    }
+    if (base == MAP_FAILED && (flags & ALLOCATOR_VIRTUAL_HUGETLB))
+        warnf(LOG_ID_ALLOCATOR, "Virtual allocator couldn't map huge pages, falling back to regular pages");
+#endif
+    if (base == MAP_FAILED) {
+        flags       &= ~ALLOCATOR_VIRTUAL_HUGETLB;
+        reserve_size = allocator_virtual_align(reserve_size, page_size);
+        base = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+
+    struct AllocatorVirtual* result = NULL;
+    if (base != MAP_FAILED) {
+#if defined(__linux__) && defined(SYS_mbind)
+        // MPOL_LOCAL, from <numaif.h>.
+        if (flags & ALLOCATOR_VIRTUAL_NUMA_LOCAL)
+            syscall(SYS_mbind, base, reserve_size, 4, NULL, 0, 0);
+#endif
+        struct AllocatorVirtual allocator = {
+                .base      = base,
+                .reserved  = reserve_size,
+                .committed = 0,
+                .used      = sizeof(struct AllocatorVirtual),
+                .page_size = page_size,
+                .flags     = flags,
+        };
+        if (allocator_virtual_commit(&allocator, allocator.used)) {
+            result  = (struct AllocatorVirtual*) base;
+            *result = allocator;
+        } else {
+            munmap(base, reserve_size);
+        }
+    } else {
+        warnf(LOG_ID_ALLOCATOR, "Virtual allocator couldn't reserve %zu bytes", reserve_size);
+    }
+
+    return (struct Allocator) {
+            .data = result,
+            .alloc = result != NULL ? allocator_virtual_alloc : NULL,
+            ALLOCATOR_DEBUG_BLOCK(
+                    .name = "allocator_virtual",
+                    .id = allocator_id++,
+            )
+    };
+}
+#endif
 
@@ -0,0 +1,363 @@
+// Regression tests for the allocators, run by ctest, with the hashmap built
+// on top of them (ALLOCATOR). Each test returns the number of failed checks,
+// and main returns nonzero if any of them failed. With ALLOCATOR_DEBUG, it
+// also asserts that everything taken from the system was given back, and
+// with ALLOCATOR_LOG_ASYNC it checks the trace rings.
+
+#define _DEFAULT_SOURCE
+#define ALLOCATOR
+
+// A small ring, so the tests fill it with a few records.
+#define ALLOCATOR_LOG_RING_SIZE 16
+
+#include <stdio.h>
+
+#define TKB_MAP_IMPLEMENTATION
+#include "hashmap.h"
+
+/// Counts and prints a failed check, without stopping the test,
+/// and is left in with NDEBUG, unlike assert.
+#define TEST_CHECK(condition)                                                       \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                             \
+        }                                                                           \
+    } while (0)
+
+/// Returns whether the `size` bytes all hold `pattern`.
+static int test_filled(const u8* memory, size_t size, u8 pattern) {
+    for (size_t i = 0; i < size; ++i) {
+        if (memory[i] != pattern)
+            return 0;
+    }
+    return 1;
+}
+
+
+/// Allocates blocks of growing sizes, grows and shrinks the last one,
+/// and deallocates them in reverse, which every allocator supports.
+/// With `resettable`, the allocator has to hand out the same memory
+/// again after each reset.
+static int test_round_trip(const char* name, struct Allocator* allocator, int resettable) {
+    enum { BLOCKS = 64 };
+    u8*    blocks[BLOCKS];
+    size_t sizes[BLOCKS];
+
+    int failures = 0;
+    for (size_t i = 0; i < BLOCKS; ++i) {
+        sizes[i]  = 16 + i * 37;
+        blocks[i] = allocate(allocator, sizes[i]);
+        TEST_CHECK(blocks[i] != NULL);
+        if (blocks[i] == NULL)
+            return failures;
+        memset(blocks[i], (int)i, sizes[i]);
+    }
+
+    // The last block is the most recent allocation, which the
+    // stack, arena and virtual allocators resize in place.
+    size_t last  = BLOCKS - 1;
+    u8*    grown = reallocate(allocator, sizes[last] * 4, blocks[last], sizes[last]);
+    TEST_CHECK(grown != NULL);
+    if (grown != NULL) {
+        TEST_CHECK(test_filled(grown, sizes[last], (u8)last));
+        memset(grown, (int)last, sizes[last] * 4);
+        blocks[last] = reallocate(allocator, sizes[last], grown, sizes[last] * 4);
+        TEST_CHECK(blocks[last] != NULL);
+    }
+
+    for (size_t i = BLOCKS; i > 0; --i) {
+        if (blocks[i - 1] == NULL)
+            continue;
+        TEST_CHECK(test_filled(blocks[i - 1], sizes[i - 1], (u8)(i - 1)));
+        deallocate(allocator, blocks[i - 1], sizes[i - 1]);
+    }
+
+    if (resettable) {
+        allocator_reset_all(allocator);
+        u8* first = allocate(allocator, 64);
+        TEST_CHECK(first != NULL);
+        for (size_t i = 0; i < BLOCKS; ++i)
+            TEST_CHECK(allocate(allocator, sizes[i]) != NULL);
+        allocator_reset_all(allocator);
+        TEST_CHECK(allocate(allocator, 64) == first);
+    }
+
+    if (failures != 0)
+        fprintf(stderr, "%s failed\n", name);
+    return failures;
+}
+
+/// The top of the stack grows and shrinks in place, while anything
+/// below it can only shrink, and returns NULL to make the caller
+/// allocate and copy instead.
+static int test_stack_realloc(void) {
+    int failures = 0;
+    struct Allocator stack = allocator_stack_new(&allocator_system, 1024);
+
+    u8* below = allocate(&stack, 100);
+    u8* top   = allocate(&stack, 100);
+    TEST_CHECK(below != NULL && top != NULL && top == below + 100);
+
+    TEST_CHECK(reallocate(&stack, 300, top, 100) == top);
+    TEST_CHECK(reallocate(&stack, 200, below, 100) == NULL);
+    TEST_CHECK(reallocate(&stack, 50, below, 100) == below);
+    TEST_CHECK(reallocate(&stack, 2000, top, 300) == NULL);
+    TEST_CHECK(reallocate(&stack, 150, top, 300) == top);
+
+    // The next allocation starts where the shrunk top ends.
+    u8* next = allocate(&stack, 10);
+    TEST_CHECK(next == top + 150);
+
+    deallocate(&stack, next, 10);
+    deallocate(&stack, top, 150);
+    deallocate(&stack, below, 100);
+    TEST_CHECK(allocate(&stack, 100) == below);
+
+    allocator_release(&stack);
+    return failures;
+}
+
+/// Grows hashmaps from 16 entries to many thousands, which takes
+/// reallocations in place, copies into new blocks and, with
+/// HASHMAP_OPTION_STABLE, chunks that stay where they are. The stack
+/// allocator only gets a plain map, as it needs the deallocations in
+/// the reverse order, and the block of a plain map stays on top.
+static int test_hashmap_grow(const char* name, struct Allocator* allocator, int stack) {
+    enum { KEYS = 20000 };
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_NONE,
+        HASHMAP_OPTION_STABLE,
+        HASHMAP_OPTION_INCREMENTAL,
+        HASHMAP_OPTION_GROUPS | HASHMAP_OPTION_STORE_HASH,
+    };
+
+    int    failures = 0;
+    size_t count    = stack ? 1 : sizeof(options) / sizeof(*options);
+    for (size_t o = 0; o < count; ++o) {
+        HashMap* map = hashmap_new_with_options(allocator, 16, 0.75f, sizeof(u64), sizeof(u64), options[o]);
+        TEST_CHECK(map != NULL);
+        if (map == NULL)
+            break;
+
+        for (u64 key = 0; key < KEYS; ++key) {
+            u64 value = key * 3 + 1;
+            TEST_CHECK(hashmap_set(&map, &key, &value, hash_u64, compare_u64) == 1);
+        }
+        TEST_CHECK(hashmap_count(map) == KEYS);
+        for (u64 key = 0; key < KEYS + 100; ++key) {
+            const u64* value = hashmap_get(map, &key, hash_u64, compare_u64);
+            TEST_CHECK((value != NULL) == (key < KEYS));
+            TEST_CHECK(value == NULL || *value == key * 3 + 1);
+        }
+        hashmap_free(&map);
+
+        if (failures != 0) {
+            fprintf(stderr, "%s, options %d failed\n", name, (int)options[o]);
+            break;
+        }
+    }
+    return failures;
+}
+
+
+static int test_system(void) {
+    int failures = 0;
+    failures += test_round_trip("system", &allocator_system, 0);
+    failures += test_hashmap_grow("system", &allocator_system, 0);
+    return failures;
+}
+
+static int test_stack(void) {
+    int failures = 0;
+    struct Allocator stack = allocator_stack_new(&allocator_system, 8 << 20);
+    failures += test_round_trip("stack", &stack, 1);
+    allocator_reset_all(&stack);
+    failures += test_hashmap_grow("stack", &stack, 1);
+    allocator_release(&stack);
+    return failures + test_stack_realloc();
+}
+
+static int test_pool(void) {
+    int failures = 0;
+    struct Allocator pool = allocator_pool_new(&allocator_system);
+    TEST_CHECK(pool.data != NULL);
+    if (pool.data == NULL)
+        return failures;
+    failures += test_round_trip("pool", &pool, 1);
+    allocator_reset_all(&pool);
+    failures += test_hashmap_grow("pool", &pool, 0);
+    allocator_release(&pool);
+    return failures;
+}
+
+static int test_arena(void) {
+    int failures = 0;
+    struct Allocator arena = allocator_arena_new(&allocator_system, 1 << 20);
+    TEST_CHECK(arena.data != NULL);
+    if (arena.data == NULL)
+        return failures;
+
+    // Releasing the arena releases the threads that are left.
+    struct Allocator thread = allocator_arena_thread(&arena);
+    struct Allocator other  = allocator_arena_thread(&arena);
+    TEST_CHECK(thread.data != NULL && other.data != NULL);
+    if (thread.data != NULL && other.data != NULL) {
+        failures += test_round_trip("arena", &thread, 1);
+        allocator_reset_all(&thread);
+        failures += test_hashmap_grow("arena", &thread, 0);
+        TEST_CHECK(allocate(&other, 100) != NULL);
+        allocator_release(&thread);
+    }
+    allocator_release(&arena);
+    return failures;
+}
+
+static int test_virtual(void) {
+    int failures = 0;
+#if ALLOCATOR_VIRTUAL_AVAILABLE
+    struct Allocator virtual = allocator_virtual_new(256 << 20, ALLOCATOR_VIRTUAL_NONE);
+    TEST_CHECK(virtual.data != NULL);
+    if (virtual.data == NULL)
+        return failures;
+    failures += test_round_trip("virtual", &virtual, 1);
+    allocator_reset_all(&virtual);
+    failures += test_hashmap_grow("virtual", &virtual, 0);
+    allocator_release(&virtual);
+#endif
+    return failures;
+}
+
+#ifdef ALLOCATOR_DEBUG
+static void* test_stats_thread(void* data) {
+    return allocate((struct Allocator*)data, 1000);
+}
+
+/// Counts a known sequence of calls on a stack allocator, where a
+/// reallocation is both an allocation and a deallocation, and the
+/// memory that's still live when it's reset counts as deallocated.
+static int test_stats(void) {
+    int failures = 0;
+    struct Allocator stack = allocator_stack_new(&allocator_system, 4096);
+
+    u8* below = allocate(&stack, 100);
+    u8* top   = allocate(&stack, 200);
+    top = reallocate(&stack, 400, top, 200);
+    TEST_CHECK(below != NULL && top != NULL);
+    deallocate(&stack, top, 400);
+
+    struct AllocatorStats stats = allocator_stats(&stack);
+    TEST_CHECK(stats.live == 100);
+    TEST_CHECK(stats.peak == 500);
+    TEST_CHECK(stats.allocated == 700 && stats.allocations == 3);
+    TEST_CHECK(stats.deallocated == 600 && stats.deallocations == 2);
+    TEST_CHECK(stats.histogram[6] == 1 && stats.histogram[7] == 1 && stats.histogram[8] == 1);
+
+    allocator_reset_all(&stack);
+    stats = allocator_stats(&stack);
+    TEST_CHECK(stats.live == 0 && stats.deallocated == 700);
+    TEST_CHECK(stats.peak == 500);
+
+    // Another thread counts its allocation in its own stats,
+    // which are summed with those of this thread.
+    struct AllocatorStats system = allocator_stats(&allocator_system);
+    pthread_t thread;
+    void*     memory = NULL;
+    TEST_CHECK(pthread_create(&thread, NULL, test_stats_thread, &allocator_system) == 0);
+    pthread_join(thread, &memory);
+    TEST_CHECK(memory != NULL);
+
+    stats = allocator_stats(&allocator_system);
+    TEST_CHECK(stats.live == system.live + 1000);
+    TEST_CHECK(stats.allocations == system.allocations + 1);
+    deallocate(&allocator_system, memory, 1000);
+    stats = allocator_stats(&allocator_system);
+    TEST_CHECK(stats.live == system.live);
+    TEST_CHECK(stats.deallocations == system.deallocations + 1);
+
+    allocator_release(&stack);
+    return failures;
+}
+#endif
+
+#ifdef ALLOCATOR_LOG_ASYNC
+/// Allocates and deallocates `count` blocks from the system
+/// allocator, which pushes a record for each call.
+static void test_log_records(size_t count) {
+    void* blocks[ALLOCATOR_LOG_RING_SIZE];
+    for (size_t i = 0; i < count; ++i)
+        blocks[i] = allocate(&allocator_system, 32);
+    for (size_t i = count; i > 0; --i)
+        deallocate(&allocator_system, blocks[i - 1], 32);
+}
+
+/// Every record pushed while the ring has room has to be drained, and a
+/// full ring drops and counts the records that don't fit.
+static int test_log(void) {
+    enum { HALF = ALLOCATOR_LOG_RING_SIZE / 2 };
+
+    int failures = 0;
+    allocator_log_drain();
+    test_log_records(HALF);
+    struct AllocatorLogRing* ring = allocator_log_ring;
+    TEST_CHECK(ring != NULL);
+    if (ring == NULL)
+        return failures;
+
+    size_t dropped = ring->dropped;
+    TEST_CHECK(allocator_log_drain() == ALLOCATOR_LOG_RING_SIZE);
+    TEST_CHECK(ring->dropped == dropped);
+
+    // Draining between the batches keeps room for all of them.
+    for (int round = 0; round < 4; ++round) {
+        test_log_records(HALF / 2);
+        TEST_CHECK(allocator_log_drain() == HALF);
+    }
+    TEST_CHECK(ring->dropped == dropped);
+
+    test_log_records(ALLOCATOR_LOG_RING_SIZE);
+    TEST_CHECK(ring->dropped == dropped + ALLOCATOR_LOG_RING_SIZE);
+    TEST_CHECK(allocator_log_drain() == ALLOCATOR_LOG_RING_SIZE);
+    TEST_CHECK(ring->reported == ring->dropped);
+    TEST_CHECK(allocator_log_drain() == 0);
+
+    // The background thread drains the ring before it fills,
+    // when each batch waits for the previous one.
+    dropped = ring->dropped;
+    size_t tail = ring->tail;
+    TEST_CHECK(allocator_log_start(1));
+    for (int round = 0; round < 8; ++round) {
+        test_log_records(HALF / 2);
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+            sched_yield();
+    }
+    allocator_log_stop();
+    TEST_CHECK(ring->tail - tail == 8 * HALF);
+    TEST_CHECK(ring->dropped == dropped);
+    return failures;
+}
+#endif
+
+
+int main(void) {
+    int failures = 0;
+#ifdef ALLOCATOR_LOG_ASYNC
+    failures += test_log();
+#endif
+    failures += test_system();
+    failures += test_stack();
+    failures += test_pool();
+    failures += test_arena();
+    failures += test_virtual();
+#ifdef ALLOCATOR_DEBUG
+    failures += test_stats();
+#endif
+    allocator_assert_no_memory_leak();
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("All tests passed");
+    return 0;
+}
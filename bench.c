@@ -0,0 +1,470 @@
+// Benchmarks the hashmap over a grid of workloads, sizes, load factors,
+// grow factors, allocators and layouts, and prints one CSV row per run, so
+// the output of two builds can be diffed.
+//
+//     map_bench [-s sizes] [-l load_factors] [-g grow_factors] [-a allocators] [-w workloads] [-L layouts]
+//
+// Each option takes a comma separated list, e.g. `-s 100,1000000 -a system,virtual`.
+// The defaults skip the 100M entry maps, as they need several GB of memory.
+//
+// The columns are:
+// - workload:        hit, miss, insert, delete, churn (a delete, an insert
+//                    and a lookup for every op, at a constant count), scatter
+//                    (hits in a random order instead of the insertion order,
+//                    so every entry is a cache miss), batch (the hits of
+//                    scatter, looked up BENCH_BATCH keys at a time with
+//                    get_batch) or scan (a read of every key, without looking
+//                    any of them up).
+// - index_bytes:     the width of the indices, which follows from the size
+//                    and the load factor (1, 2, 4 or 8 bytes).
+// - layout:          soa (all keys, then all values) or aos (each value
+//                    next to its key, HASHMAP_OPTION_INTERLEAVED).
+// - ns_per_op:       the wall time of all ops divided by their number.
+// - p99_ns:          the 99th percentile of every 64th op timed on its own,
+//                    without the overhead of reading the clock. For batch,
+//                    every 64th batch is timed and divided by its keys.
+// - bytes_per_entry: the size of the block of the map, divided by its count.
+
+#define _DEFAULT_SOURCE
+#define ALLOCATOR
+
+#include <stdio.h>
+#include <time.h>
+
+#define TKB_MAP_IMPLEMENTATION
+#include "hashmap.h"
+
+typedef struct BenchMap BenchMap;
+MAP_DEFINE_H(BenchMap, bench_map, u64, u64)
+MAP_DEFINE_C_EX(BenchMap, bench_map, u64, u64, hash_u64, compare_u64)
+
+
+/// The minimum number of ops to run, so the small maps are
+/// measured over many rounds instead of a single one.
+#define BENCH_MIN_OPS      (1 << 21)
+#define BENCH_SAMPLE_EVERY 64
+#define BENCH_MAX_VALUES   16
+#define BENCH_BATCH        64
+
+
+static inline u64 bench_now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000ULL + (u64)time.tv_nsec;
+}
+
+static inline u64 bench_random(u64* state) {
+    u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+typedef struct BenchRun {
+    u64  start;
+    u64  ops;
+    u64* samples;
+    u64  sample_count;
+    u64  sample_capacity;
+} BenchRun;
+
+/// The time it takes to read the clock twice, which is
+/// subtracted from every sample.
+static u64 bench_clock_overhead = 0;
+
+static void bench_calibrate(void) {
+    u64 best = (u64)-1;
+    for (int i = 0; i < 10000; ++i) {
+        u64 start = bench_now();
+        u64 end   = bench_now();
+        if (end - start < best)
+            best = end - start;
+    }
+    bench_clock_overhead = best;
+}
+
+static inline void bench_sample(BenchRun* run, u64 elapsed) {
+    if (run->sample_count == run->sample_capacity) {
+        run->sample_capacity = run->sample_capacity ? run->sample_capacity * 2 : 4096;
+        run->samples = realloc(run->samples, run->sample_capacity * sizeof(u64));
+    }
+    run->samples[run->sample_count++] = (elapsed > bench_clock_overhead) ? elapsed - bench_clock_overhead : 0;
+}
+
+/// Runs the op, and times it on its own if it's one of the sampled ones.
+#define BENCH_OP(run, ...)                                                    \
+    do {                                                                      \
+        if (((run)->ops++ & (BENCH_SAMPLE_EVERY - 1)) == 0) {                 \
+            u64 bench_start_ = bench_now();                                   \
+            __VA_ARGS__;                                                      \
+            bench_sample((run), bench_now() - bench_start_);                  \
+        } else {                                                              \
+            __VA_ARGS__;                                                      \
+        }                                                                     \
+    } while (0)
+
+static int bench_compare_u64(const void* a, const void* b) {
+    u64 x = *(const u64*)a;
+    u64 y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+static u64 bench_p99(BenchRun* run) {
+    if (run->sample_count == 0)
+        return 0;
+    qsort(run->samples, run->sample_count, sizeof(u64), bench_compare_u64);
+    return run->samples[(run->sample_count * 99) / 100];
+}
+
+
+// ---- Allocators ----
+
+typedef struct BenchAllocator {
+    const char*      name;
+    struct Allocator allocator;
+    struct Allocator parent;
+    int              owned;
+} BenchAllocator;
+
+static const char* bench_allocator_names[] = { "system", "stack", "pool", "arena", "virtual" };
+
+/// Creates the allocator for a run with room for about `bytes` bytes.
+static int bench_allocator_new(BenchAllocator* result, const char* name, size_t bytes) {
+    *result = (BenchAllocator) { .name = name };
+
+    if (strcmp(name, "system") == 0) {
+        result->allocator = allocator_system;
+        return 1;
+    }
+    if (strcmp(name, "stack") == 0) {
+        result->allocator = allocator_stack_new(&allocator_system, bytes);
+    } else if (strcmp(name, "pool") == 0) {
+        result->allocator = allocator_pool_new(&allocator_system);
+    } else if (strcmp(name, "arena") == 0) {
+        result->parent = allocator_arena_new(&allocator_system, 1 << 20);
+        if (result->parent.data == NULL)
+            return 0;
+        result->allocator = allocator_arena_thread(&result->parent);
+#if ALLOCATOR_VIRTUAL_AVAILABLE
+    } else if (strcmp(name, "virtual") == 0) {
+        result->allocator = allocator_virtual_new(bytes, ALLOCATOR_VIRTUAL_HUGEPAGES);
+#endif
+    } else {
+        fprintf(stderr, "Unknown allocator '%s'\n", name);
+        return 0;
+    }
+
+    result->owned = 1;
+    return result->allocator.data != NULL;
+}
+
+static void bench_allocator_free(BenchAllocator* allocator) {
+    if (!allocator->owned)
+        return;
+    if (allocator->allocator.data != NULL)
+        allocator_release(&allocator->allocator);
+    if (allocator->parent.data != NULL)
+        allocator_release(&allocator->parent);
+}
+
+/// Resets the allocator between the rounds of a run, so
+/// the allocators that never free don't run out.
+static void bench_allocator_reset(BenchAllocator* allocator) {
+    if (strcmp(allocator->name, "arena") == 0 || strcmp(allocator->name, "virtual") == 0)
+        allocator_reset_all(&allocator->allocator);
+}
+
+
+// ---- Workloads ----
+
+typedef struct BenchConfig {
+    const char* workload;
+    size_t      size;
+    float       load_factor;
+    float       grow_factor;
+    const char* allocator;
+    const char* layout;
+} BenchConfig;
+
+typedef struct BenchResult {
+    u64    ops;
+    u64    nanoseconds;
+    u64    p99;
+    size_t index_stride;
+    double bytes_per_entry;
+} BenchResult;
+
+static volatile u64 bench_sink = 0;
+
+static BenchMap* bench_map_create(Allocator* allocator, const BenchConfig* config, size_t capacity) {
+    HashMapOptions options = (strcmp(config->layout, "aos") == 0) ? HASHMAP_OPTION_INTERLEAVED : HASHMAP_OPTION_NONE;
+    BenchMap*      map     = bench_map_new_with_options(allocator, capacity, config->load_factor, options);
+    if (map != NULL)
+        bench_map_set_grow_factor(map, config->grow_factor);
+    return map;
+}
+
+static void bench_measure(BenchResult* result, const BenchMap* map) {
+    const HashMapHeader* header = hashmap_header((const HashMap*)map);
+    result->index_stride    = header->index_stride;
+    result->bytes_per_entry = header->count ? (double)hashmap_header_total_size(header) / (double)header->count : 0.0;
+}
+
+static void bench_fill(BenchMap** map, const u64* keys, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        bench_map_set(map, keys[i], i);
+}
+
+static int bench_run(const BenchConfig* config, BenchResult* result) {
+    size_t size   = config->size;
+    size_t rounds = (size < BENCH_MIN_OPS) ? BENCH_MIN_OPS / size : 1;
+
+    if (strcmp(config->layout, "soa") != 0 && strcmp(config->layout, "aos") != 0) {
+        fprintf(stderr, "Unknown layout '%s'\n", config->layout);
+        return 0;
+    }
+
+    // Twice the keys, where the second half is never inserted
+    // and used for the misses and the churn.
+    u64* keys = malloc(2 * size * sizeof(u64));
+    if (keys == NULL)
+        return 0;
+    u64 state = 0x5EED;
+    for (size_t i = 0; i < 2 * size; ++i)
+        keys[i] = bench_random(&state);
+
+    BenchAllocator allocator;
+    size_t budget = 64 * size * sizeof(u64) + (16 << 20);
+    if (!bench_allocator_new(&allocator, config->allocator, budget)) {
+        bench_allocator_free(&allocator);
+        free(keys);
+        return 0;
+    }
+
+    BenchRun run = { 0 };
+    u64      sum = 0;
+
+    if (strcmp(config->workload, "hit") == 0 || strcmp(config->workload, "miss") == 0) {
+        BenchMap* map = bench_map_create(&allocator.allocator, config, 16);
+        bench_fill(&map, keys, size);
+        bench_measure(result, map);
+
+        const u64* lookups = keys + (strcmp(config->workload, "miss") == 0 ? size : 0);
+        run.start = bench_now();
+        for (size_t r = 0; r < rounds; ++r) {
+            for (size_t i = 0; i < size; ++i) {
+                BENCH_OP(&run, {
+                    const u64* value = bench_map_get(map, lookups[i]);
+                    sum += (value != NULL) ? *value : 1;
+                });
+            }
+        }
+        result->nanoseconds = bench_now() - run.start;
+        bench_map_free(&map);
+    } else if (strcmp(config->workload, "scatter") == 0 || strcmp(config->workload, "batch") == 0) {
+        BenchMap* map = bench_map_create(&allocator.allocator, config, 16);
+        bench_fill(&map, keys, size);
+        bench_measure(result, map);
+
+        // Shuffle the inserted keys into the unused half.
+        u64* lookups = keys + size;
+        memcpy(lookups, keys, size * sizeof(u64));
+        for (size_t i = size - 1; i > 0; --i) {
+            size_t j   = (size_t)(bench_random(&state) % (i + 1));
+            u64    key = lookups[i];
+            lookups[i] = lookups[j];
+            lookups[j] = key;
+        }
+
+        if (strcmp(config->workload, "batch") == 0) {
+            u64* values[BENCH_BATCH];
+            run.start = bench_now();
+            for (size_t r = 0; r < rounds; ++r) {
+                for (size_t i = 0; i < size; i += BENCH_BATCH) {
+                    size_t count = (size - i < BENCH_BATCH) ? size - i : BENCH_BATCH;
+                    int    timed = ((run.ops / BENCH_BATCH) & (BENCH_SAMPLE_EVERY - 1)) == 0;
+                    u64    start = timed ? bench_now() : 0;
+                    bench_map_get_batch(map, lookups + i, count, values);
+                    for (size_t j = 0; j < count; ++j)
+                        sum += (values[j] != NULL) ? *values[j] : 1;
+                    if (timed)
+                        bench_sample(&run, (bench_now() - start) / count);
+                    run.ops += count;
+                }
+            }
+            result->nanoseconds = bench_now() - run.start;
+        } else {
+            run.start = bench_now();
+            for (size_t r = 0; r < rounds; ++r) {
+                for (size_t i = 0; i < size; ++i) {
+                    BENCH_OP(&run, {
+                        const u64* value = bench_map_get(map, lookups[i]);
+                        sum += (value != NULL) ? *value : 1;
+                    });
+                }
+            }
+            result->nanoseconds = bench_now() - run.start;
+        }
+        bench_map_free(&map);
+    } else if (strcmp(config->workload, "scan") == 0) {
+        BenchMap* map = bench_map_create(&allocator.allocator, config, 16);
+        bench_fill(&map, keys, size);
+        bench_measure(result, map);
+
+        HashMapStrided strided = hashmap_keys_strided((const HashMap*)map);
+        run.start = bench_now();
+        for (size_t r = 0; r < rounds; ++r) {
+            for (size_t i = 0; i < strided.count; ++i)
+                BENCH_OP(&run, sum += *(const u64*)(strided.data + i * strided.stride));
+        }
+        result->nanoseconds = bench_now() - run.start;
+        bench_map_free(&map);
+    } else if (strcmp(config->workload, "insert") == 0) {
+        result->nanoseconds = 0;
+        for (size_t r = 0; r < rounds; ++r) {
+            BenchMap* map = bench_map_create(&allocator.allocator, config, 16);
+            u64 start = bench_now();
+            for (size_t i = 0; i < size; ++i)
+                BENCH_OP(&run, sum += bench_map_set(&map, keys[i], i));
+            result->nanoseconds += bench_now() - start;
+            if (r == 0)
+                bench_measure(result, map);
+            bench_map_free(&map);
+            bench_allocator_reset(&allocator);
+        }
+    } else if (strcmp(config->workload, "delete") == 0) {
+        result->nanoseconds = 0;
+        for (size_t r = 0; r < rounds; ++r) {
+            BenchMap* map = bench_map_create(&allocator.allocator, config, size);
+            bench_fill(&map, keys, size);
+            if (r == 0)
+                bench_measure(result, map);
+            u64 start = bench_now();
+            for (size_t i = 0; i < size; ++i)
+                BENCH_OP(&run, sum += (bench_map_del(&map, keys[i]) != NULL));
+            result->nanoseconds += bench_now() - start;
+            bench_map_free(&map);
+            bench_allocator_reset(&allocator);
+        }
+    } else if (strcmp(config->workload, "churn") == 0) {
+        // Replace the keys one at a time with the unused ones, which
+        // keeps the count constant while the tombstones pile up.
+        BenchMap* map = bench_map_create(&allocator.allocator, config, 16);
+        bench_fill(&map, keys, size);
+
+        size_t total = rounds * size;
+        run.start = bench_now();
+        for (size_t i = 0; i < total; ++i) {
+            size_t old_key = i % (2 * size);
+            size_t new_key = (i + size) % (2 * size);
+            BENCH_OP(&run, {
+                bench_map_del(&map, keys[old_key]);
+                bench_map_set(&map, keys[new_key], i);
+                const u64* value = bench_map_get(map, keys[(new_key * 7) % (2 * size)]);
+                sum += (value != NULL) ? *value : 1;
+            });
+        }
+        result->nanoseconds = bench_now() - run.start;
+        bench_measure(result, map);
+        bench_map_free(&map);
+    } else {
+        fprintf(stderr, "Unknown workload '%s'\n", config->workload);
+        bench_allocator_free(&allocator);
+        free(keys);
+        return 0;
+    }
+
+    bench_sink += sum;
+    result->ops = run.ops;
+    result->p99 = bench_p99(&run);
+
+    free(run.samples);
+    bench_allocator_free(&allocator);
+    free(keys);
+    return 1;
+}
+
+
+// ---- Options ----
+
+typedef struct BenchList {
+    const char* values[BENCH_MAX_VALUES];
+    size_t      count;
+} BenchList;
+
+/// Splits the comma separated list in place.
+static void bench_parse_list(BenchList* list, char* text) {
+    list->count = 0;
+    for (char* token = strtok(text, ","); token != NULL && list->count < BENCH_MAX_VALUES; token = strtok(NULL, ","))
+        list->values[list->count++] = token;
+}
+
+static void bench_default_list(BenchList* list, const char** values, size_t count) {
+    list->count = count;
+    for (size_t i = 0; i < count; ++i)
+        list->values[i] = values[i];
+}
+
+int main(int argc, char* argv[]) {
+    static const char* default_sizes[]        = { "100", "10000", "1000000" };
+    static const char* default_load_factors[] = { "0.5", "0.75", "0.9" };
+    static const char* default_grow_factors[] = { "1.5", "2.0" };
+    static const char* default_workloads[]    = { "hit", "miss", "insert", "delete", "churn", "scatter", "batch", "scan" };
+    static const char* default_layouts[]      = { "soa", "aos" };
+
+    BenchList sizes, load_factors, grow_factors, allocators, workloads, layouts;
+    bench_default_list(&sizes,        default_sizes,         sizeof(default_sizes)         / sizeof(*default_sizes));
+    bench_default_list(&load_factors, default_load_factors,  sizeof(default_load_factors)  / sizeof(*default_load_factors));
+    bench_default_list(&grow_factors, default_grow_factors,  sizeof(default_grow_factors)  / sizeof(*default_grow_factors));
+    bench_default_list(&allocators,   bench_allocator_names, sizeof(bench_allocator_names) / sizeof(*bench_allocator_names));
+    bench_default_list(&workloads,    default_workloads,     sizeof(default_workloads)     / sizeof(*default_workloads));
+    bench_default_list(&layouts,      default_layouts,       sizeof(default_layouts)       / sizeof(*default_layouts));
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if      (strcmp(argv[i], "-s") == 0) bench_parse_list(&sizes,        argv[i + 1]);
+        else if (strcmp(argv[i], "-l") == 0) bench_parse_list(&load_factors, argv[i + 1]);
+        else if (strcmp(argv[i], "-g") == 0) bench_parse_list(&grow_factors, argv[i + 1]);
+        else if (strcmp(argv[i], "-a") == 0) bench_parse_list(&allocators,   argv[i + 1]);
+        else if (strcmp(argv[i], "-w") == 0) bench_parse_list(&workloads,    argv[i + 1]);
+        else if (strcmp(argv[i], "-L") == 0) bench_parse_list(&layouts,      argv[i + 1]);
+        else {
+            fprintf(stderr, "usage: %s [-s sizes] [-l load_factors] [-g grow_factors] [-a allocators] [-w workloads] [-L layouts]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_calibrate();
+
+    printf("workload,size,load_factor,grow_factor,index_bytes,allocator,layout,ops,ns_per_op,p99_ns,bytes_per_entry\n");
+    for (size_t w = 0; w < workloads.count; ++w)
+    for (size_t s = 0; s < sizes.count; ++s)
+    for (size_t l = 0; l < load_factors.count; ++l)
+    for (size_t g = 0; g < grow_factors.count; ++g)
+    for (size_t a = 0; a < allocators.count; ++a)
+    for (size_t y = 0; y < layouts.count; ++y) {
+        BenchConfig config = {
+            .workload    = workloads.values[w],
+            .size        = (size_t)strtoull(sizes.values[s], NULL, 10),
+            .load_factor = strtof(load_factors.values[l], NULL),
+            .grow_factor = strtof(grow_factors.values[g], NULL),
+            .allocator   = allocators.values[a],
+            .layout      = layouts.values[y],
+        };
+        if (config.size == 0)
+            continue;
+
+        BenchResult result = { 0 };
+        if (!bench_run(&config, &result)) {
+            fprintf(stderr, "Failed to run %s with %zu entries on the %s allocator\n", config.workload, config.size, config.allocator);
+            continue;
+        }
+
+        printf("%s,%zu,%.2f,%.2f,%zu,%s,%s,%llu,%.2f,%llu,%.2f\n",
+               config.workload, config.size, config.load_factor, config.grow_factor, result.index_stride, config.allocator, config.layout,
+               result.ops, (double)result.nanoseconds / (double)result.ops, result.p99, result.bytes_per_entry);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -5,17 +5,59 @@
 #ifdef ALLOCATOR
 #include "allocator.h"
 #else
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 typedef void* Allocator;
 static Allocator allocator_system = NULL;
-#define allocate(allocator, size)                malloc(size)
-#define deallocate(allocator, memory, old_size)  free(memory)
+#define allocate(allocator, size)                      malloc(size)
+#define reallocate(allocator, size, memory, old_size)  realloc(memory, size)
+#define deallocate(allocator, memory, old_size)        free(memory)
 #endif
 
 
-typedef unsigned char  u8;
-typedef unsigned short u16;
+typedef unsigned char      u8;
+typedef unsigned short     u16;
+typedef unsigned int       u32;
+typedef unsigned long long u64;
+
+
+// Define TKB_MAP_STATS to count how the hashmaps are probed and grown, see
+// `hashmap_stats`. Without it, the counters and the code that updates them
+// compile to nothing.
+#ifdef TKB_MAP_STATS
+#define HASHMAP_STATS_ENABLED 1
+#define HASHMAP_STATS_BLOCK(...) __VA_ARGS__
+#else
+#define HASHMAP_STATS_ENABLED 0
+#define HASHMAP_STATS_BLOCK(...)
+#endif
+
+#define HASHMAP_STATS_BUCKETS 16
+
+typedef struct HashMapStats {
+    /// The probe lengths of the keys found by get, set and del, and of the
+    /// free indices taken by set, as the distance from the index the hash
+    /// starts at. Bucket 0 counts the keys found at their first index, and
+    /// bucket `i` the lengths in `[2^(i-1), 2^i)`. The last bucket also
+    /// counts everything longer.
+    u64 get_probes[HASHMAP_STATS_BUCKETS];
+    u64 set_probes[HASHMAP_STATS_BUCKETS];
+    u64 del_probes[HASHMAP_STATS_BUCKETS];
+
+    /// The keys that get and del didn't find.
+    u64 get_misses;
+    u64 del_misses;
+
+    /// The times set went through every index without finding
+    /// a free one, and had to grow before reaching the capacity.
+    u64 full_probes;
+
+    /// The number of calls to `hashmap_grow`, and the time spent in them.
+    u64 grows;
+    u64 grow_nanoseconds;
+    u64 grow_max_nanoseconds;
+} HashMapStats;
 
 
 typedef struct HashMapHeader {
@@ -38,6 +80,38 @@ typedef struct HashMapHeader {
     /// The mask used to get the correct index size.
     size_t index_mask;
 
+    /// The number of indices marked as deleted. They're
+    /// part of the probe sequences until the indices are
+    /// rebuilt, which `hashmap_set_hashed` does once they
+    /// and the entries pass the load factor.
+    size_t tombstones;
+
+    /// The hashmap that is being migrated from after an
+    /// incremental grow, or NULL. Its indices, and the
+    /// entries that haven't been copied yet, are used.
+    struct HashMapHeader* previous;
+
+    /// How many of the previous indices that have been
+    /// migrated.
+    size_t migrated;
+
+    /// How many of the previous entries that have been
+    /// copied.
+    size_t copied;
+
+    /// The chunks holding the keys and values with
+    /// `HASHMAP_OPTION_STABLE`, or NULL.
+    u8** chunks;
+
+    /// The newest chunk of the copied strings of the keys
+    /// with `HASHMAP_OPTION_OWNED_KEYS`, or NULL.
+    struct HashMapStrings* strings;
+
+    /// The counting Bloom filter with `HASHMAP_OPTION_FILTER`,
+    /// or NULL, and the number of its blocks minus 1.
+    u8*    filter;
+    size_t filter_mask;
+
     /// Load factor is a percentage of the capacity
     /// before the hashmap will grow.
     /// It is a value between 1 and 100, where 100
@@ -62,34 +136,270 @@ typedef struct HashMapHeader {
     /// The stride of the indices in the hashmap.
     u16 index_stride;
 
-    // Following this header is:
+    /// The options the hashmap was created with,
+    /// see `HashMapOptions`.
+    u16 options;
+
+    /// The stride of an entry, and the offset of its value
+    /// from its key, with `HASHMAP_OPTION_INTERLEAVED`.
+    u16 entry_stride;
+    u16 value_offset;
+
+    /// Kept across grows, with TKB_MAP_STATS.
+    HASHMAP_STATS_BLOCK(HashMapStats stats;)
+
+    // Following this header is (each array aligned
+    // to `sizeof(size_t)`):
     // indices[index_capacity * index_stride]
     // keys[capacity * key_stride],
     // values[capacity * value_stride]
+    // hashes[capacity]                     (if HASHMAP_OPTION_STORE_HASH)
+    // control[index_capacity + 16]         (if HASHMAP_OPTION_GROUPS)
+    //
+    // With HASHMAP_OPTION_INTERLEAVED, the keys hold the whole
+    // entries (capacity * entry_stride), and the values are empty.
+    // With HASHMAP_OPTION_STABLE, the keys, values and
+    // hashes are left out, and kept in `chunks` instead.
 } HashMapHeader;
 
+/// Options that can be given to `hashmap_new_with_options`
+/// to change how the hashmap stores its entries.
+typedef enum HashMapOptions {
+    HASHMAP_OPTION_NONE        = 0,
+
+    /// Store the full hash of each key next to its value.
+    /// Probes compare the stored hash before calling the
+    /// compare function, and growing reinserts the entries
+    /// from the stored hash instead of rehashing every key.
+    HASHMAP_OPTION_STORE_HASH  = 1 << 0,
+
+    /// Keep a control byte with 7 bits of the hash for
+    /// each index, and probe 16 indices at a time with
+    /// SSE2/NEON (SwissTable-style). Only the indices
+    /// whose control byte matches are followed into the
+    /// keys, so it's possible to run at a high load factor
+    /// (like `HASHMAP_GROUP_LOAD_FACTOR`).
+    HASHMAP_OPTION_GROUPS      = 1 << 1,
+
+    /// Spread the work of a grow over the following sets
+    /// and deletes, instead of doing it all at once. The
+    /// old block is kept, and its entries are copied and
+    /// its indices migrated `HASHMAP_MIGRATE_STEP` at a
+    /// time, so no single insert pays for all of them. It
+    /// still clears the new indices, and recounts the
+    /// `HASHMAP_OPTION_FILTER` counters. Lookups check both
+    /// indices meanwhile, and pointers to the entries are
+    /// only valid until the next set or del. `hashmap_keys`
+    /// and the other functions that hand out all the entries
+    /// return NULL until the entries have been copied, which
+    /// `hashmap_finish_migration` does at once.
+    HASHMAP_OPTION_INCREMENTAL = 1 << 2,
+
+    /// Keep the keys and values in their own chunks, separate
+    /// from the indices. Chunks are never moved, only added
+    /// (each twice the size of the last), so growing only
+    /// rebuilds the indices, and the pointers returned by
+    /// `hashmap_get` stay valid until the entry, or the last
+    /// entry, is deleted. `hashmap_retain` also replaces each
+    /// removed entry with the last one. `hashmap_keys` and
+    /// `hashmap_values` return NULL, use `hashmap_key_at` and
+    /// `hashmap_value_at`.
+    HASHMAP_OPTION_STABLE      = 1 << 3,
+
+    /// Keep the indices of each probe sequence ordered by where
+    /// their hash starts (Robin Hood hashing), by shifting the
+    /// following indices forward on insert, and back over the
+    /// removed index on delete. No tombstones are left behind,
+    /// and a miss stops at the first index that is closer to its
+    /// start than the key would be. Implies STORE_HASH, as the
+    /// start of every index is needed, and can't be combined
+    /// with GROUPS.
+    HASHMAP_OPTION_ROBIN_HOOD  = 1 << 4,
+
+    /// Leave out the indices while the capacity is at most
+    /// `HASHMAP_SMALL_CAPACITY`, and find keys by comparing
+    /// them with every entry instead, without hashing them
+    /// (SIMD for u32 and u64 keys with `compare_u32` and
+    /// `compare_u64`). The indices are built when it grows
+    /// past it, and left out again if it shrinks back.
+    HASHMAP_OPTION_SMALL       = 1 << 5,
+
+    /// Copy the string of every key that is added into chunks
+    /// owned by the hashmap, and store the key pointing to the
+    /// copy, so the caller doesn't need to keep the string alive
+    /// or allocate one for each key. The keys must be either
+    /// `const char*` or `StringKey` (told apart by the stride).
+    /// The chunks are never moved, only added, so the keys can
+    /// still be hashed and compared as usual. The strings of
+    /// deleted keys are kept until `hashmap_shrink_to_fit`,
+    /// which copies the others into one chunk, or `hashmap_free`.
+    /// If a key's string can't be copied, it isn't added and
+    /// `hashmap_set` returns 0.
+    HASHMAP_OPTION_OWNED_KEYS  = 1 << 6,
+
+    /// Keep a counting Bloom filter of the hashes, with a block
+    /// of 4-bit counters in a cache line for every 16 entries
+    /// of the capacity. Each key counts in 4 counters of one
+    /// block, so most misses of `hashmap_get` and `hashmap_del`
+    /// are answered from that line, without probing the indices
+    /// or comparing any keys, and `hashmap_set` skips the lookup
+    /// for most new keys. Implies STORE_HASH, as the filter is
+    /// counted again from the stored hashes when it's resized.
+    HASHMAP_OPTION_FILTER      = 1 << 7,
+
+    /// Store each value right after its key (array of structs),
+    /// instead of all the keys followed by all the values, so a
+    /// hit of `hashmap_get` compares the key and returns the
+    /// value from the same cache line, for small keys and values.
+    /// Scanning only the keys touches more memory instead. Each
+    /// value is aligned to the lowest set bit of its stride (up
+    /// to `sizeof(size_t)`), and so is each key. `hashmap_keys`
+    /// and `hashmap_values` return NULL, use `hashmap_key_at`,
+    /// `hashmap_value_at` or `hashmap_keys_strided`.
+    HASHMAP_OPTION_INTERLEAVED = 1 << 8,
+} HashMapOptions;
+
 typedef void* HashMap;
 
 typedef size_t (*hash_function)(const void* key, size_t stride);
 typedef int    (*compare_function)(const void* a, const void* b, size_t stride);
 
+/// The keys or the values of a hashmap, where the `i`th one of the
+/// `count` is at `data + i * stride`, whichever the layout is. The
+/// data is NULL with `HASHMAP_OPTION_STABLE`, as the entries are
+/// spread over chunks then.
+typedef struct HashMapStrided {
+    u8*    data;
+    size_t stride;
+    size_t count;
+} HashMapStrided;
+
+/// Returns nonzero to keep the entry in `hashmap_retain`. Gets
+/// the `data` given to it, and may change the value.
+typedef int    (*retain_function)(const void* key, void* value, void* data);
+
+/// A string key that carries its length and hash, to be used
+/// with `hash_string_key` and `compare_string_key`. Keys are
+/// rejected on length and hash before their bytes are compared,
+/// and the hash is only computed once, when the key is made.
+typedef struct StringKey {
+    const char* data;
+    size_t      length;
+    size_t      hash;
+} StringKey;
+
+StringKey string_key(const char* data);
+StringKey string_key_n(const char* data, size_t length);
+
 int       hashmap_set_load_factor(HashMap* map, float load_factor);
 int       hashmap_set_grow_factor(HashMap* map, float grow_factor);
 size_t    hashmap_count(const HashMap* hashmap);
 size_t    hashmap_capacity(const HashMap* hashmap);
 u8*       hashmap_keys(const HashMap* hashmap);
 void*     hashmap_values(const HashMap* hashmap);
+u8*       hashmap_key_at(const HashMap* hashmap, size_t i);
+void*     hashmap_value_at(const HashMap* hashmap, size_t i);
+HashMapStrided hashmap_keys_strided(const HashMap* hashmap);
+HashMapStrided hashmap_values_strided(const HashMap* hashmap);
 HashMap*  hashmap_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride);
+HashMap*  hashmap_new_with_options(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options);
 void      hashmap_free(HashMap** map);
 void*     hashmap_get(const HashMap* map, const void* key, hash_function hash_key, compare_function compare_key);
 int       hashmap_set(HashMap** map, const void* key, const void* value, hash_function hash_key, compare_function compare_key);
 void*     hashmap_del(HashMap** map, const void* key, hash_function hash_key, compare_function compare_key);
 void      hashmap_grow(HashMap** map, hash_function hash_key, compare_function compare_key);
 
+// Copies the rest of the entries and migrates the rest of the indices of
+// an incremental grow (HASHMAP_OPTION_INCREMENTAL) at once, so that
+// `hashmap_keys` and the other functions that hand out all the entries
+// return them again. Does nothing if the hashmap isn't migrating.
+void      hashmap_finish_migration(HashMap** map, hash_function hash_key);
+
+// Makes room for at least `count` entries in total, so they can be set
+// without growing. Shrinks the capacity down to the count, to give back
+// memory after deleting. Both return 0 if the allocation failed, in which
+// case the hashmap is left as it was.
+int       hashmap_reserve(HashMap** map, size_t count, hash_function hash_key, compare_function compare_key);
+int       hashmap_shrink_to_fit(HashMap** map, hash_function hash_key, compare_function compare_key);
+
+// Removes all entries, and keeps the capacity for reuse.
+void      hashmap_clear(HashMap* map);
+// Sets every key of `src` to its value in `dst`, after reserving room for
+// as many entries as the larger of the two. Both need the same key and
+// value strides. Returns the number of keys that were added.
+size_t    hashmap_merge(HashMap** dst, const HashMap* src, hash_function hash_key, compare_function compare_key);
+// Removes the entries that `keep` returns 0 for, in one pass that keeps
+// the order of the others, and then rebuilds the indices once. With
+// `HASHMAP_OPTION_STABLE`, each removed entry is replaced by the last one
+// instead, as in `hashmap_del`, so only the pointers to the entries that
+// were moved are invalidated. Returns the number of entries that were
+// removed.
+size_t    hashmap_retain(HashMap* map, retain_function keep, void* data, hash_function hash_key);
+
+// Same as `hashmap_get` and `hashmap_set`, but with the hash of the key
+// already computed by the caller, e.g. when it's used for something else.
+void*     hashmap_get_hashed(const HashMap* map, const void* key, size_t hash, compare_function compare_key);
+int       hashmap_set_hashed(HashMap** map, const void* key, const void* value, size_t hash, hash_function hash_key, compare_function compare_key);
+void*     hashmap_del_hashed(HashMap** map, const void* key, size_t hash, hash_function hash_key, compare_function compare_key);
+
+// Looks up `count` keys at once, writing the value (or NULL) of each key
+// to `results`. The keys are hashed first and their indices and entries
+// prefetched in blocks, so the cache misses of the lookups overlap.
+void      hashmap_get_batch(const HashMap* map, const void* keys, size_t count, void** results, hash_function hash_key, compare_function compare_key);
+// Sets `count` keys to their values at once, the same way as
+// `hashmap_get_batch`. Each block grows the hashmap first if it could
+// fill it, so no grow happens while its lines are prefetched. Returns
+// the number of keys that were added.
+size_t    hashmap_set_batch(HashMap** map, const void* keys, const void* values, size_t count, hash_function hash_key, compare_function compare_key);
+
+// Creates a hashmap with room for exactly `count` entries and sets all
+// of them, like `hashmap_set` in order, but without growing. With
+// TKB_MAP_THREADS defined, the keys are hashed and the indices filled
+// by up to `threads` threads (rounded down to a power of 2).
+HashMap*  hashmap_build_from(Allocator* allocator, const void* keys, const void* values, size_t count, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options, size_t threads, hash_function hash_key, compare_function compare_key);
+
+#ifdef TKB_MAP_STATS
+#include <stdio.h>
+
+// Returns the counters of the hashmap, or prints them along with its
+// current load. The lookups count through the const hashmap, with the
+// relaxed GCC/Clang `__atomic` builtins, so they may still run on several
+// threads at once. The counters are read without synchronization, so
+// read them while no other thread uses the hashmap.
+const HashMapStats* hashmap_stats_of(const HashMap* map);
+void      hashmap_stats(const HashMap* map, FILE* file);
+#endif
+
 #endif  // TKB_INCLUDE_MAP_H
 
 
-#ifdef TKB_MAP_IMPLEMENTATION
+#if defined(TKB_MAP_IMPLEMENTATION) && !defined(TKB_MAP_IMPLEMENTED)
+#define TKB_MAP_IMPLEMENTED
+
+#ifdef TKB_MAP_STATS
+#include <time.h>
+
+/// Adds to a counter of the stats. Lookups count through the const
+/// hashmap, and may do so from several threads, so the counters are
+/// added to atomically. Nothing is ordered by them, hence relaxed.
+static inline void hashmap_stats_add(const u64* counter, u64 amount) {
+    __atomic_fetch_add((u64*)counter, amount, __ATOMIC_RELAXED);
+}
+
+/// Returns a time in nanoseconds for timing the grows. The monotonic
+/// clock is only declared with _POSIX_C_SOURCE (or _DEFAULT_SOURCE),
+/// which -std=c99 doesn't define, so this falls back to the processor
+/// time of `clock` then.
+static inline u64 hashmap_stats_now(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000ULL + (u64)time.tv_nsec;
+#else
+    return (u64)((double)clock() * (1e9 / (double)CLOCKS_PER_SEC));
+#endif
+}
+#endif
 
 /// How many percentage of the index capacity that
 /// should be full before it reallocates.
@@ -105,13 +415,39 @@ static const float HASHMAP_DEFAULT_GROW_FACTOR = 1.5f;
 /// the value that is used to mark a slot as deleted.
 static const size_t HASHMAP_EMPTY_SLOT = 0xFFFFFFFFFFFFFFFFULL;
 
+/// A load factor that works well with HASHMAP_OPTION_GROUPS,
+/// as most probes are resolved by one or two group matches.
+static const float HASHMAP_GROUP_LOAD_FACTOR = 0.875f;
+
+/// The number of control bytes that are matched at once
+/// when the hashmap uses HASHMAP_OPTION_GROUPS.
+#define HASHMAP_GROUP_WIDTH 16
+
+/// The largest capacity that is kept without indices with
+/// HASHMAP_OPTION_SMALL. It must not be more than the first
+/// chunk of HASHMAP_OPTION_STABLE, so the keys are together.
+#define HASHMAP_SMALL_CAPACITY 16
+
+/// Control bytes for indices that don't hold a slot. Both
+/// have the high bit set, while a used index stores 7 bits
+/// of the hash.
+static const u8 HASHMAP_CONTROL_EMPTY   = 0x80;
+static const u8 HASHMAP_CONTROL_DELETED = 0xFE;
+
+// The hash and compare functions used by MAP_DEFINE_C. Use
+// MAP_DEFINE_C_WITH to pick other functions for a map.
+#ifndef MAP_HASH_FUNCTION
 #define MAP_HASH_FUNCTION    hash_string
+#endif
+#ifndef MAP_COMPARE_FUNCTION
 #define MAP_COMPARE_FUNCTION compare_string
+#endif
 
 static inline size_t ceil(float x) {
     return (size_t)x + 1;
 }
 
+#ifndef ALLOCATOR
 static inline size_t round_up_to_nearest_power_of_2(size_t v) {
     v--;
     v |= v >> 1;
@@ -119,11 +455,34 @@ static inline size_t round_up_to_nearest_power_of_2(size_t v) {
     v |= v >> 4;
     v |= v >> 8;
     v |= v >> 16;
+#if SIZE_MAX > 0xFFFFFFFF
     v |= v >> 32;
+#endif
     v++;
 
     return v;
 }
+#endif  // allocator.h has its own.
+
+static inline size_t hashmap_ctz(u64 x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)__builtin_ctzll(x);
+#else
+    size_t n = 0;
+    while (!(x & 1)) { x >>= 1; ++n; }
+    return n;
+#endif
+}
+
+static inline size_t hashmap_clz(u64 x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)__builtin_clzll(x);
+#else
+    size_t n = 0;
+    while (!(x & 0x8000000000000000ULL)) { x <<= 1; ++n; }
+    return n;
+#endif
+}
 
 static inline HashMapHeader* hashmap_header(const HashMap* hashmap) {
     return (HashMapHeader*)(hashmap) - 1;
@@ -153,9 +512,17 @@ static inline size_t hashmap_index_mask(size_t capacity) {
     else                             return 0xFFFFFFFFFFFFFFFFULL;
 }
 
-static inline size_t hashmap_index_capacity(size_t capacity, u8 load_factor) {
+static inline size_t hashmap_index_capacity(size_t capacity, u8 load_factor, u16 options) {
+    if ((options & HASHMAP_OPTION_SMALL) && capacity <= HASHMAP_SMALL_CAPACITY)
+        return 0;
+
     float factor = 100.0f / (float)load_factor;
-    return round_up_to_nearest_power_of_2(ceil(factor * (float) capacity));
+    size_t index_capacity = round_up_to_nearest_power_of_2(ceil(factor * (float) capacity));
+
+    // A group must never wrap around onto itself.
+    if ((options & HASHMAP_OPTION_GROUPS) && index_capacity < HASHMAP_GROUP_WIDTH)
+        index_capacity = HASHMAP_GROUP_WIDTH;
+    return index_capacity;
 }
 
 int hashmap_set_load_factor(HashMap* map, float load_factor) {
@@ -176,384 +543,3082 @@ int hashmap_set_grow_factor(HashMap* map, float grow_factor) {
     return 1;
 }
 
-static inline size_t hashmap_total_size(size_t capacity, size_t index_capacity, size_t index_stride, size_t key_stride, size_t value_stride) {
-    size_t total_size =
-        sizeof(HashMapHeader) +                             // Header
-        (index_capacity * index_stride) +                   // Indices
-        (capacity * key_stride) +                           // Keys
-        (capacity * value_stride);                          // Values
-    return total_size;
+/// Rounds the offset up so that the array following
+/// it is aligned for any of the key and value types.
+static inline size_t hashmap_align(size_t offset) {
+    return (offset + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
 }
 
-size_t hashmap_count(const HashMap* hashmap) {
-    return hashmap_header(hashmap)->count;
+/// The alignment of a type of `stride` bytes, as far as it can be
+/// told from the stride alone: its lowest set bit, up to `sizeof(size_t)`.
+static inline size_t hashmap_stride_alignment(size_t stride) {
+    if (stride == 0)
+        return 1;
+    size_t alignment = stride & (0 - stride);
+    return (alignment > sizeof(size_t)) ? sizeof(size_t) : alignment;
 }
 
-size_t hashmap_capacity(const HashMap* hashmap) {
-    return hashmap_header(hashmap)->capacity;
+/// The offset of the value in an entry with `HASHMAP_OPTION_INTERLEAVED`.
+static inline size_t hashmap_entry_value_offset(size_t key_stride, size_t value_stride) {
+    size_t alignment = hashmap_stride_alignment(value_stride);
+    return (key_stride + alignment - 1) & ~(alignment - 1);
 }
 
-u8* hashmap_keys(const HashMap* hashmap) {
-    HashMapHeader* header = hashmap_header(hashmap);
-    size_t index_stride = hashmap_index_stride(header->capacity);
-    size_t offset = header->index_capacity * index_stride;
-    return (u8*)hashmap + offset;
+/// The stride of an entry with `HASHMAP_OPTION_INTERLEAVED`, padded
+/// so that both the key and the value of the next one are aligned.
+static inline size_t hashmap_entry_stride(size_t key_stride, size_t value_stride) {
+    size_t key_alignment   = hashmap_stride_alignment(key_stride);
+    size_t value_alignment = hashmap_stride_alignment(value_stride);
+    size_t alignment       = (key_alignment > value_alignment) ? key_alignment : value_alignment;
+    size_t size            = hashmap_entry_value_offset(key_stride, value_stride) + value_stride;
+    return (size + alignment - 1) & ~(alignment - 1);
 }
 
-void* hashmap_values(const HashMap* hashmap) {
-    HashMapHeader* header = hashmap_header(hashmap);
-    size_t index_stride = hashmap_index_stride(header->capacity);
-    size_t offset =
-            header->index_capacity * index_stride +
-            (header->capacity * sizeof(const char*));
-    return (u8*)hashmap + offset;
+/// The bytes per entry of the keys and of the values arrays. With
+/// `HASHMAP_OPTION_INTERLEAVED`, the keys hold the whole entries.
+static inline size_t hashmap_keys_row(size_t key_stride, size_t value_stride, u16 options) {
+    return (options & HASHMAP_OPTION_INTERLEAVED) ? hashmap_entry_stride(key_stride, value_stride) : key_stride;
 }
 
-HashMap* hashmap_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride) {
-    if (load_factor < 0.01f || load_factor > 1.0f || capacity == 0)
-        return NULL;
+static inline size_t hashmap_values_row(size_t value_stride, u16 options) {
+    return (options & HASHMAP_OPTION_INTERLEAVED) ? 0 : value_stride;
+}
 
-    u8 load = (u8)(load_factor * 100.0f);
-    u8 grow = (u8)(HASHMAP_DEFAULT_GROW_FACTOR * 100.0f);
+static inline size_t hashmap_keys_offset(size_t index_capacity, size_t index_stride) {
+    return hashmap_align(index_capacity * index_stride);
+}
 
-    size_t index_capacity = hashmap_index_capacity(capacity, load);
-    size_t index_mask     = hashmap_index_mask(index_capacity);
-    size_t index_stride   = hashmap_index_stride(index_capacity);
-    size_t total_size     = hashmap_total_size(capacity, index_capacity, index_stride, key_stride, value_stride);
+static inline size_t hashmap_values_offset(size_t capacity, size_t index_capacity, size_t index_stride, size_t key_stride, size_t value_stride, u16 options) {
+    return hashmap_keys_offset(index_capacity, index_stride) + hashmap_align(capacity * hashmap_keys_row(key_stride, value_stride, options));
+}
 
-    HashMapHeader* header = allocate(allocator, total_size);
-    if (header == NULL)
-        return NULL;
+static inline size_t hashmap_hashes_offset(size_t capacity, size_t index_capacity, size_t index_stride, size_t key_stride, size_t value_stride, u16 options) {
+    return hashmap_values_offset(capacity, index_capacity, index_stride, key_stride, value_stride, options) + hashmap_align(capacity * hashmap_values_row(value_stride, options));
+}
 
-    // Clear the indices to be dead. This is important since we use the index as a sentinel
-    // to check if the slot is empty.
-    memset(header+1, (u8)HASHMAP_EMPTY_SLOT, index_capacity * index_stride);
+/// The number of entries that are stored in the same block
+/// as the indices, which is none if they're in chunks.
+static inline size_t hashmap_dense_capacity(size_t capacity, u16 options) {
+    return (options & HASHMAP_OPTION_STABLE) ? 0 : capacity;
+}
 
-    *header = (HashMapHeader) {
-        .allocator      = allocator,
-        .count          = 0,
-        .capacity       = capacity,
-        .index_capacity = index_capacity,
-        .index_mask     = index_mask,
-        .load_factor    = load,
-        .grow_factor    = grow,
-        .key_stride     = key_stride,
-        .value_stride   = value_stride,
-        .index_stride   = index_stride,
+static inline size_t hashmap_control_offset(size_t capacity, size_t index_capacity, size_t index_stride, size_t key_stride, size_t value_stride, u16 options) {
+    capacity = hashmap_dense_capacity(capacity, options);
+    size_t offset = hashmap_hashes_offset(capacity, index_capacity, index_stride, key_stride, value_stride, options);
+    if (options & HASHMAP_OPTION_STORE_HASH)
+        offset += capacity * sizeof(size_t);
+    return offset;
+}
 
-    };
-    return (HashMap*)(header + 1);
+static inline size_t hashmap_total_size(size_t capacity, size_t index_capacity, size_t index_stride, size_t key_stride, size_t value_stride, u16 options) {
+    capacity = hashmap_dense_capacity(capacity, options);
+    size_t total_size =
+        sizeof(HashMapHeader) +                                                                                 // Header
+        hashmap_control_offset(capacity, index_capacity, index_stride, key_stride, value_stride, options);     // Indices, keys, values and hashes
+    if (options & HASHMAP_OPTION_GROUPS)
+        total_size += index_capacity + HASHMAP_GROUP_WIDTH;                                                     // Control bytes
+
+    // The indices are loaded a whole size_t at a time, which reads
+    // past the last one when nothing follows them (with STABLE).
+    return total_size + sizeof(size_t);
 }
 
-void hashmap_free(HashMap** map) {
-    HashMapHeader* header = hashmap_header(*map);
-    size_t index_capacity = header->index_capacity;
-    size_t index_stride   = header->index_stride;
-    size_t key_stride     = header->key_stride;
-    size_t value_stride   = header->value_stride;
-    size_t total_size     = hashmap_total_size(header->capacity, index_capacity, index_stride, key_stride, value_stride);
-    deallocate(header->allocator, header, total_size);
-    *map = NULL;
+static inline u8* hashmap_indices_of(const HashMapHeader* header) {
+    return (u8*)(header + 1);
 }
 
-void hashmap_grow(HashMap** map, hash_function hash_key, compare_function compare_key);
+static inline u8* hashmap_keys_of(const HashMapHeader* header) {
+    return hashmap_indices_of(header) + hashmap_keys_offset(header->index_capacity, header->index_stride);
+}
 
-void* hashmap_get(const HashMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
-    HashMapHeader* header = hashmap_header(map);
-    size_t capacity       = header->capacity;
-    size_t key_stride     = header->key_stride;
-    size_t value_stride   = header->value_stride;
-    size_t index_capacity = header->index_capacity;
-    size_t index_stride   = header->index_stride;
-    size_t index_mask     = header->index_mask;
-    size_t count          = header->count;
-    size_t counter        = count;
+/// Returns the first value. With `HASHMAP_OPTION_INTERLEAVED`,
+/// that's in the first entry, after its key.
+static inline u8* hashmap_values_of(const HashMapHeader* header) {
+    if (header->options & HASHMAP_OPTION_INTERLEAVED)
+        return hashmap_keys_of(header) + header->value_offset;
+    size_t capacity = hashmap_dense_capacity(header->capacity, header->options);
+    return hashmap_indices_of(header) + hashmap_values_offset(capacity, header->index_capacity, header->index_stride, header->key_stride, header->value_stride, header->options);
+}
 
-    const u8* indices = (u8*)map;
-    const u8* keys    = (u8*)indices + index_capacity * index_stride;
-          u8* values  = (u8*)keys + capacity * key_stride;
+/// Returns the stored hashes, or NULL if the hashmap
+/// wasn't created with `HASHMAP_OPTION_STORE_HASH`.
+static inline size_t* hashmap_hashes_of(const HashMapHeader* header) {
+    if (!(header->options & HASHMAP_OPTION_STORE_HASH))
+        return NULL;
+    size_t capacity = hashmap_dense_capacity(header->capacity, header->options);
+    return (size_t*)(hashmap_indices_of(header) + hashmap_hashes_offset(capacity, header->index_capacity, header->index_stride, header->key_stride, header->value_stride, header->options));
+}
 
-    const size_t deleted_slot = index_mask - 1;
+/// Returns the control bytes, or NULL if the hashmap
+/// wasn't created with `HASHMAP_OPTION_GROUPS`.
+static inline u8* hashmap_control_of(const HashMapHeader* header) {
+    if (!(header->options & HASHMAP_OPTION_GROUPS))
+        return NULL;
+    return hashmap_indices_of(header) + hashmap_control_offset(header->capacity, header->index_capacity, header->index_stride, header->key_stride, header->value_stride, header->options);
+}
 
-    size_t hash_mask = index_capacity - 1;
-    size_t hash      = hash_key(key, key_stride);
-    do {
-        size_t index = hash & hash_mask;
-        size_t slot  = *(size_t*)(indices + index * index_stride) & index_mask;
+static inline size_t hashmap_header_total_size(const HashMapHeader* header) {
+    return hashmap_total_size(header->capacity, header->index_capacity, header->index_stride, header->key_stride, header->value_stride, header->options);
+}
 
-        if (slot >= deleted_slot) {
-            return NULL;
-        }
+/// The distance from one key to the next, and from one value
+/// to the next, which is the entry with `HASHMAP_OPTION_INTERLEAVED`.
+static inline size_t hashmap_key_step(const HashMapHeader* header) {
+    return (header->options & HASHMAP_OPTION_INTERLEAVED) ? header->entry_stride : header->key_stride;
+}
 
-        const u8* existing_key = keys + slot * key_stride;
-        if (compare_key(key, existing_key, key_stride) == 0) {
-            return values + slot * value_stride;
-        }
+static inline size_t hashmap_value_step(const HashMapHeader* header) {
+    return (header->options & HASHMAP_OPTION_INTERLEAVED) ? header->entry_stride : header->value_stride;
+}
 
-        hash = (hash + 1) & hash_mask;
-    } while (--counter);
 
-    return NULL;
+// ---- Chunked storage (HASHMAP_OPTION_STABLE) ----
+//
+// Chunk `c` holds `HASHMAP_CHUNK_BASE << c` entries, starting at
+// slot `HASHMAP_CHUNK_BASE * (2^c - 1)`, so the chunk of a slot is
+// found with a single clz. Each chunk is laid out like the dense
+// part of the block: keys, values and then the hashes.
+
+/// The number of entries in the first chunk.
+#define HASHMAP_CHUNK_BASE 16
+
+/// The size of the chunk table, which is enough
+/// for `HASHMAP_CHUNK_BASE * 2^48` entries.
+#define HASHMAP_CHUNK_COUNT 48
+
+static inline size_t hashmap_chunk_of(size_t slot) {
+    return 63 - hashmap_clz((u64)(slot / HASHMAP_CHUNK_BASE + 1));
 }
 
+static inline size_t hashmap_chunk_first(size_t chunk) {
+    return HASHMAP_CHUNK_BASE * (((size_t)1 << chunk) - 1);
+}
 
-int hashmap_set(HashMap** map, const void* key, const void* value, hash_function hash_key, compare_function compare_key) {
-    HashMapHeader* header = hashmap_header(*map);
-    size_t capacity       = header->capacity;
-    size_t key_stride     = header->key_stride;
-    size_t value_stride   = header->value_stride;
-    size_t index_capacity = header->index_capacity;
-    size_t index_stride   = header->index_stride;
-    size_t index_mask     = header->index_mask;
-    size_t count          = header->count;
-    size_t counter        = count;
+/// The offset of the first value and of the first hash in a chunk
+/// of `entries` entries.
+static inline size_t hashmap_chunk_values_offset(const HashMapHeader* header, size_t entries) {
+    if (header->options & HASHMAP_OPTION_INTERLEAVED)
+        return header->value_offset;
+    return hashmap_align(entries * header->key_stride);
+}
 
-    u8* indices = (u8*)*map;
-    u8* keys    = (u8*)indices + index_capacity * index_stride;
-    u8* values  = (u8*)keys + capacity * key_stride;
+static inline size_t hashmap_chunk_hashes_offset(const HashMapHeader* header, size_t entries) {
+    size_t key_row   = hashmap_keys_row(header->key_stride, header->value_stride, header->options);
+    size_t value_row = hashmap_values_row(header->value_stride, header->options);
+    return hashmap_align(entries * key_row) + hashmap_align(entries * value_row);
+}
 
-    const size_t deleted_slot = index_mask - 1;
+static inline size_t hashmap_chunk_size(const HashMapHeader* header, size_t chunk) {
+    size_t entries = (size_t)HASHMAP_CHUNK_BASE << chunk;
+    size_t size    = hashmap_chunk_hashes_offset(header, entries);
+    if (header->options & HASHMAP_OPTION_STORE_HASH)
+        size += entries * sizeof(size_t);
+    return size;
+}
 
-    size_t hash_mask  = index_capacity - 1;
-    size_t hash       = hash_key(key, key_stride);
-    do {
-        size_t index = hash & hash_mask;
-        size_t slot  = *(size_t*)(indices + index * index_stride) & index_mask;
+/// The number of chunks needed to hold `capacity` entries.
+static inline size_t hashmap_chunks_needed(size_t capacity) {
+    return (capacity == 0) ? 0 : hashmap_chunk_of(capacity - 1) + 1;
+}
 
-        if (slot >= deleted_slot) {
-            if (count >= capacity) {
-                hashmap_grow(map, hash_key, compare_key);
-                return hashmap_set(map, key, value, hash_key, compare_key);
-            }
+/// Allocates the chunks up to `capacity`, and the chunk table
+/// if needed. Chunks that are already allocated are kept, also
+/// on failure, where 0 is returned.
+static int hashmap_chunks_reserve(HashMapHeader* header, size_t capacity) {
+    size_t needed = hashmap_chunks_needed(capacity);
+    if (needed > HASHMAP_CHUNK_COUNT)
+        return 0;
 
-            size_t i = header->count++;
-            memcpy(indices + index * index_stride, &i,    index_stride);
-            memcpy(keys    + i     * key_stride,   key,   key_stride);
-            memcpy(values  + i     * value_stride, value, value_stride);
-            return 1;
-        }
+    if (header->chunks == NULL) {
+        header->chunks = allocate(header->allocator, HASHMAP_CHUNK_COUNT * sizeof(u8*));
+        if (header->chunks == NULL)
+            return 0;
+        memset(header->chunks, 0, HASHMAP_CHUNK_COUNT * sizeof(u8*));
+    }
 
-        u8* existing_key = keys + slot * key_stride;
-        if (compare_key(key, existing_key, key_stride) == 0) {
-            memcpy(values + slot * value_stride, value, value_stride);
+    for (size_t chunk = 0; chunk < needed; ++chunk) {
+        if (header->chunks[chunk] != NULL)
+            continue;
+        header->chunks[chunk] = allocate(header->allocator, hashmap_chunk_size(header, chunk));
+        if (header->chunks[chunk] == NULL)
             return 0;
-        }
+    }
+    return 1;
+}
 
-        hash = (hash + 1) & hash_mask;
+/// Deallocates the chunks that aren't needed for `capacity`
+/// entries. With a capacity of 0, the chunk table as well.
+static void hashmap_chunks_release(HashMapHeader* header, size_t capacity) {
+    if (header->chunks == NULL)
+        return;
 
+    for (size_t chunk = hashmap_chunks_needed(capacity); chunk < HASHMAP_CHUNK_COUNT; ++chunk) {
+        if (header->chunks[chunk] == NULL)
+            break;
+        deallocate(header->allocator, header->chunks[chunk], hashmap_chunk_size(header, chunk));
+        header->chunks[chunk] = NULL;
+    }
 
-    // This is necessary to avoid infinite loops when
-    // the load factor is 1 and the hashmap is full.
-    // We could check whether the second to last element
-    // inserted requires the hashmap to grow, but that
-    // would require the hashmap to regrow before hitting
-    // the capacity. This is probably not expected as the
-    // user would not expect the hashmap to grow when the
-    // load factor is 1 and haven't reached the capacity.
-    // We could check this before the loop, but that would
-    // require an extra branch for every insertion, instead
-    // of just the one's that collide.
-    } while (--counter);
+    if (capacity == 0) {
+        deallocate(header->allocator, header->chunks, HASHMAP_CHUNK_COUNT * sizeof(u8*));
+        header->chunks = NULL;
+    }
+}
 
-    hashmap_grow(map, hash_key, compare_key);
-    return hashmap_set(map, key, value, hash_key, compare_key);
+/// Returns the block that holds the dense entry in the slot. During
+/// an incremental grow, the slots from `copied` up to the old count
+/// haven't been copied yet and are still read from the previous block.
+static inline const HashMapHeader* hashmap_slot_block(const HashMapHeader* header, size_t slot) {
+    const HashMapHeader* previous = header->previous;
+    return (previous != NULL && slot >= header->copied && slot < previous->count) ? previous : header;
 }
 
+/// Copies up to `steps` of the entries that are still in the
+/// previous block after an incremental grow. The previous count
+/// never changes, so it marks where the entries that were there
+/// when growing end.
+static void hashmap_copy_entries(HashMapHeader* header, size_t steps) {
+    const HashMapHeader* previous = header->previous;
+    size_t remaining = previous->count - header->copied;
+    size_t count     = (steps < remaining) ? steps : remaining;
+    size_t first     = header->copied;
+
+    // The chunks are shared between both blocks.
+    if (header->chunks == NULL && count > 0) {
+        size_t  keys_row   = hashmap_keys_row(header->key_stride, header->value_stride, header->options);
+        size_t  values_row = hashmap_values_row(header->value_stride, header->options);
+        size_t* hashes     = hashmap_hashes_of(header);
+        memcpy(hashmap_keys_of(header)   + first * keys_row,   hashmap_keys_of(previous)   + first * keys_row,   count * keys_row);
+        memcpy(hashmap_values_of(header) + first * values_row, hashmap_values_of(previous) + first * values_row, count * values_row);
+        if (hashes != NULL)
+            memcpy(hashes + first, hashmap_hashes_of(previous) + first, count * sizeof(size_t));
+    }
+    header->copied = first + count;
+}
 
-void* hashmap_del(HashMap** map, const void* key, hash_function hash_key, compare_function compare_key) {
-    HashMapHeader* header = hashmap_header(*map);
-    size_t capacity       = header->capacity;
-    size_t key_stride     = header->key_stride;
-    size_t value_stride   = header->value_stride;
-    size_t index_capacity = header->index_capacity;
-    size_t index_stride   = header->index_stride;
-    size_t index_mask     = header->index_mask;
-    size_t count          = header->count;
-    size_t counter        = count;
+/// Returns the key in the slot, wherever it's stored.
+static inline u8* hashmap_slot_key(const HashMapHeader* header, size_t slot) {
+    if (header->chunks == NULL)
+        return hashmap_keys_of(hashmap_slot_block(header, slot)) + slot * hashmap_key_step(header);
 
-    u8* indices = (u8*)*map;
-    u8* keys    = (u8*)indices + index_capacity * index_stride;
-    u8* values  = (u8*)keys + capacity * key_stride;
+    size_t chunk = hashmap_chunk_of(slot);
+    return header->chunks[chunk] + (slot - hashmap_chunk_first(chunk)) * hashmap_key_step(header);
+}
 
-    const size_t deleted_slot = index_mask - 1;
+static inline u8* hashmap_slot_value(const HashMapHeader* header, size_t slot) {
+    if (header->chunks == NULL)
+        return hashmap_values_of(hashmap_slot_block(header, slot)) + slot * hashmap_value_step(header);
 
-    size_t hash_mask  = index_capacity - 1;
-    size_t hash       = hash_key(key, key_stride);
-    do {
-        size_t index = hash & hash_mask;
-        size_t slot  = *(size_t*)(indices + index * index_stride) & index_mask;
+    size_t chunk   = hashmap_chunk_of(slot);
+    size_t entries = (size_t)HASHMAP_CHUNK_BASE << chunk;
+    return header->chunks[chunk] + hashmap_chunk_values_offset(header, entries) + (slot - hashmap_chunk_first(chunk)) * hashmap_value_step(header);
+}
 
-        if (slot >= deleted_slot) {
-            return NULL;
-        }
+/// Returns the stored hash in the slot, or NULL if the hashmap
+/// wasn't created with `HASHMAP_OPTION_STORE_HASH`.
+static inline size_t* hashmap_slot_hash(const HashMapHeader* header, size_t slot) {
+    if (!(header->options & HASHMAP_OPTION_STORE_HASH))
+        return NULL;
+    if (header->chunks == NULL)
+        return hashmap_hashes_of(hashmap_slot_block(header, slot)) + slot;
 
-        u8* existing_key = keys + slot * key_stride;
-        if (compare_key(key, existing_key, key_stride) == 0) {
-
-            // If the slot is not the last slot, we need to move the last slot
-            // to the slot we just deleted.
-            if (slot != count - 1) {
-
-                // Find the last slot by iterating through the indices
-                // and find the last slot that points to the end.
-                size_t last_slot;
-                for (size_t i = 0; i < index_capacity; ++i) {
-                    last_slot = *(size_t*)(indices + i * index_stride) & index_mask;
-                    if (last_slot == count - 1) {
-                        // Copy the last slot to the slot we just deleted.
-                        memcpy(indices + i * index_stride, &slot, index_stride);
-                        // Mark the slot as deleted
-                        memcpy(indices + index * index_stride, &deleted_slot, index_stride);
-                        break;
-                    }
-                }
+    size_t chunk   = hashmap_chunk_of(slot);
+    size_t entries = (size_t)HASHMAP_CHUNK_BASE << chunk;
+    u8*    hashes  = header->chunks[chunk] + hashmap_chunk_hashes_offset(header, entries);
+    return (size_t*)hashes + (slot - hashmap_chunk_first(chunk));
+}
 
-                // Copy the last key to the slot we just deleted.
-                u8* key_a = keys + slot * key_stride;
-                u8* key_b = keys + last_slot * key_stride;
-                memcpy(key_a, key_b, key_stride);
-
-                // Copy the last value to the slot we just deleted.
-                u8* val_a = values + slot * value_stride;
-                u8* val_b = values + last_slot * value_stride;
-                memcpy(val_a, val_b, value_stride);
-            } else {
-                // Mark the slot as deleted
-                memcpy(indices + index * index_stride, &deleted_slot, index_stride);
-            }
+// ---- Owned strings (HASHMAP_OPTION_OWNED_KEYS) ----
+//
+// The strings of the keys are copied back to back into chunks,
+// each twice the size of the last, and the chunks are linked
+// from the newest to the oldest. A chunk is never moved, so a
+// key keeps pointing to its copy across grows.
 
-            header->count -= 1;
-            return values + slot * value_stride;
-        }
+#define HASHMAP_STRINGS_CHUNK_SIZE     4096
+#define HASHMAP_STRINGS_MAX_CHUNK_SIZE (1 << 20)
 
-        hash = (hash + 1) & hash_mask;
+typedef struct HashMapStrings {
+    /// The previous, older, chunk, or NULL.
+    struct HashMapStrings* next;
+    size_t size;
+    size_t used;
 
-    // This is necessary to avoid infinite loops when
-    // the load factor is 1 and the hashmap is full.
-    // We could check whether the second to last element
-    // inserted requires the hashmap to grow, but that
-    // would require the hashmap to regrow before hitting
-    // the capacity. This is probably not expected as the
-    // user would not expect the hashmap to grow when the
-    // load factor is 1 and haven't reached the capacity.
-    // We could check this before the loop, but that would
-    // require an extra branch for every insertion, instead
-    // of just the one's that collide.
-    } while (--counter);
+    // Following this header is:
+    // data[size]
+} HashMapStrings;
+
+/// Deallocates the chunk and all the chunks older than it.
+static void hashmap_strings_release(Allocator* allocator, HashMapStrings* chunk) {
+    (void)allocator;
+    while (chunk != NULL) {
+        HashMapStrings* next = chunk->next;
+        deallocate(allocator, chunk, sizeof(HashMapStrings) + chunk->size);
+        chunk = next;
+    }
+}
 
-    return NULL;
+/// Takes `size` bytes from the newest chunk, or from a new
+/// chunk of at least `minimum` bytes if it doesn't have room.
+/// Returns NULL if a new chunk couldn't be allocated.
+static char* hashmap_strings_allocate(HashMapHeader* header, size_t size, size_t minimum) {
+    HashMapStrings* chunk = header->strings;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = minimum;
+        if (chunk_size < size)
+            chunk_size = size;
+
+        HashMapStrings* fresh = allocate(header->allocator, sizeof(HashMapStrings) + chunk_size);
+        if (fresh == NULL)
+            return NULL;
+        *fresh = (HashMapStrings) { .next = chunk, .size = chunk_size, .used = 0 };
+        header->strings = chunk = fresh;
+    }
+
+    char* data = (char*)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    return data;
 }
 
+/// Returns the string of a `const char*` or `StringKey` key,
+/// and its length.
+static inline const char* hashmap_key_string(const HashMapHeader* header, const void* key, size_t* length) {
+    if (header->key_stride == sizeof(StringKey)) {
+        StringKey string;
+        memcpy(&string, key, sizeof(string));
+        *length = string.length;
+        return string.data;
+    }
 
+    const char* data;
+    memcpy(&data, key, sizeof(data));
+    *length = strlen(data);
+    return data;
+}
 
-void hashmap_grow(HashMap** map, hash_function hash_key, compare_function compare_key) {
-    HashMapHeader* old_header = hashmap_header(*map);
-    size_t old_capacity       = old_header->capacity;
-    size_t old_index_capacity = old_header->index_capacity;
-    size_t old_index_stride   = old_header->index_stride;
-
-    Allocator* allocator = old_header->allocator;
-    size_t count         = old_header->count;
-    u8     load_factor   = old_header->load_factor;
-    size_t key_stride    = old_header->key_stride;
-    size_t value_stride  = old_header->value_stride;
-    u8     grow_factor   = old_header->grow_factor;
-
-    size_t new_capacity       = hashmap_grow_capacity(old_capacity, grow_factor);
-    size_t new_index_capacity = hashmap_index_capacity(new_capacity, load_factor);
-    size_t new_index_stride   = hashmap_index_stride(new_index_capacity);
-    size_t new_index_mask     = hashmap_index_mask(new_index_capacity);
-
-    size_t old_total_size = hashmap_total_size(old_capacity, old_index_capacity, old_index_stride, key_stride, value_stride);
-    size_t new_total_size = hashmap_total_size(new_capacity, new_index_capacity, new_index_stride, key_stride, value_stride);
-    HashMapHeader* new_header = allocate(allocator, new_total_size);
-    if (new_header == NULL)
-        return;
+/// Copies the string of the key into the hashmap, and writes the
+/// key pointing to the copy to `owned`, which has to have room for
+/// a StringKey. Returns `owned`, or NULL if it couldn't be copied.
+static const void* hashmap_own_key(HashMapHeader* header, const void* key, u8* owned) {
+    size_t      length;
+    const char* data = hashmap_key_string(header, key, &length);
 
-    u8* old_indices = (u8*)*map;
-    u8* old_keys    = (u8*)old_indices + old_index_capacity * old_index_stride;
-    u8* old_values  = (u8*)old_keys + old_capacity * key_stride;
+    size_t minimum = (header->strings == NULL) ? HASHMAP_STRINGS_CHUNK_SIZE : header->strings->size * 2;
+    if (minimum > HASHMAP_STRINGS_MAX_CHUNK_SIZE)
+        minimum = HASHMAP_STRINGS_MAX_CHUNK_SIZE;
 
-    memset(new_header+1, (u8)HASHMAP_EMPTY_SLOT, new_index_capacity * new_index_stride);
-    *new_header = (HashMapHeader) {
-            .allocator      = allocator,
-            .count          = 0,
-            .capacity       = new_capacity,
-            .index_capacity = new_index_capacity,
-            .index_mask     = new_index_mask,
-            .load_factor    = load_factor,
-            .grow_factor    = grow_factor,
-            .key_stride     = key_stride,
-            .value_stride   = value_stride,
-            .index_stride   = new_index_stride,
-    };
+    char* copy = hashmap_strings_allocate(header, length + 1, minimum);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+
+    // Both kinds of keys start with the pointer to the string.
+    const char* pointer = copy;
+    memcpy(owned, key, header->key_stride);
+    memcpy(owned, &pointer, sizeof(pointer));
+    return owned;
+}
 
-    *map = (HashMap*)(new_header + 1);
+/// Copies the strings of all keys into one chunk of exactly their
+/// size, and deallocates the old chunks with the strings of the
+/// deleted keys. Returns 0 if it couldn't be allocated, in which
+/// case the keys still point to the old chunks.
+static int hashmap_strings_compact(HashMapHeader* header) {
+    HashMapStrings* old   = header->strings;
+    size_t          count = header->count;
+    size_t          total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t length;
+        hashmap_key_string(header, hashmap_slot_key(header, i), &length);
+        total += length + 1;
+    }
+
+    if (old != NULL && old->next == NULL && old->used == total)
+        return 1;
+
+    header->strings = NULL;
+    if (total > 0 && hashmap_strings_allocate(header, 0, total) == NULL) {
+        header->strings = old;
+        return 0;
+    }
+
+    u8 owned[sizeof(StringKey)];
     for (size_t i = 0; i < count; ++i) {
-        u8* key   = old_keys   + i * old_header->key_stride;
-        u8* value = old_values + i * old_header->value_stride;
-        hashmap_set(map, key, value, hash_key, compare_key);
+        u8* key = hashmap_slot_key(header, i);
+        hashmap_own_key(header, key, owned);
+        memcpy(key, owned, header->key_stride);
     }
+    hashmap_strings_release(header->allocator, old);
+    return 1;
+}
 
-    deallocate(allocator, old_header, old_total_size);
+// ---- Prefilter (HASHMAP_OPTION_FILTER) ----
+//
+// A blocked counting Bloom filter. The hash picks a block of
+// 128 4-bit counters, which is one cache line, and 4 of the
+// counters in it. A key can only be in the hashmap if all of
+// its counters are set. A counter that reaches 15 is never
+// decremented again, as it no longer knows how many keys it
+// counts, which only makes the filter a little less selective.
+
+#define HASHMAP_FILTER_BLOCK   64
+#define HASHMAP_FILTER_ENTRIES 16
+#define HASHMAP_FILTER_PROBES  4
+
+/// The number of blocks for the capacity, as a power of 2.
+static inline size_t hashmap_filter_blocks(size_t capacity) {
+    size_t blocks = 1;
+    while (blocks * HASHMAP_FILTER_ENTRIES < capacity)
+        blocks <<= 1;
+    return blocks;
 }
 
+/// The filter is allocated with a block to spare, so the
+/// blocks can be aligned to cache lines.
+static inline size_t hashmap_filter_size(size_t blocks) {
+    return (blocks + 1) * HASHMAP_FILTER_BLOCK;
+}
 
+/// Returns the block of the hash, and the 7 bit positions of
+/// its counters in `counters`. The block is picked from the
+/// high bits of the mixed hash, the counters from the low.
+static inline u8* hashmap_filter_block(const HashMapHeader* header, size_t hash, u64* counters) {
+    u64    mixed  = ((u64)hash ^ ((u64)hash >> 32)) * 0x9E3779B97F4A7C15ULL;
+    size_t blocks = ((size_t)header->filter + HASHMAP_FILTER_BLOCK - 1) & ~(size_t)(HASHMAP_FILTER_BLOCK - 1);
+    *counters = mixed >> 4;
+    return (u8*)blocks + ((size_t)(mixed >> 36) & header->filter_mask) * HASHMAP_FILTER_BLOCK;
+}
 
-size_t hash_string(const void* key, size_t stride) {
-    (void)stride;
-    const char* data = *(const char**) key;
-    size_t seed = 0;
-    for (size_t i = 0; data[i] != '\0'; ++i) {
-        seed ^= data[i] + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+static inline int hashmap_filter_may_contain(const HashMapHeader* header, size_t hash) {
+    u64 counters;
+    const u8* block = hashmap_filter_block(header, hash, &counters);
+    for (int i = 0; i < HASHMAP_FILTER_PROBES; ++i, counters >>= 7) {
+        size_t counter = (size_t)(counters & 127);
+        if (((block[counter >> 1] >> ((counter & 1) * 4)) & 15) == 0)
+            return 0;
     }
-    return seed;
+    return 1;
 }
 
-int compare_string(const void* key, const void* candidate, size_t stride) {
-    (void)stride;
-    const char* str_a = *(const char**)key;
-    const char* str_b = *(const char**)candidate;
-    for (size_t i = 0; str_a[i] != '\0' && str_b[i] != '\0'; ++i) {
-        if (str_a[i] != str_b[i]) {
-            return 1;
-        }
+static inline void hashmap_filter_add(HashMapHeader* header, size_t hash) {
+    u64 counters;
+    u8* block = hashmap_filter_block(header, hash, &counters);
+    for (int i = 0; i < HASHMAP_FILTER_PROBES; ++i, counters >>= 7) {
+        size_t counter = (size_t)(counters & 127);
+        size_t shift   = (counter & 1) * 4;
+        if (((block[counter >> 1] >> shift) & 15) != 15)
+            block[counter >> 1] += (u8)(1 << shift);
     }
-    return 0;
 }
-#endif  // TKB_MAP_IMPLEMENTATION
 
+static inline void hashmap_filter_remove(HashMapHeader* header, size_t hash) {
+    u64 counters;
+    u8* block = hashmap_filter_block(header, hash, &counters);
+    for (int i = 0; i < HASHMAP_FILTER_PROBES; ++i, counters >>= 7) {
+        size_t counter = (size_t)(counters & 127);
+        size_t shift   = (counter & 1) * 4;
+        size_t value   = (block[counter >> 1] >> shift) & 15;
+        if (value != 0 && value != 15)
+            block[counter >> 1] -= (u8)(1 << shift);
+    }
+}
 
+/// Clears the filter and counts the stored hash of every entry.
+static void hashmap_filter_count(HashMapHeader* header) {
+    memset(header->filter, 0, hashmap_filter_size(header->filter_mask + 1));
+    for (size_t i = 0; i < header->count; ++i)
+        hashmap_filter_add(header, *hashmap_slot_hash(header, i));
+}
 
-#define MAP_DEFINE_H(Class, prefix, KEY, VALUE)                                                                                                                                                                      \
-    static inline Class*  prefix##_new(Allocator* allocator, size_t capacity);                                 \
-    static inline Class*  prefix##_new_with_load_factor(Allocator* allocator, size_t capacity, float factor);  \
-    static inline size_t  prefix##_count(const Class* map);                                                    \
-    static inline size_t  prefix##_capacity(const Class* map);                                                 \
-    static inline KEY*    prefix##_keys(const Class* map);                                                     \
-    static inline VALUE*  prefix##_values(const Class* map);                                                   \
-    static inline VALUE*  prefix##_get(const Class* map, KEY key);                                             \
+/// Gives the filter the number of blocks for the capacity, and
+/// counts the entries into it if that changed. If the blocks
+/// couldn't be allocated, 0 is returned and the old filter is
+/// kept, which still works, only with more false positives.
+static int hashmap_filter_resize(HashMapHeader* header) {
+    size_t blocks = hashmap_filter_blocks(header->capacity);
+    if (header->filter != NULL && blocks == header->filter_mask + 1)
+        return 1;
+
+    u8* filter = allocate(header->allocator, hashmap_filter_size(blocks));
+    if (filter == NULL)
+        return 0;
+    if (header->filter != NULL)
+        deallocate(header->allocator, header->filter, hashmap_filter_size(header->filter_mask + 1));
+
+    header->filter      = filter;
+    header->filter_mask = blocks - 1;
+    hashmap_filter_count(header);
+    return 1;
+}
+
+/// Reads the slot stored at the index, which is either a
+/// position in the keys and values, or one of the empty
+/// and deleted sentinels.
+static inline size_t hashmap_load_slot(const u8* indices, size_t index, size_t index_stride, size_t index_mask) {
+    return *(size_t*)(indices + index * index_stride) & index_mask;
+}
+
+static inline void hashmap_store_slot(u8* indices, size_t index, size_t index_stride, size_t slot) {
+    memcpy(indices + index * index_stride, &slot, index_stride);
+}
+
+/// Finds the index that points to the slot by following the
+/// probe sequence of its hash, which is much shorter than
+/// searching through all of the indices. Returns
+/// `index_capacity` if no index points to the slot.
+static inline size_t hashmap_find_index_of_slot(const u8* indices, size_t index_capacity, size_t index_stride, size_t index_mask, size_t hash, size_t slot) {
+    size_t hash_mask = index_capacity - 1;
+    size_t index     = hash & hash_mask;
+    size_t counter   = index_capacity;
+    do {
+        size_t existing = hashmap_load_slot(indices, index, index_stride, index_mask);
+        if (existing == slot)
+            return index;
+        if (existing == index_mask)
+            break;
+        index = (index + 1) & hash_mask;
+    } while (--counter);
+    return index_capacity;
+}
+
+size_t hashmap_count(const HashMap* hashmap) {
+    return hashmap_header(hashmap)->count;
+}
+
+size_t hashmap_capacity(const HashMap* hashmap) {
+    return hashmap_header(hashmap)->capacity;
+}
+
+/// Whether the entries are spread over the previous block of an
+/// incremental grow, so they can't be handed out as one array.
+static inline int hashmap_is_migrating(const HashMapHeader* header) {
+    return header->previous != NULL && header->copied < header->previous->count;
+}
+
+u8* hashmap_keys(const HashMap* hashmap) {
+    const HashMapHeader* header = hashmap_header(hashmap);
+    return (header->chunks != NULL || (header->options & HASHMAP_OPTION_INTERLEAVED) || hashmap_is_migrating(header)) ? NULL : hashmap_keys_of(header);
+}
+
+void* hashmap_values(const HashMap* hashmap) {
+    const HashMapHeader* header = hashmap_header(hashmap);
+    return (header->chunks != NULL || (header->options & HASHMAP_OPTION_INTERLEAVED) || hashmap_is_migrating(header)) ? NULL : hashmap_values_of(header);
+}
+
+HashMapStrided hashmap_keys_strided(const HashMap* hashmap) {
+    const HashMapHeader* header = hashmap_header(hashmap);
+    return (HashMapStrided) {
+        .data   = (header->chunks != NULL || hashmap_is_migrating(header)) ? NULL : hashmap_keys_of(header),
+        .stride = hashmap_key_step(header),
+        .count  = header->count,
+    };
+}
+
+HashMapStrided hashmap_values_strided(const HashMap* hashmap) {
+    const HashMapHeader* header = hashmap_header(hashmap);
+    return (HashMapStrided) {
+        .data   = (header->chunks != NULL || hashmap_is_migrating(header)) ? NULL : hashmap_values_of(header),
+        .stride = hashmap_value_step(header),
+        .count  = header->count,
+    };
+}
+
+u8* hashmap_key_at(const HashMap* hashmap, size_t i) {
+    return hashmap_slot_key(hashmap_header(hashmap), i);
+}
+
+void* hashmap_value_at(const HashMap* hashmap, size_t i) {
+    return hashmap_slot_value(hashmap_header(hashmap), i);
+}
+
+/// Marks all indices as unused.
+static inline void hashmap_clear_indices(HashMapHeader* header) {
+    // Clear the indices to be dead. This is important since we use the index as a sentinel
+    // to check if the slot is empty.
+    memset(hashmap_indices_of(header), (u8)HASHMAP_EMPTY_SLOT, header->index_capacity * header->index_stride);
+
+    u8* control = hashmap_control_of(header);
+    if (control != NULL)
+        memset(control, HASHMAP_CONTROL_EMPTY, header->index_capacity + HASHMAP_GROUP_WIDTH);
+
+    header->tombstones = 0;
+}
+
+HashMap* hashmap_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride) {
+    return hashmap_new_with_options(allocator, capacity, load_factor, key_stride, value_stride, HASHMAP_OPTION_NONE);
+}
+
+HashMap* hashmap_new_with_options(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options) {
+    if (load_factor < 0.01f || load_factor > 1.0f || capacity == 0)
+        return NULL;
+    if ((options & HASHMAP_OPTION_ROBIN_HOOD) && (options & HASHMAP_OPTION_GROUPS))
+        return NULL;
+    if ((options & HASHMAP_OPTION_OWNED_KEYS) && key_stride != sizeof(const char*) && key_stride != sizeof(StringKey))
+        return NULL;
+    if (options & (HASHMAP_OPTION_ROBIN_HOOD | HASHMAP_OPTION_FILTER))
+        options |= HASHMAP_OPTION_STORE_HASH;
+    if ((options & HASHMAP_OPTION_INTERLEAVED) && hashmap_entry_stride(key_stride, value_stride) > 0xFFFF)
+        return NULL;
+
+    u8 load = (u8)(load_factor * 100.0f);
+    u8 grow = (u8)(HASHMAP_DEFAULT_GROW_FACTOR * 100.0f);
+
+    size_t index_capacity = hashmap_index_capacity(capacity, load, (u16)options);
+    size_t index_mask     = hashmap_index_mask(index_capacity);
+    size_t index_stride   = hashmap_index_stride(index_capacity);
+    size_t total_size     = hashmap_total_size(capacity, index_capacity, index_stride, key_stride, value_stride, (u16)options);
+
+    HashMapHeader* header = allocate(allocator, total_size);
+    if (header == NULL)
+        return NULL;
+
+    *header = (HashMapHeader) {
+        .allocator      = allocator,
+        .count          = 0,
+        .capacity       = capacity,
+        .index_capacity = index_capacity,
+        .index_mask     = index_mask,
+        .tombstones     = 0,
+        .previous       = NULL,
+        .migrated       = 0,
+        .copied         = 0,
+        .chunks         = NULL,
+        .strings        = NULL,
+        .filter         = NULL,
+        .filter_mask    = 0,
+        .load_factor    = load,
+        .grow_factor    = grow,
+        .key_stride     = key_stride,
+        .value_stride   = value_stride,
+        .index_stride   = index_stride,
+        .options        = (u16)options,
+        .entry_stride   = (u16)hashmap_entry_stride(key_stride, value_stride),
+        .value_offset   = (u16)hashmap_entry_value_offset(key_stride, value_stride),
+    };
+    hashmap_clear_indices(header);
+
+    if ((options & HASHMAP_OPTION_STABLE) && !hashmap_chunks_reserve(header, capacity)) {
+        hashmap_chunks_release(header, 0);
+        deallocate(allocator, header, total_size);
+        return NULL;
+    }
+
+    if ((options & HASHMAP_OPTION_FILTER) && !hashmap_filter_resize(header)) {
+        hashmap_chunks_release(header, 0);
+        deallocate(allocator, header, total_size);
+        return NULL;
+    }
+
+    return (HashMap*)(header + 1);
+}
+
+void hashmap_free(HashMap** map) {
+    HashMapHeader* header = hashmap_header(*map);
+    if (header->previous != NULL)
+        deallocate(header->allocator, header->previous, hashmap_header_total_size(header->previous));
+    hashmap_chunks_release(header, 0);
+    hashmap_strings_release(header->allocator, header->strings);
+    if (header->filter != NULL)
+        deallocate(header->allocator, header->filter, hashmap_filter_size(header->filter_mask + 1));
+    deallocate(header->allocator, header, hashmap_header_total_size(header));
+    *map = NULL;
+}
+
+/// Swaps the bytes of two non-overlapping memory blocks.
+static inline void hashmap_swap(u8* a, u8* b, size_t size) {
+    u8 buffer[64];
+    while (size > 0) {
+        size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+        memcpy(buffer, a, n);
+        memcpy(a, b, n);
+        memcpy(b, buffer, n);
+        a += n; b += n; size -= n;
+    }
+}
+
+// ---- Group probing (HASHMAP_OPTION_GROUPS) ----
+//
+// The indices get a parallel array of control bytes, where
+// each used index holds 7 bits of the hash of its key. A
+// group of 16 control bytes is matched against those bits at
+// once, and only the matching indices are followed into the
+// keys. The control bytes are followed by a copy of the first
+// group, so a group can be loaded at any index without
+// wrapping. Groups are probed in triangular steps, which
+// visits every group when the index capacity is a power of 2.
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+
+/// How many bits each index takes up in a group mask.
+#define HASHMAP_GROUP_SHIFT 0
+
+static inline u64 hashmap_group_match(const u8* control, u8 value) {
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    return (u64)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+}
+
+static inline u64 hashmap_group_match_free(const u8* control) {
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    return (u64)_mm_movemask_epi8(group);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/// How many bits each index takes up in a group mask.
+#define HASHMAP_GROUP_SHIFT 2
+
+// NEON doesn't have a movemask, so narrow each byte into a
+// nibble and keep the high bit of each nibble.
+static inline u64 hashmap_group_mask(uint8x16_t matches) {
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) & 0x8888888888888888ULL;
+}
+
+static inline u64 hashmap_group_match(const u8* control, u8 value) {
+    return hashmap_group_mask(vceqq_u8(vld1q_u8(control), vdupq_n_u8(value)));
+}
+
+static inline u64 hashmap_group_match_free(const u8* control) {
+    return hashmap_group_mask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(control)), vdupq_n_s8(0)));
+}
+#else
+/// How many bits each index takes up in a group mask.
+#define HASHMAP_GROUP_SHIFT 0
+
+static inline u64 hashmap_group_match(const u8* control, u8 value) {
+    u64 mask = 0;
+    for (size_t i = 0; i < HASHMAP_GROUP_WIDTH; ++i)
+        mask |= (u64)(control[i] == value) << i;
+    return mask;
+}
+
+static inline u64 hashmap_group_match_free(const u8* control) {
+    u64 mask = 0;
+    for (size_t i = 0; i < HASHMAP_GROUP_WIDTH; ++i)
+        mask |= (u64)(control[i] >> 7) << i;
+    return mask;
+}
+#endif
+
+static inline u64 hashmap_group_match_empty(const u8* control) {
+    return hashmap_group_match(control, HASHMAP_CONTROL_EMPTY);
+}
+
+/// The index within the group of the first match.
+static inline size_t hashmap_group_first(u64 mask) {
+    return hashmap_ctz(mask) >> HASHMAP_GROUP_SHIFT;
+}
+
+/// The number of indices at the end of the group
+/// that didn't match.
+static inline size_t hashmap_group_leading(u64 mask) {
+    return (hashmap_clz(mask) - (64 - (HASHMAP_GROUP_WIDTH << HASHMAP_GROUP_SHIFT))) >> HASHMAP_GROUP_SHIFT;
+}
+
+/// The 7 bits of the hash stored in the control byte. The
+/// hash is mixed first, so they don't overlap with the bits
+/// that select the index.
+static inline u8 hashmap_group_tag(size_t hash) {
+    return (u8)(((u64)hash * 0x9E3779B97F4A7C15ULL) >> 57);
+}
+
+static inline void hashmap_group_set_control(u8* control, size_t index_capacity, size_t index, u8 value) {
+    control[index] = value;
+    if (index < HASHMAP_GROUP_WIDTH)
+        control[index_capacity + index] = value;
+}
+
+// ---- Index probing ----
+//
+// The indices map a hash to a slot in the dense keys and values.
+// All probing goes through the `hashmap_index_*` functions below,
+// which pick between linear probing and group probing. `table` is
+// the header whose indices are probed, and `header` the one whose
+// keys are compared. They're the same hashmap, except when an
+// incremental grow is still migrating the previous indices.
+
+/// Returned by the index functions when nothing was found.
+static const size_t HASHMAP_NOT_FOUND = (size_t)-1;
+
+/// Checks the stored hash, if any, before comparing the keys.
+static inline int hashmap_slot_matches(const HashMapHeader* header, size_t slot, const void* key, size_t hash, compare_function compare_key) {
+    const size_t* stored = hashmap_slot_hash(header, slot);
+    return (stored == NULL || *stored == hash) && compare_key(key, hashmap_slot_key(header, slot), header->key_stride) == 0;
+}
+
+static size_t hashmap_linear_find(const HashMapHeader* table, const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key) {
+    size_t index_capacity = table->index_capacity;
+    size_t index_stride   = table->index_stride;
+    size_t index_mask     = table->index_mask;
+    size_t counter        = index_capacity;
+
+    const u8* indices = hashmap_indices_of(table);
+
+    const size_t empty_slot   = index_mask;
+    const size_t deleted_slot = index_mask - 1;
+
+    size_t hash_mask = index_capacity - 1;
+    size_t index     = hash & hash_mask;
+    do {
+        size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);
+
+        if (slot == empty_slot) {
+            return HASHMAP_NOT_FOUND;
+        }
+
+        // Deleted slots are part of the probe sequence
+        // of the keys inserted after them, so keep going.
+        if (slot != deleted_slot) {
+            if (hashmap_slot_matches(header, slot, key, hash, compare_key)) {
+                return index;
+            }
+        }
+
+        index = (index + 1) & hash_mask;
+    } while (--counter);
+
+    return HASHMAP_NOT_FOUND;
+}
+
+static size_t hashmap_linear_find_free(const HashMapHeader* table, size_t hash) {
+    size_t index_capacity = table->index_capacity;
+    size_t index_stride   = table->index_stride;
+    size_t index_mask     = table->index_mask;
+    size_t counter        = index_capacity;
+
+    const u8* indices = hashmap_indices_of(table);
+
+    const size_t deleted_slot = index_mask - 1;
+
+    size_t hash_mask = index_capacity - 1;
+    size_t index     = hash & hash_mask;
+    do {
+        if (hashmap_load_slot(indices, index, index_stride, index_mask) >= deleted_slot) {
+            return index;
+        }
+
+        index = (index + 1) & hash_mask;
+
+    // This is necessary to avoid infinite loops when
+    // the load factor is 1 and the hashmap is full.
+    // We could check whether the second to last element
+    // inserted requires the hashmap to grow, but that
+    // would require the hashmap to regrow before hitting
+    // the capacity. This is probably not expected as the
+    // user would not expect the hashmap to grow when the
+    // load factor is 1 and haven't reached the capacity.
+    // We could check this before the loop, but that would
+    // require an extra branch for every insertion, instead
+    // of just the one's that collide.
+    } while (--counter);
+
+    return HASHMAP_NOT_FOUND;
+}
+
+static size_t hashmap_group_find(const HashMapHeader* table, const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key) {
+    size_t index_capacity = table->index_capacity;
+    size_t index_stride   = table->index_stride;
+    size_t index_mask     = table->index_mask;
+
+    const u8* control = hashmap_control_of(table);
+    const u8* indices = hashmap_indices_of(table);
+
+    size_t hash_mask = index_capacity - 1;
+    size_t position  = hash & hash_mask;
+    u8     tag       = hashmap_group_tag(hash);
+    for (size_t step = 0; step < index_capacity; step += HASHMAP_GROUP_WIDTH) {
+        position = (position + step) & hash_mask;
+        const u8* group = control + position;
+
+        for (u64 match = hashmap_group_match(group, tag); match != 0; match &= match - 1) {
+            size_t index = (position + hashmap_group_first(match)) & hash_mask;
+            size_t slot  = hashmap_load_slot(indices, index, index_stride, index_mask);
+            if (hashmap_slot_matches(header, slot, key, hash, compare_key)) {
+                return index;
+            }
+        }
+
+        // An empty index ends the probe sequence.
+        if (hashmap_group_match_empty(group) != 0) {
+            return HASHMAP_NOT_FOUND;
+        }
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static size_t hashmap_group_find_free(const HashMapHeader* table, size_t hash) {
+    size_t index_capacity = table->index_capacity;
+    const u8* control     = hashmap_control_of(table);
+
+    size_t hash_mask = index_capacity - 1;
+    size_t position  = hash & hash_mask;
+    for (size_t step = 0; step < index_capacity; step += HASHMAP_GROUP_WIDTH) {
+        position = (position + step) & hash_mask;
+        u64 free = hashmap_group_match_free(control + position);
+        if (free != 0) {
+            return (position + hashmap_group_first(free)) & hash_mask;
+        }
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static size_t hashmap_group_find_slot(const HashMapHeader* table, size_t hash, size_t slot) {
+    size_t index_capacity = table->index_capacity;
+    size_t index_stride   = table->index_stride;
+    size_t index_mask     = table->index_mask;
+
+    const u8* control = hashmap_control_of(table);
+    const u8* indices = hashmap_indices_of(table);
+
+    size_t hash_mask = index_capacity - 1;
+    size_t position  = hash & hash_mask;
+    u8     tag       = hashmap_group_tag(hash);
+    for (size_t step = 0; step < index_capacity; step += HASHMAP_GROUP_WIDTH) {
+        position = (position + step) & hash_mask;
+        const u8* group = control + position;
+
+        for (u64 match = hashmap_group_match(group, tag); match != 0; match &= match - 1) {
+            size_t index = (position + hashmap_group_first(match)) & hash_mask;
+            if (hashmap_load_slot(indices, index, index_stride, index_mask) == slot)
+                return index;
+        }
+
+        if (hashmap_group_match_empty(group) != 0) {
+            return HASHMAP_NOT_FOUND;
+        }
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static void hashmap_group_erase(HashMapHeader* table, size_t index) {
+    size_t index_capacity = table->index_capacity;
+    u8*    control        = hashmap_control_of(table);
+    size_t hash_mask      = index_capacity - 1;
+
+    // If there's an empty index within a group's width on
+    // both sides, no group covering this index has ever
+    // been full, so no probe sequence went past it and it
+    // can be marked as empty instead of deleted.
+    size_t before       = (index - HASHMAP_GROUP_WIDTH) & hash_mask;
+    u64    empty_before = hashmap_group_match_empty(control + before);
+    u64    empty_after  = hashmap_group_match_empty(control + index);
+    int    never_full   = empty_before != 0 && empty_after != 0 &&
+                          hashmap_group_first(empty_after) + hashmap_group_leading(empty_before) < HASHMAP_GROUP_WIDTH;
+    hashmap_group_set_control(control, index_capacity, index, never_full ? HASHMAP_CONTROL_EMPTY : HASHMAP_CONTROL_DELETED);
+}
+
+/// How far the index is from where the hash of its slot starts,
+/// with HASHMAP_OPTION_ROBIN_HOOD.
+static inline size_t hashmap_robin_distance(const HashMapHeader* table, const HashMapHeader* header, size_t index, size_t slot) {
+    return (index - *hashmap_slot_hash(header, slot)) & (table->index_capacity - 1);
+}
+
+static size_t hashmap_robin_find(const HashMapHeader* table, const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key) {
+    size_t index_capacity = table->index_capacity;
+    size_t index_stride   = table->index_stride;
+    size_t index_mask     = table->index_mask;
+
+    const u8* indices = hashmap_indices_of(table);
+
+    const size_t empty_slot   = index_mask;
+    const size_t deleted_slot = index_mask - 1;
+
+    size_t hash_mask = index_capacity - 1;
+    size_t index     = hash & hash_mask;
+    for (size_t distance = 0; distance < index_capacity; ++distance) {
+        size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);
+        if (slot == empty_slot)
+            return HASHMAP_NOT_FOUND;
+
+        // Only the previous indices of an incremental
+        // grow have tombstones, which are skipped.
+        if (slot != deleted_slot) {
+            size_t stored = *hashmap_slot_hash(header, slot);
+            if (stored == hash && compare_key(key, hashmap_slot_key(header, slot), header->key_stride) == 0)
+                return index;
+
+            // The key would have been placed before
+            // any index that starts after it.
+            if (((index - stored) & hash_mask) < distance)
+                return HASHMAP_NOT_FOUND;
+        }
+
+        index = (index + 1) & hash_mask;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+/// Finds where the hash is inserted, which is the first index that is
+/// unused, or closer to the start of its hash than the new one would be.
+static size_t hashmap_robin_find_free(const HashMapHeader* table, size_t hash) {
+    size_t index_capacity = table->index_capacity;
+    size_t index_stride   = table->index_stride;
+    size_t index_mask     = table->index_mask;
+
+    const u8* indices = hashmap_indices_of(table);
+
+    size_t hash_mask = index_capacity - 1;
+    size_t index     = hash & hash_mask;
+    for (size_t distance = 0; distance < index_capacity; ++distance) {
+        size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);
+        if (slot >= index_mask - 1 || hashmap_robin_distance(table, table, index, slot) < distance)
+            return index;
+        index = (index + 1) & hash_mask;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+/// Shifts the indices from `index` up to the next unused one forward by
+/// one, to make room at `index`. There's always an unused index, as the
+/// capacity is less than the index capacity.
+static void hashmap_robin_shift_forward(HashMapHeader* table, size_t index) {
+    size_t index_stride = table->index_stride;
+    size_t index_mask   = table->index_mask;
+    size_t hash_mask    = table->index_capacity - 1;
+    u8*    indices      = hashmap_indices_of(table);
+
+    size_t end = index;
+    while (hashmap_load_slot(indices, end, index_stride, index_mask) < index_mask - 1)
+        end = (end + 1) & hash_mask;
+
+    while (end != index) {
+        size_t previous = (end - 1) & hash_mask;
+        hashmap_store_slot(indices, end, index_stride, hashmap_load_slot(indices, previous, index_stride, index_mask));
+        end = previous;
+    }
+}
+
+/// Removes the index by shifting the following indices back over it,
+/// until one that is at the start of its hash, or unused.
+static void hashmap_robin_erase(HashMapHeader* table, size_t index) {
+    size_t index_stride = table->index_stride;
+    size_t index_mask   = table->index_mask;
+    size_t hash_mask    = table->index_capacity - 1;
+    u8*    indices      = hashmap_indices_of(table);
+
+    size_t next = (index + 1) & hash_mask;
+    for (;;) {
+        size_t slot = hashmap_load_slot(indices, next, index_stride, index_mask);
+        if (slot >= index_mask - 1 || hashmap_robin_distance(table, table, next, slot) == 0)
+            break;
+        hashmap_store_slot(indices, index, index_stride, slot);
+        index = next;
+        next  = (next + 1) & hash_mask;
+    }
+    hashmap_store_slot(indices, index, index_stride, index_mask);
+}
+
+/// Finds the index in the table that points to the key.
+static inline size_t hashmap_index_find(const HashMapHeader* table, const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key) {
+    if (table->options & HASHMAP_OPTION_GROUPS)
+        return hashmap_group_find(table, header, key, hash, compare_key);
+    if (table->options & HASHMAP_OPTION_ROBIN_HOOD)
+        return hashmap_robin_find(table, header, key, hash, compare_key);
+    return hashmap_linear_find(table, header, key, hash, compare_key);
+}
+
+/// Finds the first unused index in the probe sequence of the hash.
+static inline size_t hashmap_index_find_free(const HashMapHeader* table, size_t hash) {
+    if (table->options & HASHMAP_OPTION_GROUPS)
+        return hashmap_group_find_free(table, hash);
+    if (table->options & HASHMAP_OPTION_ROBIN_HOOD)
+        return hashmap_robin_find_free(table, hash);
+    return hashmap_linear_find_free(table, hash);
+}
+
+/// Finds the index in the table that points to the slot.
+static inline size_t hashmap_index_find_slot(const HashMapHeader* table, size_t hash, size_t slot) {
+    if (table->options & HASHMAP_OPTION_GROUPS)
+        return hashmap_group_find_slot(table, hash, slot);
+
+    size_t index = hashmap_find_index_of_slot(hashmap_indices_of(table), table->index_capacity, table->index_stride, table->index_mask, hash, slot);
+    return (index == table->index_capacity) ? HASHMAP_NOT_FOUND : index;
+}
+
+/// Returns the slot that the index points to, or
+/// `HASHMAP_NOT_FOUND` if the index is unused.
+static inline size_t hashmap_index_slot(const HashMapHeader* table, size_t index) {
+    if (table->options & HASHMAP_OPTION_GROUPS) {
+        if (hashmap_control_of(table)[index] & 0x80)
+            return HASHMAP_NOT_FOUND;
+    }
+
+    size_t slot = hashmap_load_slot(hashmap_indices_of(table), index, table->index_stride, table->index_mask);
+    return (slot >= table->index_mask - 1) ? HASHMAP_NOT_FOUND : slot;
+}
+
+static inline int hashmap_index_is_deleted(const HashMapHeader* table, size_t index) {
+    if (table->options & HASHMAP_OPTION_GROUPS)
+        return hashmap_control_of(table)[index] == HASHMAP_CONTROL_DELETED;
+    return hashmap_load_slot(hashmap_indices_of(table), index, table->index_stride, table->index_mask) == table->index_mask - 1;
+}
+
+#ifdef TKB_MAP_STATS
+/// Counts the probe length of the index that was found for the hash.
+static inline void hashmap_stats_probe(const u64* histogram, const HashMapHeader* table, size_t hash, size_t index) {
+    size_t length = (index - hash) & (table->index_capacity - 1);
+    size_t bucket = 0;
+    while (length != 0 && bucket + 1 < HASHMAP_STATS_BUCKETS) {
+        length >>= 1;
+        ++bucket;
+    }
+    hashmap_stats_add(&histogram[bucket], 1);
+}
+#endif
+
+/// Points the index from `hashmap_index_find_free` to the slot. With
+/// HASHMAP_OPTION_ROBIN_HOOD, the index may be used, and is moved.
+static inline void hashmap_index_insert(HashMapHeader* table, size_t index, size_t hash, size_t slot) {
+    table->tombstones -= (size_t)hashmap_index_is_deleted(table, index);
+    if (table->options & HASHMAP_OPTION_GROUPS)
+        hashmap_group_set_control(hashmap_control_of(table), table->index_capacity, index, hashmap_group_tag(hash));
+    else if (table->options & HASHMAP_OPTION_ROBIN_HOOD)
+        hashmap_robin_shift_forward(table, index);
+    hashmap_store_slot(hashmap_indices_of(table), index, table->index_stride, slot);
+}
+
+static inline void hashmap_index_erase(HashMapHeader* table, size_t index) {
+    if (table->options & HASHMAP_OPTION_GROUPS)
+        hashmap_group_erase(table, index);
+    else
+        hashmap_store_slot(hashmap_indices_of(table), index, table->index_stride, table->index_mask - 1);
+    table->tombstones += (size_t)hashmap_index_is_deleted(table, index);
+}
+
+/// Finds the index that points to the key, in the indices of the
+/// hashmap or, while migrating, in the previous indices. The
+/// table that the index belongs to is written to `table`.
+static inline size_t hashmap_lookup(const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key, const HashMapHeader** table) {
+    *table = header;
+    size_t index = hashmap_index_find(header, header, key, hash, compare_key);
+    if (index == HASHMAP_NOT_FOUND && header->previous != NULL) {
+        *table = header->previous;
+        index  = hashmap_index_find(header->previous, header, key, hash, compare_key);
+    }
+    return index;
+}
+
+
+// ---- Small hashmaps (HASHMAP_OPTION_SMALL) ----
+//
+// A small hashmap has an index capacity of 0 and no indices, and
+// every operation compares the key with all entries. The entries
+// stay dense, so deleting moves the last entry into the hole as
+// usual, only without any index to update.
+
+static inline int compare_u32(const void* key, const void* candidate, size_t stride);
+static inline int compare_u64(const void* key, const void* candidate, size_t stride);
+
+static inline int hashmap_is_small(const HashMapHeader* header) {
+    return header->index_capacity == 0;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+static inline size_t hashmap_small_find_u32(const u8* keys, size_t count, u32 key) {
+    __m128i needle = _mm_set1_epi32((int)key);
+    size_t  i      = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(keys + i * sizeof(u32))), needle);
+        int     mask  = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        if (mask != 0)
+            return i + hashmap_ctz((u64)mask);
+    }
+    for (; i < count; ++i) {
+        if (((const u32*)keys)[i] == key)
+            return i;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static inline size_t hashmap_small_find_u64(const u8* keys, size_t count, u64 key) {
+    __m128i needle = _mm_set1_epi64x((long long)key);
+    size_t  i      = 0;
+    for (; i + 2 <= count; i += 2) {
+        // SSE2 can only compare 32 bits at a time, so
+        // both halves of a lane have to be equal.
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(keys + i * sizeof(u64))), needle);
+        equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(equal));
+        if (mask != 0)
+            return i + hashmap_ctz((u64)mask);
+    }
+    if (i < count && ((const u64*)keys)[i] == key)
+        return i;
+    return HASHMAP_NOT_FOUND;
+}
+#else
+static inline size_t hashmap_small_find_u32(const u8* keys, size_t count, u32 key) {
+    for (size_t i = 0; i < count; ++i) {
+        if (((const u32*)keys)[i] == key)
+            return i;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static inline size_t hashmap_small_find_u64(const u8* keys, size_t count, u64 key) {
+    for (size_t i = 0; i < count; ++i) {
+        if (((const u64*)keys)[i] == key)
+            return i;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+#endif
+
+/// Returns the slot of the key, or `HASHMAP_NOT_FOUND`. The keys
+/// are together, also in the first chunk of HASHMAP_OPTION_STABLE,
+/// and only packed without HASHMAP_OPTION_INTERLEAVED.
+static size_t hashmap_small_find(const HashMapHeader* header, const void* key, compare_function compare_key) {
+    size_t    count      = header->count;
+    size_t    key_stride = header->key_stride;
+    size_t    key_step   = hashmap_key_step(header);
+    const u8* keys       = hashmap_slot_key(header, 0);
+
+    if (key_step != key_stride) {
+        for (size_t slot = 0; slot < count; ++slot) {
+            if (compare_key(key, keys + slot * key_step, key_stride) == 0)
+                return slot;
+        }
+        return HASHMAP_NOT_FOUND;
+    }
+
+    if (compare_key == compare_u64 && key_stride == sizeof(u64)) {
+        u64 value;
+        memcpy(&value, key, sizeof(value));
+        return hashmap_small_find_u64(keys, count, value);
+    }
+    if (compare_key == compare_u32 && key_stride == sizeof(u32)) {
+        u32 value;
+        memcpy(&value, key, sizeof(value));
+        return hashmap_small_find_u32(keys, count, value);
+    }
+
+    for (size_t slot = 0; slot < count; ++slot) {
+        if (compare_key(key, keys + slot * key_stride, key_stride) == 0)
+            return slot;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static void* hashmap_small_get(const HashMapHeader* header, const void* key, compare_function compare_key) {
+    size_t slot = hashmap_small_find(header, key, compare_key);
+    if (slot == HASHMAP_NOT_FOUND) {
+        HASHMAP_STATS_BLOCK(hashmap_stats_add(&header->stats.get_misses, 1);)
+        return NULL;
+    }
+    return hashmap_slot_value(header, slot);
+}
+
+/// Sets the key in a small hashmap. The hash is only used, and
+/// only needs to be computed, with HASHMAP_OPTION_STORE_HASH.
+static int hashmap_small_set(HashMap** map, const void* key, const void* value, size_t hash, hash_function hash_key, compare_function compare_key) {
+    HashMapHeader* header = hashmap_header(*map);
+    size_t         slot   = hashmap_small_find(header, key, compare_key);
+    if (slot != HASHMAP_NOT_FOUND) {
+        memcpy(hashmap_slot_value(header, slot), value, header->value_stride);
+        return 0;
+    }
+
+    if (header->count == header->capacity) {
+        hashmap_grow(map, hash_key, compare_key);
+        return hashmap_set(map, key, value, hash_key, compare_key);
+    }
+
+    u8 owned[sizeof(StringKey)];
+    if (header->options & HASHMAP_OPTION_OWNED_KEYS) {
+        key = hashmap_own_key(header, key, owned);
+        if (key == NULL)
+            return 0;
+    }
+
+    size_t  i      = header->count++;
+    size_t* stored = hashmap_slot_hash(header, i);
+    memcpy(hashmap_slot_key(header, i),   key,   header->key_stride);
+    memcpy(hashmap_slot_value(header, i), value, header->value_stride);
+    if (stored != NULL)
+        *stored = hash;
+    if (header->filter != NULL)
+        hashmap_filter_add(header, hash);
+    return 1;
+}
+
+static void* hashmap_small_del(HashMapHeader* header, const void* key, compare_function compare_key) {
+    size_t slot = hashmap_small_find(header, key, compare_key);
+    if (slot == HASHMAP_NOT_FOUND) {
+        HASHMAP_STATS_BLOCK(hashmap_stats_add(&header->stats.del_misses, 1);)
+        return NULL;
+    }
+    if (header->filter != NULL)
+        hashmap_filter_remove(header, *hashmap_slot_hash(header, slot));
+
+    size_t last_slot = header->count - 1;
+    if (slot != last_slot) {
+        size_t* stored      = hashmap_slot_hash(header, slot);
+        size_t* last_stored = hashmap_slot_hash(header, last_slot);
+        memcpy(hashmap_slot_key(header, slot), hashmap_slot_key(header, last_slot), header->key_stride);
+        hashmap_swap(hashmap_slot_value(header, slot), hashmap_slot_value(header, last_slot), header->value_stride);
+        if (stored != NULL)
+            *stored = *last_stored;
+    }
+
+    header->count -= 1;
+    return hashmap_slot_value(header, last_slot);
+}
+
+
+// ---- Incremental grow (HASHMAP_OPTION_INCREMENTAL) ----
+//
+// When growing, the new block only gets its indices cleared, and
+// the old block is kept as `previous` instead of copying the keys
+// and values and rebuilding the indices. The entries keep their
+// slot, so its indices still point to the right ones. Each set and
+// del then copies a few of the entries and moves a few of the
+// previous indices over, and lookups check both until all of them
+// have been moved. The slots that haven't been copied yet are read
+// from the previous block (see `hashmap_slot_block`).
+
+/// How many of the previous indices and entries that are
+/// migrated by each set and del.
+#define HASHMAP_MIGRATE_STEP 64
+
+static void hashmap_migrate(HashMapHeader* header, size_t steps, hash_function hash_key) {
+    HashMapHeader* previous = header->previous;
+    size_t key_stride       = header->key_stride;
+    hashmap_copy_entries(header, steps);
+
+    size_t remaining        = previous->index_capacity - header->migrated;
+    size_t end              = header->migrated + (steps < remaining ? steps : remaining);
+
+    for (size_t index = header->migrated; index < end; ++index) {
+        size_t slot = hashmap_index_slot(previous, index);
+        if (slot == HASHMAP_NOT_FOUND)
+            continue;
+
+        size_t* stored = hashmap_slot_hash(header, slot);
+        size_t  hash   = (stored != NULL) ? *stored : hash_key(hashmap_slot_key(header, slot), key_stride);
+        hashmap_index_insert(header, hashmap_index_find_free(header, hash), hash, slot);
+        hashmap_index_erase(previous, index);
+    }
+    header->migrated = end;
+
+    // There are never more entries than indices, so the
+    // entries are always done first.
+    if (end == previous->index_capacity && header->copied == previous->count) {
+        deallocate(header->allocator, previous, hashmap_header_total_size(previous));
+        header->previous = NULL;
+        header->migrated = 0;
+        header->copied   = 0;
+    }
+}
+
+
+/// How much of the room that the entries leave in the indices that
+/// has to be tombstones before they're cleared, as a fraction, so the
+/// rebuild is paid for by the deletes since the last one.
+#define HASHMAP_CLEANUP_FRACTION 2
+
+static void hashmap_rebuild_indices(HashMapHeader* header, hash_function hash_key);
+
+/// Whether the tombstones should be cleared before inserting. Once
+/// the entries and the tombstones together pass the load factor, the
+/// probe sequences are as long as in a hashmap that should've grown,
+/// and they only get longer as deletes and sets at the same count
+/// turn the rest of the empty indices into tombstones.
+static inline int hashmap_needs_cleanup(const HashMapHeader* header) {
+    size_t used  = header->count + header->tombstones;
+    size_t limit = header->index_capacity * header->load_factor / 100;
+    size_t room  = header->index_capacity - header->count;
+    return used >= limit && header->tombstones > room / HASHMAP_CLEANUP_FRACTION && header->previous == NULL;
+}
+
+// ---- Plain hashmaps (HASHMAP_OPTION_NONE) ----
+//
+// Without any options, the keys and values are each one dense array,
+// and there's never a previous block, chunks or a filter. Get, set and
+// del then probe the indices and compare the keys right in the arrays,
+// instead of going through the slot accessors that check for each of
+// the options on every probe. The stats are only counted by the
+// general path, so it's taken with TKB_MAP_STATS.
+
+static inline int hashmap_is_plain(const HashMapHeader* header) {
+    return header->options == HASHMAP_OPTION_NONE && !HASHMAP_STATS_ENABLED;
+}
+
+static inline u8* hashmap_plain_values(const HashMapHeader* header) {
+    return hashmap_keys_of(header) + hashmap_align(header->capacity * header->key_stride);
+}
+
+/// Returns the index that points to the key, or `HASHMAP_NOT_FOUND`.
+/// The first unused index that was passed, or `index_capacity` if
+/// none was, is written to `free_index`.
+static inline size_t hashmap_plain_find(const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key, size_t* free_index) {
+    size_t    index_capacity = header->index_capacity;
+    size_t    index_stride   = header->index_stride;
+    size_t    index_mask     = header->index_mask;
+    size_t    key_stride     = header->key_stride;
+    size_t    hash_mask      = index_capacity - 1;
+    const u8* indices        = hashmap_indices_of(header);
+    const u8* keys           = hashmap_keys_of(header);
+
+    size_t index = hash & hash_mask;
+    *free_index  = index_capacity;
+    for (size_t counter = index_capacity; counter > 0; --counter) {
+        size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);
+        if (slot >= index_mask - 1) {
+            if (*free_index == index_capacity)
+                *free_index = index;
+            if (slot == index_mask)
+                return HASHMAP_NOT_FOUND;
+        } else if (compare_key(key, keys + slot * key_stride, key_stride) == 0) {
+            return index;
+        }
+        index = (index + 1) & hash_mask;
+    }
+    return HASHMAP_NOT_FOUND;
+}
+
+static inline void* hashmap_plain_get(const HashMapHeader* header, const void* key, size_t hash, compare_function compare_key) {
+    size_t free_index;
+    size_t index = hashmap_plain_find(header, key, hash, compare_key, &free_index);
+    if (index == HASHMAP_NOT_FOUND)
+        return NULL;
+
+    size_t slot = hashmap_load_slot(hashmap_indices_of(header), index, header->index_stride, header->index_mask);
+    return hashmap_plain_values(header) + slot * header->value_stride;
+}
+
+/// Sets the key like `hashmap_set_hashed`. Returns -1 if the hashmap
+/// has to grow first.
+static inline int hashmap_plain_set(HashMapHeader* header, const void* key, const void* value, size_t hash, hash_function hash_key, compare_function compare_key) {
+    size_t key_stride   = header->key_stride;
+    size_t value_stride = header->value_stride;
+    u8*    indices      = hashmap_indices_of(header);
+
+    size_t free_index;
+    size_t index = hashmap_plain_find(header, key, hash, compare_key, &free_index);
+    if (index != HASHMAP_NOT_FOUND) {
+        size_t slot = hashmap_load_slot(indices, index, header->index_stride, header->index_mask);
+        memcpy(hashmap_plain_values(header) + slot * value_stride, value, value_stride);
+        return 0;
+    }
+
+    if (hashmap_needs_cleanup(header)) {
+        hashmap_rebuild_indices(header, hash_key);
+        hashmap_plain_find(header, key, hash, compare_key, &free_index);
+    }
+    if (free_index == header->index_capacity || header->count >= header->capacity)
+        return -1;
+
+    size_t i = header->count++;
+    header->tombstones -= (size_t)hashmap_index_is_deleted(header, free_index);
+    hashmap_store_slot(indices, free_index, header->index_stride, i);
+    memcpy(hashmap_keys_of(header)      + i * key_stride,   key,   key_stride);
+    memcpy(hashmap_plain_values(header) + i * value_stride, value, value_stride);
+    return 1;
+}
+
+static inline void* hashmap_plain_del(HashMapHeader* header, const void* key, size_t hash, hash_function hash_key, compare_function compare_key) {
+    size_t key_stride   = header->key_stride;
+    size_t value_stride = header->value_stride;
+    size_t index_stride = header->index_stride;
+    size_t index_mask   = header->index_mask;
+    u8*    indices      = hashmap_indices_of(header);
+    u8*    keys         = hashmap_keys_of(header);
+    u8*    values       = hashmap_plain_values(header);
+
+    size_t free_index;
+    size_t index = hashmap_plain_find(header, key, hash, compare_key, &free_index);
+    if (index == HASHMAP_NOT_FOUND)
+        return NULL;
+
+    // Move the last entry into the hole, as in `hashmap_del_hashed`.
+    size_t slot      = hashmap_load_slot(indices, index, index_stride, index_mask);
+    size_t last_slot = header->count - 1;
+    if (slot != last_slot) {
+        u8*    last_key   = keys + last_slot * key_stride;
+        size_t last_hash  = hash_key(last_key, key_stride);
+        size_t last_index = hashmap_find_index_of_slot(indices, header->index_capacity, index_stride, index_mask, last_hash, last_slot);
+        hashmap_store_slot(indices, last_index, index_stride, slot);
+        memcpy(keys + slot * key_stride, last_key, key_stride);
+        hashmap_swap(values + slot * value_stride, values + last_slot * value_stride, value_stride);
+    }
+
+    hashmap_store_slot(indices, index, index_stride, index_mask - 1);
+    header->tombstones += 1;
+    header->count      -= 1;
+    return values + last_slot * value_stride;
+}
+
+
+void* hashmap_get(const HashMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
+    const HashMapHeader* header = hashmap_header(map);
+    if (hashmap_is_small(header))
+        return hashmap_small_get(header, key, compare_key);
+    return hashmap_get_hashed(map, key, hash_key(key, header->key_stride), compare_key);
+}
+
+void* hashmap_get_hashed(const HashMap* map, const void* key, size_t hash, compare_function compare_key) {
+    const HashMapHeader* header = hashmap_header(map);
+    const HashMapHeader* table;
+
+    if (hashmap_is_plain(header))
+        return hashmap_plain_get(header, key, hash, compare_key);
+    if (hashmap_is_small(header))
+        return hashmap_small_get(header, key, compare_key);
+
+    size_t index = HASHMAP_NOT_FOUND;
+    if (header->filter == NULL || hashmap_filter_may_contain(header, hash))
+        index = hashmap_lookup(header, key, hash, compare_key, &table);
+    if (index == HASHMAP_NOT_FOUND) {
+        HASHMAP_STATS_BLOCK(hashmap_stats_add(&header->stats.get_misses, 1);)
+        return NULL;
+    }
+    HASHMAP_STATS_BLOCK(hashmap_stats_probe(header->stats.get_probes, table, hash, index);)
+
+    size_t slot = hashmap_load_slot(hashmap_indices_of(table), index, table->index_stride, table->index_mask);
+    return hashmap_slot_value(header, slot);
+}
+
+
+int hashmap_set(HashMap** map, const void* key, const void* value, hash_function hash_key, compare_function compare_key) {
+    const HashMapHeader* header = hashmap_header(*map);
+    if (hashmap_is_small(header) && !(header->options & HASHMAP_OPTION_STORE_HASH))
+        return hashmap_small_set(map, key, value, 0, hash_key, compare_key);
+    return hashmap_set_hashed(map, key, value, hash_key(key, header->key_stride), hash_key, compare_key);
+}
+
+int hashmap_set_hashed(HashMap** map, const void* key, const void* value, size_t hash, hash_function hash_key, compare_function compare_key) {
+    HashMapHeader* header = hashmap_header(*map);
+    size_t key_stride     = header->key_stride;
+    size_t value_stride   = header->value_stride;
+
+    if (hashmap_is_plain(header)) {
+        int result = hashmap_plain_set(header, key, value, hash, hash_key, compare_key);
+        if (result >= 0)
+            return result;
+        hashmap_grow(map, hash_key, compare_key);
+        return hashmap_set_hashed(map, key, value, hash, hash_key, compare_key);
+    }
+    if (hashmap_is_small(header))
+        return hashmap_small_set(map, key, value, hash, hash_key, compare_key);
+
+    if (header->previous != NULL)
+        hashmap_migrate(header, HASHMAP_MIGRATE_STEP, hash_key);
+
+    // A key that isn't in the filter is new, so it only
+    // needs a free index.
+    const HashMapHeader* table;
+    size_t index = HASHMAP_NOT_FOUND;
+    if (header->filter == NULL || hashmap_filter_may_contain(header, hash))
+        index = hashmap_lookup(header, key, hash, compare_key, &table);
+    if (index != HASHMAP_NOT_FOUND) {
+        HASHMAP_STATS_BLOCK(hashmap_stats_probe(header->stats.set_probes, table, hash, index);)
+        size_t slot = hashmap_load_slot(hashmap_indices_of(table), index, table->index_stride, table->index_mask);
+        memcpy(hashmap_slot_value(header, slot), value, value_stride);
+        return 0;
+    }
+
+    if (hashmap_needs_cleanup(header))
+        hashmap_rebuild_indices(header, hash_key);
+
+    size_t free_index = (header->count < header->capacity) ? hashmap_index_find_free(header, hash) : HASHMAP_NOT_FOUND;
+    if (free_index == HASHMAP_NOT_FOUND) {
+        HASHMAP_STATS_BLOCK(hashmap_stats_add(&header->stats.full_probes, header->count < header->capacity);)
+        hashmap_grow(map, hash_key, compare_key);
+        return hashmap_set_hashed(map, key, value, hash, hash_key, compare_key);
+    }
+
+    HASHMAP_STATS_BLOCK(hashmap_stats_probe(header->stats.set_probes, header, hash, free_index);)
+
+    u8 owned[sizeof(StringKey)];
+    if (header->options & HASHMAP_OPTION_OWNED_KEYS) {
+        key = hashmap_own_key(header, key, owned);
+        if (key == NULL)
+            return 0;
+    }
+
+    size_t  i      = header->count++;
+    size_t* stored = hashmap_slot_hash(header, i);
+    hashmap_index_insert(header, free_index, hash, i);
+    memcpy(hashmap_slot_key(header, i),   key,   key_stride);
+    memcpy(hashmap_slot_value(header, i), value, value_stride);
+    if (stored != NULL)
+        *stored = hash;
+    if (header->filter != NULL)
+        hashmap_filter_add(header, hash);
+    return 1;
+}
+
+
+void* hashmap_del(HashMap** map, const void* key, hash_function hash_key, compare_function compare_key) {
+    HashMapHeader* header = hashmap_header(*map);
+    if (hashmap_is_small(header))
+        return hashmap_small_del(header, key, compare_key);
+    return hashmap_del_hashed(map, key, hash_key(key, header->key_stride), hash_key, compare_key);
+}
+
+void* hashmap_del_hashed(HashMap** map, const void* key, size_t hash, hash_function hash_key, compare_function compare_key) {
+    HashMapHeader* header = hashmap_header(*map);
+    size_t key_stride     = header->key_stride;
+    size_t value_stride   = header->value_stride;
+
+    if (hashmap_is_plain(header))
+        return hashmap_plain_del(header, key, hash, hash_key, compare_key);
+    if (hashmap_is_small(header))
+        return hashmap_small_del(header, key, compare_key);
+
+    if (header->previous != NULL)
+        hashmap_migrate(header, HASHMAP_MIGRATE_STEP, hash_key);
+
+    const HashMapHeader* table;
+    size_t index = HASHMAP_NOT_FOUND;
+    if (header->filter == NULL || hashmap_filter_may_contain(header, hash))
+        index = hashmap_lookup(header, key, hash, compare_key, &table);
+    if (index == HASHMAP_NOT_FOUND) {
+        HASHMAP_STATS_BLOCK(hashmap_stats_add(&header->stats.del_misses, 1);)
+        return NULL;
+    }
+    HASHMAP_STATS_BLOCK(hashmap_stats_probe(header->stats.del_probes, table, hash, index);)
+
+    if (header->filter != NULL)
+        hashmap_filter_remove(header, hash);
+
+    size_t slot      = hashmap_load_slot(hashmap_indices_of(table), index, table->index_stride, table->index_mask);
+    size_t last_slot = header->count - 1;
+
+    // If the slot is not the last slot, we need to move the last slot
+    // to the slot we just deleted.
+    if (slot != last_slot) {
+        u8*     existing_key = hashmap_slot_key(header, slot);
+        u8*     last_key     = hashmap_slot_key(header, last_slot);
+        size_t* stored       = hashmap_slot_hash(header, slot);
+        size_t* last_stored  = hashmap_slot_hash(header, last_slot);
+
+        // Find the index that points to the last slot through
+        // its probe sequence, and point it to the deleted slot.
+        size_t         last_hash  = (last_stored != NULL) ? *last_stored : hash_key(last_key, key_stride);
+        HashMapHeader* last_table = header;
+        size_t         last_index = hashmap_index_find_slot(header, last_hash, last_slot);
+        if (last_index == HASHMAP_NOT_FOUND) {
+            last_table = header->previous;
+            last_index = hashmap_index_find_slot(last_table, last_hash, last_slot);
+        }
+        hashmap_store_slot(hashmap_indices_of(last_table), last_index, last_table->index_stride, slot);
+
+        // Copy the last key to the slot we just deleted.
+        memcpy(existing_key, last_key, key_stride);
+
+        // Swap the values, so the deleted value ends up after
+        // the last entry, where the returned pointer points to.
+        hashmap_swap(hashmap_slot_value(header, slot), hashmap_slot_value(header, last_slot), value_stride);
+
+        // Copy the last hash to the slot we just deleted.
+        if (stored != NULL)
+            *stored = last_hash;
+    }
+
+    // Mark the slot as deleted. With HASHMAP_OPTION_ROBIN_HOOD, the
+    // following indices are shifted back instead, except in the previous
+    // indices of an incremental grow, as that could move them behind
+    // the ones that have been migrated.
+    if (table == header && (header->options & HASHMAP_OPTION_ROBIN_HOOD))
+        hashmap_robin_erase(header, index);
+    else
+        hashmap_index_erase((HashMapHeader*)table, index);
+
+    header->count -= 1;
+    return hashmap_slot_value(header, last_slot);
+}
+
+
+
+// ---- Bulk build ----
+//
+// Builds the indices for many entries at once. The entries are hashed in
+// slices, then partitioned by which range of the indices their hash starts
+// in, and every range is filled on its own. An entry whose probe sequence
+// leaves its range is left for a sequential pass at the end. Equal keys
+// always start at the same index, so they're found within the same range,
+// which keeps the last value for each key like a sequence of sets would.
+// With TKB_MAP_THREADS defined, the slices and ranges run on their own
+// threads.
+
+/// The most threads used by a bulk build.
+#define HASHMAP_BUILD_MAX_THREADS 64
+
+#ifndef HASHMAP_REBUILD_THREADS
+/// The number of threads used to rebuild the indices when growing
+/// a hashmap with more than `HASHMAP_PARALLEL_REBUILD_COUNT` entries.
+#define HASHMAP_REBUILD_THREADS 4
+#endif
+
+#ifndef HASHMAP_PARALLEL_REBUILD_COUNT
+#define HASHMAP_PARALLEL_REBUILD_COUNT (1 << 20)
+#endif
+
+typedef struct HashMapBuild {
+    HashMapHeader*   header;
+    const u8*        keys;
+    const u8*        values;
+    hash_function    hash_key;
+    compare_function compare_key;
+
+    size_t  count;
+    size_t  threads;
+    size_t  range_shift;
+
+    size_t* hashes;
+    size_t* items;
+    size_t* offsets;        // [threads * threads], by slice and then range
+    size_t* ranges;         // [threads + 1], where each range starts in `items`
+    size_t* overflows;      // [threads], how many entries left each range
+    u8*     dropped;        // [count], set for keys that were set again
+} HashMapBuild;
+
+typedef void (*hashmap_build_phase)(HashMapBuild* build, size_t id);
+
+#ifdef TKB_MAP_THREADS
+#include <pthread.h>
+
+typedef struct HashMapBuildTask {
+    HashMapBuild*       build;
+    hashmap_build_phase phase;
+    size_t              id;
+} HashMapBuildTask;
+
+static void* hashmap_build_thread(void* data) {
+    HashMapBuildTask* task = (HashMapBuildTask*)data;
+    task->phase(task->build, task->id);
+    return NULL;
+}
+#endif
+
+/// Runs the phase once for each thread, and waits for all of them.
+static void hashmap_build_run(HashMapBuild* build, hashmap_build_phase phase) {
+#ifdef TKB_MAP_THREADS
+    HashMapBuildTask tasks[HASHMAP_BUILD_MAX_THREADS];
+    pthread_t        threads[HASHMAP_BUILD_MAX_THREADS];
+    int              started[HASHMAP_BUILD_MAX_THREADS];
+
+    // If a thread can't be started, its part is run right away instead.
+    for (size_t i = 1; i < build->threads; ++i) {
+        tasks[i]   = (HashMapBuildTask) { build, phase, i };
+        started[i] = pthread_create(&threads[i], NULL, hashmap_build_thread, &tasks[i]) == 0;
+        if (!started[i])
+            phase(build, i);
+    }
+    phase(build, 0);
+    for (size_t i = 1; i < build->threads; ++i) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+#else
+    for (size_t i = 0; i < build->threads; ++i)
+        phase(build, i);
+#endif
+}
+
+static inline size_t hashmap_build_range_of(const HashMapBuild* build, size_t hash) {
+    return (hash & (build->header->index_capacity - 1)) >> build->range_shift;
+}
+
+/// Copies and hashes the entries of the slice, and counts
+/// how many of them start in each range.
+static void hashmap_build_hash(HashMapBuild* build, size_t id) {
+    HashMapHeader* header  = build->header;
+    size_t*        offsets = build->offsets + id * build->threads;
+    size_t         begin   = build->count *  id      / build->threads;
+    size_t         end     = build->count * (id + 1) / build->threads;
+
+    for (size_t i = begin; i < end; ++i) {
+        u8*     key    = hashmap_slot_key(header, i);
+        size_t* stored = hashmap_slot_hash(header, i);
+        if (build->keys != NULL) {
+            memcpy(key, build->keys + i * header->key_stride, header->key_stride);
+            memcpy(hashmap_slot_value(header, i), build->values + i * header->value_stride, header->value_stride);
+        }
+
+        size_t hash = (stored != NULL && build->keys == NULL) ? *stored : build->hash_key(key, header->key_stride);
+        if (stored != NULL)
+            *stored = hash;
+        build->hashes[i] = hash;
+        offsets[hashmap_build_range_of(build, hash)] += 1;
+    }
+}
+
+/// Writes the entries of the slice to where their range starts,
+/// in the same order as they were given.
+static void hashmap_build_partition(HashMapBuild* build, size_t id) {
+    size_t* offsets = build->offsets + id * build->threads;
+    size_t  begin   = build->count *  id      / build->threads;
+    size_t  end     = build->count * (id + 1) / build->threads;
+
+    for (size_t i = begin; i < end; ++i)
+        build->items[offsets[hashmap_build_range_of(build, build->hashes[i])]++] = i;
+}
+
+/// Handles a key that was already placed at `slot`, by keeping
+/// the later value and dropping the entry of the later key.
+static inline void hashmap_build_drop(HashMapBuild* build, size_t slot, size_t item) {
+    HashMapHeader* header = build->header;
+    memcpy(hashmap_slot_value(header, slot), hashmap_slot_value(header, item), header->value_stride);
+    build->dropped[item] = 1;
+}
+
+/// Reads the slot at the index like `hashmap_load_slot`, but only the
+/// bytes of the index itself near the end of the range, as the range
+/// after it is filled by another thread at the same time.
+static inline size_t hashmap_build_load_slot(const HashMapHeader* header, const u8* indices, size_t index, size_t high) {
+    size_t index_stride = header->index_stride;
+    if ((high - index) * index_stride >= sizeof(size_t))
+        return hashmap_load_slot(indices, index, index_stride, header->index_mask);
+
+    size_t slot = 0;
+    memcpy(&slot, indices + index * index_stride, index_stride);
+    return slot & header->index_mask;
+}
+
+/// Places the entries starting in the range, without probing outside
+/// it. Returns 0 if the entry has to be placed by the sequential pass.
+static int hashmap_build_place(HashMapBuild* build, size_t item, size_t low, size_t high) {
+    HashMapHeader* header  = build->header;
+    size_t         hash    = build->hashes[item];
+    size_t         mask    = header->index_capacity - 1;
+    const void*    key     = hashmap_slot_key(header, item);
+    u8*            indices = hashmap_indices_of(header);
+
+    if (header->options & HASHMAP_OPTION_GROUPS) {
+        const u8* control  = hashmap_control_of(header);
+        size_t    position = hash & mask;
+        u8        tag      = hashmap_group_tag(hash);
+        for (size_t step = 0; step < header->index_capacity; step += HASHMAP_GROUP_WIDTH) {
+            position = (position + step) & mask;
+            if (position < low || position + HASHMAP_GROUP_WIDTH > high)
+                return 0;
+
+            const u8* group = control + position;
+            if (build->compare_key != NULL) {
+                for (u64 match = hashmap_group_match(group, tag); match != 0; match &= match - 1) {
+                    size_t index = position + hashmap_group_first(match);
+                    size_t slot  = hashmap_build_load_slot(header, indices, index, high);
+                    if (hashmap_slot_matches(header, slot, key, hash, build->compare_key)) {
+                        hashmap_build_drop(build, slot, item);
+                        return 1;
+                    }
+                }
+            }
+
+            // The control byte and the index are set directly, as
+            // `hashmap_index_insert` also counts the tombstones in the
+            // header, which every range would write at once. The
+            // indices are cleared, so there are none to count.
+            u64 empty = hashmap_group_match_empty(group);
+            if (empty != 0) {
+                size_t index = position + hashmap_group_first(empty);
+                hashmap_group_set_control(hashmap_control_of(header), header->index_capacity, index, tag);
+                hashmap_store_slot(indices, index, header->index_stride, item);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // The indices are stored directly instead of with
+    // `hashmap_index_insert`, whose loads aren't kept in the range.
+    int robin_hood = (header->options & HASHMAP_OPTION_ROBIN_HOOD) != 0;
+    for (size_t index = hash & mask, distance = 0; index < high; ++index, ++distance) {
+        size_t slot = hashmap_build_load_slot(header, indices, index, high);
+        if (slot == header->index_mask) {
+            hashmap_store_slot(indices, index, header->index_stride, item);
+            return 1;
+        }
+        if (build->compare_key != NULL && hashmap_slot_matches(header, slot, key, hash, build->compare_key)) {
+            hashmap_build_drop(build, slot, item);
+            return 1;
+        }
+
+        // Insert before the first index that starts after the hash, if
+        // the indices it shifts forward don't leave the range.
+        if (robin_hood && hashmap_robin_distance(header, header, index, slot) < distance) {
+            size_t end = index;
+            while (end < high && hashmap_build_load_slot(header, indices, end, high) != header->index_mask)
+                ++end;
+            if (end == high)
+                return 0;
+            for (; end > index; --end)
+                hashmap_store_slot(indices, end, header->index_stride, hashmap_build_load_slot(header, indices, end - 1, high));
+            hashmap_store_slot(indices, index, header->index_stride, item);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void hashmap_build_fill(HashMapBuild* build, size_t id) {
+    size_t  low      = id       << build->range_shift;
+    size_t  high     = (id + 1) << build->range_shift;
+    size_t* items    = build->items + build->ranges[id];
+    size_t  count    = build->ranges[id + 1] - build->ranges[id];
+    size_t  overflow = 0;
+
+    // The entries that didn't fit are moved to the start of
+    // the range's items, which have already been read.
+    for (size_t i = 0; i < count; ++i) {
+        if (!hashmap_build_place(build, items[i], low, high))
+            items[overflow++] = items[i];
+    }
+    build->overflows[id] = overflow;
+}
+
+/// Removes the dropped entries so the rest are dense again,
+/// and points the indices to where their entries moved.
+static void hashmap_build_compact(HashMapBuild* build) {
+    HashMapHeader* header = build->header;
+    size_t*        moved  = build->hashes;
+    size_t         count  = 0;
+
+    for (size_t i = 0; i < build->count; ++i) {
+        moved[i] = count;
+        if (build->dropped[i])
+            continue;
+        if (count != i) {
+            size_t* from = hashmap_slot_hash(header, i);
+            memcpy(hashmap_slot_key(header, count),   hashmap_slot_key(header, i),   header->key_stride);
+            memcpy(hashmap_slot_value(header, count), hashmap_slot_value(header, i), header->value_stride);
+            if (from != NULL)
+                *hashmap_slot_hash(header, count) = *from;
+        }
+        count += 1;
+    }
+
+    u8* indices = hashmap_indices_of(header);
+    for (size_t index = 0; index < header->index_capacity; ++index) {
+        size_t slot = hashmap_index_slot(header, index);
+        if (slot != HASHMAP_NOT_FOUND)
+            hashmap_store_slot(indices, index, header->index_stride, moved[slot]);
+    }
+    header->count = count;
+}
+
+/// Sets the entries of a small hashmap one at a time, as there
+/// are no indices to build.
+static int hashmap_small_build(HashMapHeader* header, const u8* keys, const u8* values, size_t count, hash_function hash_key, compare_function compare_key) {
+    if (keys == NULL) {
+        header->count = count;
+        return 1;
+    }
+
+    header->count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const u8* key  = keys + i * header->key_stride;
+        size_t    slot = (compare_key != NULL) ? hashmap_small_find(header, key, compare_key) : HASHMAP_NOT_FOUND;
+        if (slot == HASHMAP_NOT_FOUND) {
+            slot = header->count++;
+            size_t* stored = hashmap_slot_hash(header, slot);
+            memcpy(hashmap_slot_key(header, slot), key, header->key_stride);
+            if (stored != NULL)
+                *stored = hash_key(key, header->key_stride);
+        }
+        memcpy(hashmap_slot_value(header, slot), values + i * header->value_stride, header->value_stride);
+    }
+    return 1;
+}
+
+/// Builds the indices of the `count` entries, copying them from `keys`
+/// and `values` first unless they're NULL. Without `compare_key`, the
+/// keys have to be unique. The indices have to be cleared. Returns 0 if
+/// the temporary memory couldn't be allocated, and nothing was done.
+static int hashmap_build(HashMapHeader* header, const void* keys, const void* values, size_t count, size_t threads, hash_function hash_key, compare_function compare_key) {
+#ifndef TKB_MAP_THREADS
+    threads = 1;
+#endif
+    if (hashmap_is_small(header))
+        return hashmap_small_build(header, (const u8*)keys, (const u8*)values, count, hash_key, compare_key);
+
+    // Each range has to fit a whole group, and is
+    // a power of 2 so the range is a shift away.
+    size_t range_shift = 0;
+    while (((size_t)1 << range_shift) < header->index_capacity)
+        ++range_shift;
+
+    size_t ranges = 1;
+    while (ranges * 2 <= threads && ranges * 2 <= HASHMAP_BUILD_MAX_THREADS && range_shift > 4) {
+        ranges      *= 2;
+        range_shift -= 1;
+    }
+
+    size_t temporary = count * 2 * sizeof(size_t) + ranges * (ranges + 2) * sizeof(size_t) + sizeof(size_t) + count;
+    u8*    memory    = allocate(header->allocator, temporary);
+    if (memory == NULL)
+        return 0;
+    memset(memory + count * 2 * sizeof(size_t), 0, temporary - count * 2 * sizeof(size_t));
+
+    HashMapBuild build = {
+        .header      = header,
+        .keys        = (const u8*)keys,
+        .values      = (const u8*)values,
+        .hash_key    = hash_key,
+        .compare_key = compare_key,
+        .count       = count,
+        .threads     = ranges,
+        .range_shift = range_shift,
+        .hashes      = (size_t*)memory,
+        .items       = (size_t*)memory + count,
+        .offsets     = (size_t*)memory + count * 2,
+        .ranges      = (size_t*)memory + count * 2 + ranges * ranges,
+        .overflows   = (size_t*)memory + count * 2 + ranges * ranges + ranges + 1,
+        .dropped     = memory + count * 2 * sizeof(size_t) + ranges * (ranges + 2) * sizeof(size_t) + sizeof(size_t),
+    };
+    header->count = count;
+
+    hashmap_build_run(&build, hashmap_build_hash);
+
+    // Turn the counts into where each slice writes each range.
+    size_t offset = 0;
+    for (size_t range = 0; range < ranges; ++range) {
+        build.ranges[range] = offset;
+        for (size_t slice = 0; slice < ranges; ++slice) {
+            size_t n = build.offsets[slice * ranges + range];
+            build.offsets[slice * ranges + range] = offset;
+            offset += n;
+        }
+    }
+    build.ranges[ranges] = offset;
+
+    hashmap_build_run(&build, hashmap_build_partition);
+    hashmap_build_run(&build, hashmap_build_fill);
+
+    // The entries that left their range are placed like any set.
+    int dropped = 0;
+    for (size_t range = 0; range < ranges; ++range) {
+        for (size_t i = 0; i < build.overflows[range]; ++i) {
+            size_t item = build.items[build.ranges[range] + i];
+            size_t hash = build.hashes[item];
+
+            size_t index = (compare_key != NULL) ? hashmap_index_find(header, header, hashmap_slot_key(header, item), hash, compare_key) : HASHMAP_NOT_FOUND;
+            if (index != HASHMAP_NOT_FOUND) {
+                hashmap_build_drop(&build, hashmap_load_slot(hashmap_indices_of(header), index, header->index_stride, header->index_mask), item);
+                continue;
+            }
+            hashmap_index_insert(header, hashmap_index_find_free(header, hash), hash, item);
+        }
+    }
+
+    for (size_t i = 0; i < count && !dropped; ++i)
+        dropped = build.dropped[i];
+    if (dropped)
+        hashmap_build_compact(&build);
+
+    deallocate(header->allocator, memory, temporary);
+    return 1;
+}
+
+HashMap* hashmap_build_from(Allocator* allocator, const void* keys, const void* values, size_t count, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options, size_t threads, hash_function hash_key, compare_function compare_key) {
+    HashMap* map = hashmap_new_with_options(allocator, (count > 0) ? count : 1, load_factor, key_stride, value_stride, options);
+    if (map == NULL)
+        return NULL;
+
+    HashMapHeader* header = hashmap_header(map);
+    if (!hashmap_build(header, keys, values, count, threads, hash_key, compare_key)) {
+        hashmap_free(&map);
+        return NULL;
+    }
+
+    // The strings are copied afterwards, so only the keys that
+    // were kept are copied, and the threads don't share a chunk.
+    if (header->options & HASHMAP_OPTION_OWNED_KEYS) {
+        u8 owned[sizeof(StringKey)];
+        for (size_t i = 0; i < header->count; ++i) {
+            u8* key = hashmap_slot_key(header, i);
+            if (hashmap_own_key(header, key, owned) == NULL) {
+                hashmap_free(&map);
+                return NULL;
+            }
+            memcpy(key, owned, header->key_stride);
+        }
+    }
+
+    if (header->filter != NULL)
+        hashmap_filter_count(header);
+    return map;
+}
+
+/// Points the indices to every entry, with the hash
+/// either stored or computed from the key.
+static void hashmap_rebuild_indices(HashMapHeader* header, hash_function hash_key) {
+    size_t count      = header->count;
+    size_t key_stride = header->key_stride;
+
+    hashmap_clear_indices(header);
+    if (hashmap_is_small(header))
+        return;
+#ifdef TKB_MAP_THREADS
+    if (count >= HASHMAP_PARALLEL_REBUILD_COUNT && hashmap_build(header, NULL, NULL, count, HASHMAP_REBUILD_THREADS, hash_key, NULL))
+        return;
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        size_t* stored = hashmap_slot_hash(header, i);
+        size_t  hash   = (stored != NULL) ? *stored : hash_key(hashmap_slot_key(header, i), key_stride);
+        hashmap_index_insert(header, hashmap_index_find_free(header, hash), hash, i);
+    }
+}
+
+/// Moves the dense arrays of a block from the offsets `from` to the
+/// offsets `to`. The arrays are in the same order at both, but each can
+/// move up or down on its own, e.g. the keys move up when the indices
+/// grow, while the values move down as the capacity shrinks. The arrays
+/// that move down are moved first, from the lowest one, and then those
+/// that move up, from the highest one, so none is written over before
+/// it has moved.
+static void hashmap_move_arrays(u8* data, const size_t* from, const size_t* to, const size_t* sizes, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (to[i] < from[i])
+            memmove(data + to[i], data + from[i], sizes[i]);
+    }
+    for (size_t i = count; i-- > 0;) {
+        if (to[i] > from[i])
+            memmove(data + to[i], data + from[i], sizes[i]);
+    }
+}
+
+/// Resizes the block in place with `reallocate`. The keys, values and
+/// hashes are dense, so they only need to be moved to their new offsets
+/// and never rehashed. Returns NULL if the allocator couldn't reallocate,
+/// in which case the old block is untouched.
+static HashMapHeader* hashmap_resize_in_place(HashMapHeader* header, size_t capacity, size_t index_capacity) {
+    size_t count        = hashmap_dense_capacity(header->count, header->options);
+    size_t key_stride   = header->key_stride;
+    size_t value_stride = header->value_stride;
+    size_t index_stride = hashmap_index_stride(index_capacity);
+    u16    options      = header->options;
+
+    size_t old_total_size = hashmap_header_total_size(header);
+    size_t new_total_size = hashmap_total_size(capacity, index_capacity, index_stride, key_stride, value_stride, options);
+
+    // The offsets are from the end of the header.
+    size_t old_offsets[3] = {
+        hashmap_keys_offset(header->index_capacity, header->index_stride),
+        hashmap_values_offset(header->capacity, header->index_capacity, header->index_stride, key_stride, value_stride, options),
+        hashmap_hashes_offset(header->capacity, header->index_capacity, header->index_stride, key_stride, value_stride, options),
+    };
+    size_t new_offsets[3] = {
+        hashmap_keys_offset(index_capacity, index_stride),
+        hashmap_values_offset(capacity, index_capacity, index_stride, key_stride, value_stride, options),
+        hashmap_hashes_offset(capacity, index_capacity, index_stride, key_stride, value_stride, options),
+    };
+    size_t sizes[3] = {
+        count * hashmap_keys_row(key_stride, value_stride, options),
+        count * hashmap_values_row(value_stride, options),
+        (options & HASHMAP_OPTION_STORE_HASH) ? count * sizeof(size_t) : 0,
+    };
+
+    // Everything has to fit in the block while it's moved, so
+    // grow it before, and shrink it after.
+    u8* block;
+    if (new_total_size >= old_total_size) {
+        block = reallocate(header->allocator, new_total_size, header, old_total_size);
+        if (block == NULL)
+            return NULL;
+        hashmap_move_arrays(block + sizeof(HashMapHeader), old_offsets, new_offsets, sizes, 3);
+    } else {
+        u8* data = (u8*)header + sizeof(HashMapHeader);
+        hashmap_move_arrays(data, old_offsets, new_offsets, sizes, 3);
+
+        block = reallocate(header->allocator, new_total_size, header, old_total_size);
+        if (block == NULL) {
+            // Move everything back, so the block is left as it was.
+            hashmap_move_arrays(data, new_offsets, old_offsets, sizes, 3);
+            return NULL;
+        }
+    }
+
+    header = (HashMapHeader*)block;
+    header->capacity       = capacity;
+    header->index_capacity = index_capacity;
+    header->index_mask     = hashmap_index_mask(index_capacity);
+    header->index_stride   = index_stride;
+    return header;
+}
+
+/// Allocates a new block and copies the keys, values and hashes
+/// into it, unless `incremental`, but leaves the indices cleared.
+static HashMapHeader* hashmap_resize_copy(HashMapHeader* old_header, size_t capacity, size_t index_capacity, int incremental) {
+    Allocator* allocator    = old_header->allocator;
+    size_t     count        = old_header->count;
+    size_t     dense        = hashmap_dense_capacity(count, old_header->options);
+    size_t     key_stride   = old_header->key_stride;
+    size_t     value_stride = old_header->value_stride;
+    u16        options      = old_header->options;
+
+    size_t index_stride = hashmap_index_stride(index_capacity);
+    size_t total_size   = hashmap_total_size(capacity, index_capacity, index_stride, key_stride, value_stride, options);
+    HashMapHeader* new_header = allocate(allocator, total_size);
+    if (new_header == NULL)
+        return NULL;
+
+    *new_header = (HashMapHeader) {
+            .allocator      = allocator,
+            .count          = count,
+            .capacity       = capacity,
+            .index_capacity = index_capacity,
+            .index_mask     = hashmap_index_mask(index_capacity),
+            .tombstones     = 0,
+            .previous       = NULL,
+            .migrated       = 0,
+            .copied         = 0,
+            .chunks         = old_header->chunks,
+            .strings        = old_header->strings,
+            .filter         = old_header->filter,
+            .filter_mask    = old_header->filter_mask,
+            .load_factor    = old_header->load_factor,
+            .grow_factor    = old_header->grow_factor,
+            .key_stride     = key_stride,
+            .value_stride   = value_stride,
+            .index_stride   = index_stride,
+            .options        = options,
+            .entry_stride   = old_header->entry_stride,
+            .value_offset   = old_header->value_offset,
+    };
+    HASHMAP_STATS_BLOCK(new_header->stats = old_header->stats;)
+    hashmap_clear_indices(new_header);
+    if (incremental)
+        return new_header;
+
+    // The keys and values are dense, so they keep their
+    // slot and can be copied over in bulk.
+    size_t* new_hashes = hashmap_hashes_of(new_header);
+    memcpy(hashmap_keys_of(new_header),   hashmap_keys_of(old_header),   dense * hashmap_keys_row(key_stride, value_stride, options));
+    memcpy(hashmap_values_of(new_header), hashmap_values_of(old_header), dense * hashmap_values_row(value_stride, options));
+    if (new_hashes != NULL)
+        memcpy(new_hashes, hashmap_hashes_of(old_header), dense * sizeof(size_t));
+    return new_header;
+}
+
+/// Changes the capacity of the hashmap to `capacity`, which must be at
+/// least the count. With `incremental`, the old indices are kept and
+/// migrated by the following sets and deletes (see `hashmap_migrate`),
+/// otherwise they're rebuilt right away. Returns 0 on failure, in which
+/// case the hashmap is left as it was.
+static int hashmap_resize(HashMap** map, size_t capacity, hash_function hash_key, int incremental) {
+    HashMapHeader* old_header = hashmap_header(*map);
+
+    // Resizing again before the last incremental grow has
+    // finished, so everything has to be migrated first.
+    if (old_header->previous != NULL)
+        hashmap_migrate(old_header, old_header->previous->index_capacity, hash_key);
+
+    // The chunks don't move, so they're only added before
+    // growing, and released after shrinking.
+    if (old_header->chunks != NULL && !hashmap_chunks_reserve(old_header, capacity))
+        return 0;
+
+    size_t index_capacity = hashmap_index_capacity(capacity, old_header->load_factor, old_header->options);
+    HashMapHeader* new_header = NULL;
+
+    // The old indices has to stay around while they're migrated,
+    // so the block can't be resized in place.
+    incremental = incremental && (old_header->options & HASHMAP_OPTION_INCREMENTAL) && old_header->count > 0 && !hashmap_is_small(old_header);
+    if (!incremental)
+        new_header = hashmap_resize_in_place(old_header, capacity, index_capacity);
+
+    if (new_header == NULL) {
+        new_header = hashmap_resize_copy(old_header, capacity, index_capacity, incremental);
+        if (new_header == NULL)
+            return 0;
+
+        if (incremental)
+            new_header->previous = old_header;
+        else
+            deallocate(old_header->allocator, old_header, hashmap_header_total_size(old_header));
+    }
+
+    if (new_header->previous == NULL)
+        hashmap_rebuild_indices(new_header, hash_key);
+
+    hashmap_chunks_release(new_header, capacity);
+    if (new_header->filter != NULL)
+        hashmap_filter_resize(new_header);
+
+    *map = (HashMap*)(new_header + 1);
+    return 1;
+}
+
+void hashmap_grow(HashMap** map, hash_function hash_key, compare_function compare_key) {
+    // The keys are already unique, so they're never compared
+    // when reinserted, only placed at their first free index.
+    (void)compare_key;
+
+    HashMapHeader* header = hashmap_header(*map);
+#ifdef TKB_MAP_STATS
+    u64 start = hashmap_stats_now();
+#endif
+    hashmap_resize(map, hashmap_grow_capacity(header->capacity, header->grow_factor), hash_key, 1);
+#ifdef TKB_MAP_STATS
+    u64 elapsed = hashmap_stats_now() - start;
+
+    HashMapStats* stats = &hashmap_header(*map)->stats;
+    stats->grows            += 1;
+    stats->grow_nanoseconds += elapsed;
+    if (elapsed > stats->grow_max_nanoseconds)
+        stats->grow_max_nanoseconds = elapsed;
+#endif
+}
+
+void hashmap_finish_migration(HashMap** map, hash_function hash_key) {
+    HashMapHeader* header = hashmap_header(*map);
+    if (header->previous != NULL)
+        hashmap_migrate(header, header->previous->index_capacity, hash_key);
+}
+
+int hashmap_reserve(HashMap** map, size_t count, hash_function hash_key, compare_function compare_key) {
+    (void)compare_key;
+
+    if (count <= hashmap_header(*map)->capacity)
+        return 1;
+    return hashmap_resize(map, count, hash_key, 0);
+}
+
+int hashmap_shrink_to_fit(HashMap** map, hash_function hash_key, compare_function compare_key) {
+    (void)compare_key;
+
+    HashMapHeader* header = hashmap_header(*map);
+    if ((header->options & HASHMAP_OPTION_OWNED_KEYS) && !hashmap_strings_compact(header))
+        return 0;
+
+    size_t capacity = (header->count > 0) ? header->count : 1;
+    if (capacity == header->capacity)
+        return 1;
+    return hashmap_resize(map, capacity, hash_key, 0);
+}
+
+void hashmap_clear(HashMap* map) {
+    HashMapHeader* header = hashmap_header(map);
+    if (header->previous != NULL) {
+        deallocate(header->allocator, header->previous, hashmap_header_total_size(header->previous));
+        header->previous = NULL;
+        header->migrated = 0;
+        header->copied   = 0;
+    }
+    if (header->options & HASHMAP_OPTION_OWNED_KEYS) {
+        hashmap_strings_release(header->allocator, header->strings);
+        header->strings = NULL;
+    }
+
+    header->count = 0;
+    hashmap_clear_indices(header);
+    if (header->filter != NULL)
+        hashmap_filter_count(header);
+}
+
+size_t hashmap_merge(HashMap** dst, const HashMap* src, hash_function hash_key, compare_function compare_key) {
+    const HashMapHeader* source = hashmap_header(src);
+    const HashMapHeader* header = hashmap_header(*dst);
+    if (source == header)
+        return 0;
+    if (source->key_stride != header->key_stride || source->value_stride != header->value_stride)
+        return 0;
+
+    // The keys of `src` may already be in `dst`, so only room for the
+    // larger of the two is reserved, and the rest grows as it's needed.
+    size_t count = source->count;
+    hashmap_reserve(dst, (header->count > count) ? header->count : count, hash_key, compare_key);
+
+    // Dense entries can be set as a batch, to overlap their cache
+    // misses. Those in chunks or interleaved are set one at a time.
+    if (source->chunks == NULL && source->previous == NULL && !(source->options & HASHMAP_OPTION_INTERLEAVED))
+        return hashmap_set_batch(dst, hashmap_keys_of(source), hashmap_values_of(source), count, hash_key, compare_key);
+
+    size_t added = 0;
+    for (size_t i = 0; i < count; ++i)
+        added += hashmap_set(dst, hashmap_slot_key(source, i), hashmap_slot_value(source, i), hash_key, compare_key);
+    return added;
+}
+
+/// Sets the count after `hashmap_retain` has moved the entries, and
+/// rebuilds the indices if any of them were removed.
+static size_t hashmap_retain_finish(HashMapHeader* header, size_t count, size_t kept, hash_function hash_key) {
+    if (kept == count)
+        return 0;
+
+    // The slots have moved, so the previous indices of an
+    // incremental grow are of no use anymore.
+    if (header->previous != NULL) {
+        deallocate(header->allocator, header->previous, hashmap_header_total_size(header->previous));
+        header->previous = NULL;
+        header->migrated = 0;
+        header->copied   = 0;
+    }
+
+    header->count = kept;
+    hashmap_rebuild_indices(header, hash_key);
+    return count - kept;
+}
+
+size_t hashmap_retain(HashMap* map, retain_function keep, void* data, hash_function hash_key) {
+    HashMapHeader* header       = hashmap_header(map);
+    size_t         count        = header->count;
+    size_t         key_stride   = header->key_stride;
+    size_t         value_stride = header->value_stride;
+
+    // The entries are moved within the new block, so the ones
+    // left in the previous block are copied over first.
+    if (header->previous != NULL)
+        hashmap_copy_entries(header, header->previous->count);
+
+    // The entries in chunks stay where they are, so each one that
+    // is removed is replaced by the last one, as in `hashmap_del`.
+    // The one that was moved is checked next.
+    if (header->chunks != NULL) {
+        size_t end = count;
+        for (size_t i = 0; i < end;) {
+            if (keep(hashmap_slot_key(header, i), hashmap_slot_value(header, i), data)) {
+                ++i;
+                continue;
+            }
+            if (header->filter != NULL)
+                hashmap_filter_remove(header, *hashmap_slot_hash(header, i));
+
+            end -= 1;
+            if (i != end) {
+                size_t* stored      = hashmap_slot_hash(header, i);
+                size_t* last_stored = hashmap_slot_hash(header, end);
+                memcpy(hashmap_slot_key(header, i),   hashmap_slot_key(header, end),   key_stride);
+                memcpy(hashmap_slot_value(header, i), hashmap_slot_value(header, end), value_stride);
+                if (stored != NULL)
+                    *stored = *last_stored;
+            }
+        }
+        return hashmap_retain_finish(header, count, end, hash_key);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!keep(hashmap_slot_key(header, i), hashmap_slot_value(header, i), data)) {
+            if (header->filter != NULL)
+                hashmap_filter_remove(header, *hashmap_slot_hash(header, i));
+            continue;
+        }
+
+        if (kept != i) {
+            size_t* stored      = hashmap_slot_hash(header, i);
+            size_t* kept_stored = hashmap_slot_hash(header, kept);
+            memcpy(hashmap_slot_key(header, kept),   hashmap_slot_key(header, i),   key_stride);
+            memcpy(hashmap_slot_value(header, kept), hashmap_slot_value(header, i), value_stride);
+            if (stored != NULL)
+                *kept_stored = *stored;
+        }
+        kept += 1;
+    }
+    return hashmap_retain_finish(header, count, kept, hash_key);
+}
+
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HASHMAP_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define HASHMAP_PREFETCH(address) ((void)(address))
+#endif
+
+/// How many keys that are in flight at once in the batch
+/// functions. It needs to be large enough to cover the
+/// latency of a cache miss, but small enough that the
+/// prefetched lines aren't evicted before they're used.
+#define HASHMAP_BATCH_SIZE 16
+
+/// Hashes the keys and prefetches their home index, and
+/// then the entries those indices point to.
+static inline void hashmap_prefetch_batch(const HashMapHeader* header, const u8* keys, size_t count, size_t* hashes, hash_function hash_key) {
+    size_t key_stride     = header->key_stride;
+    size_t index_stride   = header->index_stride;
+    size_t index_mask     = header->index_mask;
+    size_t hash_mask      = header->index_capacity - 1;
+
+    const u8* indices = hashmap_indices_of(header);
+    const u8* control = hashmap_control_of(header);
+
+    for (size_t i = 0; i < count; ++i) {
+        hashes[i] = hash_key(keys + i * key_stride, key_stride);
+        size_t index = hashes[i] & hash_mask;
+        HASHMAP_PREFETCH(indices + index * index_stride);
+        if (control != NULL)
+            HASHMAP_PREFETCH(control + index);
+        if (header->filter != NULL) {
+            u64 counters;
+            HASHMAP_PREFETCH(hashmap_filter_block(header, hashes[i], &counters));
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t slot = hashmap_load_slot(indices, hashes[i] & hash_mask, index_stride, index_mask);
+        if (slot >= header->count)
+            continue;
+        const size_t* stored = hashmap_slot_hash(header, slot);
+        HASHMAP_PREFETCH(hashmap_slot_key(header, slot));
+        HASHMAP_PREFETCH(hashmap_slot_value(header, slot));
+        if (stored != NULL)
+            HASHMAP_PREFETCH(stored);
+    }
+}
+
+void hashmap_get_batch(const HashMap* map, const void* keys, size_t count, void** results, hash_function hash_key, compare_function compare_key) {
+    const HashMapHeader* header = hashmap_header(map);
+    size_t key_stride = header->key_stride;
+    size_t hashes[HASHMAP_BATCH_SIZE];
+
+    if (hashmap_is_small(header)) {
+        for (size_t i = 0; i < count; ++i)
+            results[i] = hashmap_small_get(header, (const u8*)keys + i * key_stride, compare_key);
+        return;
+    }
+
+    for (size_t start = 0; start < count; start += HASHMAP_BATCH_SIZE) {
+        size_t n = (count - start < HASHMAP_BATCH_SIZE) ? count - start : HASHMAP_BATCH_SIZE;
+        const u8* batch = (const u8*)keys + start * key_stride;
+
+        hashmap_prefetch_batch(header, batch, n, hashes, hash_key);
+        for (size_t i = 0; i < n; ++i) {
+            results[start + i] = hashmap_get_hashed(map, batch + i * key_stride, hashes[i], compare_key);
+        }
+    }
+}
+
+/// Grows the hashmap until it has room for `count` more entries, the
+/// same way as when a set finds it full, so that only as much room is
+/// made as the keys that turn out to be new need.
+static void hashmap_grow_for(HashMap** map, size_t count, hash_function hash_key, compare_function compare_key) {
+    HashMapHeader* header = hashmap_header(*map);
+    while (header->count + count > header->capacity) {
+        size_t capacity = header->capacity;
+        hashmap_grow(map, hash_key, compare_key);
+        header = hashmap_header(*map);
+        if (header->capacity == capacity)
+            return;
+    }
+}
+
+size_t hashmap_set_batch(HashMap** map, const void* keys, const void* values, size_t count, hash_function hash_key, compare_function compare_key) {
+    HashMapHeader* header = hashmap_header(*map);
+
+    size_t key_stride   = header->key_stride;
+    size_t value_stride = header->value_stride;
+    size_t added        = 0;
+    size_t hashes[HASHMAP_BATCH_SIZE];
+
+    if (hashmap_is_small(header)) {
+        for (size_t i = 0; i < count; ++i)
+            added += hashmap_set(map, (const u8*)keys + i * key_stride, (const u8*)values + i * value_stride, hash_key, compare_key);
+        return added;
+    }
+
+    for (size_t start = 0; start < count; start += HASHMAP_BATCH_SIZE) {
+        size_t n = (count - start < HASHMAP_BATCH_SIZE) ? count - start : HASHMAP_BATCH_SIZE;
+        const u8* batch_keys   = (const u8*)keys   + start * key_stride;
+        const u8* batch_values = (const u8*)values + start * value_stride;
+
+        // Grow before the block, so the indices that are prefetched
+        // aren't thrown away by a grow in the middle of it.
+        hashmap_grow_for(map, n, hash_key, compare_key);
+        hashmap_prefetch_batch(hashmap_header(*map), batch_keys, n, hashes, hash_key);
+        for (size_t i = 0; i < n; ++i) {
+            added += hashmap_set_hashed(map, batch_keys + i * key_stride, batch_values + i * value_stride, hashes[i], hash_key, compare_key);
+        }
+    }
+    return added;
+}
+
+
+#ifdef TKB_MAP_STATS
+const HashMapStats* hashmap_stats_of(const HashMap* map) {
+    return &hashmap_header(map)->stats;
+}
+
+static void hashmap_stats_print_probes(FILE* file, const char* name, const u64* histogram) {
+    u64 total = 0;
+    for (size_t i = 0; i < HASHMAP_STATS_BUCKETS; ++i)
+        total += histogram[i];
+    fprintf(file, "  %s probes: %llu\n", name, total);
+    if (total == 0)
+        return;
+
+    for (size_t i = 0; i < HASHMAP_STATS_BUCKETS; ++i) {
+        if (histogram[i] == 0)
+            continue;
+        u64 low = (i == 0) ? 0 : (1ULL << (i - 1));
+        fprintf(file, "    %6llu%s %12llu (%5.1f%%)\n", low, (i + 1 == HASHMAP_STATS_BUCKETS) ? "+" : " ",
+                histogram[i], 100.0 * (double)histogram[i] / (double)total);
+    }
+}
+
+void hashmap_stats(const HashMap* map, FILE* file) {
+    const HashMapHeader* header = hashmap_header(map);
+    const HashMapStats*  stats  = &header->stats;
+
+    fprintf(file, "hashmap %p: %zu of %zu entries, %zu indices (%.1f%% load, %.1f%% of capacity)\n",
+            (const void*)map, header->count, header->capacity, header->index_capacity,
+            hashmap_is_small(header) ? 0.0 : 100.0 * (double)header->count / (double)header->index_capacity,
+            100.0 * (double)header->count / (double)header->capacity);
+    fprintf(file, "  tombstones: %zu\n", header->tombstones);
+    fprintf(file, "  grows: %llu (%.3f ms in total, %.3f ms at most), %llu before reaching the capacity\n",
+            stats->grows, (double)stats->grow_nanoseconds / 1e6, (double)stats->grow_max_nanoseconds / 1e6, stats->full_probes);
+    fprintf(file, "  misses: %llu get, %llu del\n", stats->get_misses, stats->del_misses);
+    hashmap_stats_print_probes(file, "get", stats->get_probes);
+    hashmap_stats_print_probes(file, "set", stats->set_probes);
+    hashmap_stats_print_probes(file, "del", stats->del_probes);
+}
+#endif
+
+
+
+size_t hash_string(const void* key, size_t stride) {
+    (void)stride;
+    const char* data = *(const char**) key;
+    size_t seed = 0;
+    for (size_t i = 0; data[i] != '\0'; ++i) {
+        seed ^= data[i] + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
+int compare_string(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    const char* str_a = *(const char**)key;
+    const char* str_b = *(const char**)candidate;
+    return strcmp(str_a, str_b) != 0;
+}
+
+
+// ---- Hashes for fixed-size keys ----
+//
+// The index is selected with the low bits of the hash, so
+// every bit of the key needs to affect them. The integer
+// hashes are multiply-xorshift finalizers, and the byte hash
+// is a wyhash-style hash that reads 8 bytes at a time.
+
+static inline u64 hashmap_read64(const u8* p) { u64 v; memcpy(&v, p, sizeof(v)); return v; }
+static inline u64 hashmap_read32(const u8* p) { u32 v; memcpy(&v, p, sizeof(v)); return v; }
+
+/// Multiplies a and b into 128 bits and returns the low
+/// 64 bits in a and the high 64 bits in b.
+static inline void hashmap_mum128(u64* a, u64* b) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 u128;
+    u128 r = (u128)*a * *b;
+    *a = (u64)r;
+    *b = (u64)(r >> 64);
+#else
+    u64 ha = *a >> 32, hb = *b >> 32, la = (u32)*a, lb = (u32)*b;
+    u64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    u64 t  = rl + (rm0 << 32);
+    u64 c  = t < rl;
+    u64 lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline u64 hashmap_mix(u64 a, u64 b) {
+    hashmap_mum128(&a, &b);
+    return a ^ b;
+}
+
+static const u64 HASHMAP_SECRET[4] = {
+    0xA0761D6478BD642FULL, 0xE7037ED1A0B428DBULL, 0x8EBC6AF09C88C6E3ULL, 0x589965CC75374CC3ULL,
+};
+
+/// Hashes `size` bytes at `data`, 8 bytes at a time.
+static inline u64 hashmap_hash_bytes(const void* data, size_t size, u64 seed) {
+    const u8* p = (const u8*)data;
+    u64 a, b;
+
+    seed ^= hashmap_mix(seed ^ HASHMAP_SECRET[0], HASHMAP_SECRET[1]);
+    if (size <= 16) {
+        if (size >= 4) {
+            size_t offset = (size >> 3) << 2;
+            a = (hashmap_read32(p) << 32) | hashmap_read32(p + offset);
+            b = (hashmap_read32(p + size - 4) << 32) | hashmap_read32(p + size - 4 - offset);
+        } else if (size > 0) {
+            a = ((u64)p[0] << 16) | ((u64)p[size >> 1] << 8) | p[size - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = size;
+        if (i > 48) {
+            u64 seed1 = seed, seed2 = seed;
+            do {
+                seed  = hashmap_mix(hashmap_read64(p)      ^ HASHMAP_SECRET[1], hashmap_read64(p + 8)  ^ seed);
+                seed1 = hashmap_mix(hashmap_read64(p + 16) ^ HASHMAP_SECRET[2], hashmap_read64(p + 24) ^ seed1);
+                seed2 = hashmap_mix(hashmap_read64(p + 32) ^ HASHMAP_SECRET[3], hashmap_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hashmap_mix(hashmap_read64(p) ^ HASHMAP_SECRET[1], hashmap_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = hashmap_read64(p + i - 16);
+        b = hashmap_read64(p + i - 8);
+    }
+
+    a ^= HASHMAP_SECRET[1];
+    b ^= seed;
+    hashmap_mum128(&a, &b);
+    return hashmap_mix(a ^ HASHMAP_SECRET[0] ^ size, b ^ HASHMAP_SECRET[1]);
+}
+
+static inline size_t hash_u32(const void* key, size_t stride) {
+    (void)stride;
+    u32 x = *(const u32*)key;
+    x ^= x >> 16;
+    x *= 0x7FEB352DU;
+    x ^= x >> 15;
+    x *= 0x846CA68BU;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline size_t hash_u64(const void* key, size_t stride) {
+    (void)stride;
+    u64 x = *(const u64*)key;
+    x ^= x >> 32;
+    x *= 0xD6E8FEB86659FD93ULL;
+    x ^= x >> 32;
+    x *= 0xD6E8FEB86659FD93ULL;
+    x ^= x >> 32;
+    return (size_t)x;
+}
+
+static inline size_t hash_ptr(const void* key, size_t stride) {
+    u64 x = (u64)(size_t)*(const void* const*)key;
+    return hash_u64(&x, stride);
+}
+
+/// Hashes all `stride` bytes of the key, for keys of
+/// fixed-size structs. The padding of a struct is hashed and
+/// compared too, so clear it (with memset) before setting the
+/// fields, and don't copy the key by assignment, which may
+/// leave the padding unspecified.
+static inline size_t hash_bytes(const void* key, size_t stride) {
+    return (size_t)hashmap_hash_bytes(key, stride, 0);
+}
+
+static inline int compare_u32(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    return *(const u32*)key != *(const u32*)candidate;
+}
+
+static inline int compare_u64(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    return *(const u64*)key != *(const u64*)candidate;
+}
+
+static inline int compare_ptr(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    return *(const void* const*)key != *(const void* const*)candidate;
+}
+
+static inline int compare_bytes(const void* key, const void* candidate, size_t stride) {
+    return memcmp(key, candidate, stride);
+}
+
+
+StringKey string_key(const char* data) {
+    return string_key_n(data, strlen(data));
+}
+
+StringKey string_key_n(const char* data, size_t length) {
+    StringKey key = { data, length, (size_t)hashmap_hash_bytes(data, length, 0) };
+    return key;
+}
+
+static inline size_t hash_string_key(const void* key, size_t stride) {
+    (void)stride;
+    return ((const StringKey*)key)->hash;
+}
+
+static inline int compare_string_key(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    const StringKey* a = (const StringKey*)key;
+    const StringKey* b = (const StringKey*)candidate;
+    if (a->length != b->length || a->hash != b->hash)
+        return 1;
+    return memcmp(a->data, b->data, a->length) != 0;
+}
+#endif  // TKB_MAP_IMPLEMENTATION
+
+
+
+#define MAP_DEFINE_H(Class, prefix, KEY, VALUE)                                                                                                                                                                      \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t capacity);                                 \
+    static inline Class*  prefix##_new_with_load_factor(Allocator* allocator, size_t capacity, float factor);  \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t capacity, float factor, HashMapOptions options);  \
+    static inline size_t  prefix##_count(const Class* map);                                                    \
+    static inline size_t  prefix##_capacity(const Class* map);                                                 \
+    static inline KEY*    prefix##_keys(const Class* map);                                                     \
+    static inline VALUE*  prefix##_values(const Class* map);                                                   \
+    static inline KEY*    prefix##_key_at(const Class* map, size_t i);                                         \
+    static inline VALUE*  prefix##_value_at(const Class* map, size_t i);                                       \
+    static inline VALUE*  prefix##_get(const Class* map, KEY key);                                             \
     static inline int     prefix##_set(Class** map, KEY key, VALUE value);                                     \
     static inline VALUE*  prefix##_del(Class** map, KEY key);                                                  \
     static inline void    prefix##_grow(Class** map);                                                          \
+    static inline void    prefix##_finish_migration(Class** map);                                              \
+    static inline int     prefix##_reserve(Class** map, size_t count);                                         \
+    static inline int     prefix##_shrink_to_fit(Class** map);                                                 \
+    static inline void    prefix##_clear(Class* map);                                                          \
+    static inline size_t  prefix##_merge(Class** dst, const Class* src);                                       \
+    static inline size_t  prefix##_retain(Class* map, retain_function keep, void* data);                       \
+    static inline void    prefix##_get_batch(const Class* map, const KEY* keys, size_t count, VALUE** results);  \
+    static inline size_t  prefix##_set_batch(Class** map, const KEY* keys, const VALUE* values, size_t count);   \
     static inline int     prefix##_set_load_factor(Class* map, float factor);                                  \
     static inline int     prefix##_set_grow_factor(Class* map, float factor);                                  \
     static inline void    prefix##_free(Class** map);                                                          \
 
 
-#define MAP_DEFINE_C(Class, prefix, KEY, VALUE)                                                                                                                                                                      \
+#define MAP_DEFINE_C_COMMON(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                                                                                                                \
     static inline Class*  prefix##_new(Allocator* allocator, size_t capacity)                                  { return (Class*) hashmap_new(allocator, capacity, HASHMAP_DEFAULT_LOAD_FACTOR, sizeof(KEY), sizeof(VALUE));  }                                           \
     static inline Class*  prefix##_new_with_load_factor(Allocator* allocator, size_t capacity, float factor)   { return (Class*) hashmap_new(allocator, capacity, factor, sizeof(KEY), sizeof(VALUE));  }                                           \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t capacity, float factor, HashMapOptions options)  { return (Class*) hashmap_new_with_options(allocator, capacity, factor, sizeof(KEY), sizeof(VALUE), options);  }  \
     static inline size_t  prefix##_count(const Class* map)                                                     { return hashmap_count((const HashMap*)map);    }                                                                           \
     static inline size_t  prefix##_capacity(const Class* map)                                                  { return hashmap_capacity((const HashMap*)map); }                                                                           \
     static inline KEY*    prefix##_keys(const Class* map)                                                      { return (KEY*)   hashmap_keys((const HashMap*)map);     }                                                                  \
     static inline VALUE*  prefix##_values(const Class* map)                                                    { return (VALUE*) hashmap_values((const HashMap*)map);   }                                                                  \
-    static inline VALUE*  prefix##_get(const Class* map, KEY key)                                              { return (VALUE*) hashmap_get((const HashMap*)map, (const void*)&key, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION);  }          \
-    static inline int     prefix##_set(Class** map, KEY key, VALUE value)                                      { return hashmap_set((HashMap**)map, (const void*)&key, (const void*)&value, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION);  }   \
-    static inline VALUE*  prefix##_del(Class** map, KEY key)                                                   { return hashmap_del((HashMap**)map, (const void*)&key, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION);  }   \
-    static inline void    prefix##_grow(Class** map)                                                           { hashmap_grow((HashMap**)map, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION);  }                                                 \
+    static inline KEY*    prefix##_key_at(const Class* map, size_t i)                                          { return (KEY*)   hashmap_key_at((const HashMap*)map, i);   }                                                               \
+    static inline VALUE*  prefix##_value_at(const Class* map, size_t i)                                        { return (VALUE*) hashmap_value_at((const HashMap*)map, i); }                                                               \
+    static inline void    prefix##_grow(Class** map)                                                           { hashmap_grow((HashMap**)map, HASH, COMPARE);  }                                                                           \
+    static inline void    prefix##_finish_migration(Class** map)                                               { hashmap_finish_migration((HashMap**)map, HASH);  }                                                                        \
+    static inline int     prefix##_reserve(Class** map, size_t count)                                          { return hashmap_reserve((HashMap**)map, count, HASH, COMPARE);  }                                                          \
+    static inline int     prefix##_shrink_to_fit(Class** map)                                                  { return hashmap_shrink_to_fit((HashMap**)map, HASH, COMPARE);  }                                                           \
+    static inline void    prefix##_clear(Class* map)                                                           { hashmap_clear((HashMap*)map);  }                                                                                          \
+    static inline size_t  prefix##_merge(Class** dst, const Class* src)                                        { return hashmap_merge((HashMap**)dst, (const HashMap*)src, HASH, COMPARE);  }                                              \
+    static inline size_t  prefix##_retain(Class* map, retain_function keep, void* data)                        { return hashmap_retain((HashMap*)map, keep, data, HASH);  }                                                                \
+    static inline void    prefix##_get_batch(const Class* map, const KEY* keys, size_t count, VALUE** results)  { hashmap_get_batch((const HashMap*)map, (const void*)keys, count, (void**)results, HASH, COMPARE);  }                \
+    static inline size_t  prefix##_set_batch(Class** map, const KEY* keys, const VALUE* values, size_t count)   { return hashmap_set_batch((HashMap**)map, (const void*)keys, (const void*)values, count, HASH, COMPARE);  }      \
     static inline int     prefix##_set_load_factor(Class* map, float factor)                                   { return hashmap_set_load_factor((HashMap*)map, factor);  }                                        \
     static inline int     prefix##_set_grow_factor(Class* map, float factor)                                   { return hashmap_set_grow_factor((HashMap*)map, factor);  }                                        \
     static inline void    prefix##_free(Class** map)                                                           { hashmap_free((HashMap**)map); }                                                                                           \
 
 
+/// Like MAP_DEFINE_C, but with the hash and compare functions for the key
+/// type, e.g. `MAP_DEFINE_C_WITH(IdMap, idmap, u64, int, hash_u64, compare_u64)`.
+#define MAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                                                                                                                  \
+    MAP_DEFINE_C_COMMON(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                                                                                                                    \
+    static inline VALUE*  prefix##_get(const Class* map, KEY key)                                              { return (VALUE*) hashmap_get((const HashMap*)map, (const void*)&key, HASH, COMPARE);  }                  \
+    static inline int     prefix##_set(Class** map, KEY key, VALUE value)                                      { return hashmap_set((HashMap**)map, (const void*)&key, (const void*)&value, HASH, COMPARE);  }           \
+    static inline VALUE*  prefix##_del(Class** map, KEY key)                                                   { return hashmap_del((HashMap**)map, (const void*)&key, HASH, COMPARE);  }                               \
+
+
+#define MAP_DEFINE_C(Class, prefix, KEY, VALUE)                                                                                                                                                                      \
+    MAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION)                                                                                                                            \
+
+
+/// Like MAP_DEFINE_C, but generates get/set/del with their own probe loops
+/// for the key and value types. HASH and COMPARE have the same signature as
+/// `hash_function` and `compare_function`, but are called directly with
+/// `sizeof(KEY)` as the stride, so they can be inlined. Keys and values are
+/// accessed as typed arrays instead of through memcpy of runtime strides.
+/// Maps created with any HashMapOptions other than INTERLEAVED use the
+/// generic functions instead.
+#define MAP_DEFINE_C_EX(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                                                                                                                    \
+    MAP_DEFINE_C_COMMON(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                                                                                                                    \
+    MAP_DEFINE_C_EX_PROBES(Class, prefix, dense,       KEY, VALUE, HASH, COMPARE, MAP_EX_DENSE_AT,       0)                                                                                                          \
+    MAP_DEFINE_C_EX_PROBES(Class, prefix, interleaved, KEY, VALUE, HASH, COMPARE, MAP_EX_INTERLEAVED_AT, header->entry_stride)                                                                                       \
+    static inline VALUE* prefix##_get(const Class* map, KEY key) {                                                                                                                                                   \
+        const HashMapHeader* header = hashmap_header((const HashMap*)map);                                                                                                                                           \
+        if ((header->options & ~HASHMAP_OPTION_INTERLEAVED) != HASHMAP_OPTION_NONE || HASHMAP_STATS_ENABLED)                                                                                                         \
+            return (VALUE*) hashmap_get((const HashMap*)map, (const void*)&key, HASH, COMPARE);                                                                                                                      \
+        if (header->options & HASHMAP_OPTION_INTERLEAVED)                                                                                                                                                            \
+            return prefix##_get_interleaved(header, key);                                                                                                                                                            \
+        return prefix##_get_dense(header, key);                                                                                                                                                                      \
+    }                                                                                                                                                                                                                \
+    static inline int prefix##_set(Class** map, KEY key, VALUE value) {                                                                                                                                              \
+        HashMapHeader* header = hashmap_header((const HashMap*)*map);                                                                                                                                                \
+        if ((header->options & ~HASHMAP_OPTION_INTERLEAVED) != HASHMAP_OPTION_NONE || HASHMAP_STATS_ENABLED)                                                                                                         \
+            return hashmap_set((HashMap**)map, (const void*)&key, (const void*)&value, HASH, COMPARE);                                                                                                               \
+        if (header->options & HASHMAP_OPTION_INTERLEAVED)                                                                                                                                                            \
+            return prefix##_set_interleaved(map, header, key, value);                                                                                                                                                \
+        return prefix##_set_dense(map, header, key, value);                                                                                                                                                          \
+    }                                                                                                                                                                                                                \
+    static inline VALUE* prefix##_del(Class** map, KEY key) {                                                                                                                                                        \
+        HashMapHeader* header = hashmap_header((const HashMap*)*map);                                                                                                                                                \
+        if ((header->options & ~HASHMAP_OPTION_INTERLEAVED) != HASHMAP_OPTION_NONE || HASHMAP_STATS_ENABLED)                                                                                                         \
+            return (VALUE*) hashmap_del((HashMap**)map, (const void*)&key, HASH, COMPARE);                                                                                                                           \
+        if (header->options & HASHMAP_OPTION_INTERLEAVED)                                                                                                                                                            \
+            return prefix##_del_interleaved(header, key);                                                                                                                                                            \
+        return prefix##_del_dense(header, key);                                                                                                                                                                      \
+    }                                                                                                                                                                                                                \
+
+/// The typed key or value of a slot in the probe loops of MAP_DEFINE_C_EX.
+/// In the default layout, the keys and the values are each an array of their
+/// type, so the stride is the size of the type. With INTERLEAVED, each one
+/// is `STEP` bytes (the entry stride) from the one in the previous slot.
+#define MAP_EX_DENSE_AT(T, base, slot, STEP)       (((T*)(base))[slot])
+#define MAP_EX_INTERLEAVED_AT(T, base, slot, STEP) (*(T*)((base) + (slot) * (STEP)))
+
+/// Generates the probe loops of MAP_DEFINE_C_EX for one layout, named
+/// `prefix##_get_##layout` and so on, that read the keys and values with
+/// `AT(T, base, slot, STEP)`.
+#define MAP_DEFINE_C_EX_PROBES(Class, prefix, layout, KEY, VALUE, HASH, COMPARE, AT, STEP)                                                                                                                           \
+    static inline VALUE* prefix##_get_##layout(const HashMapHeader* header, KEY key) {                                                                                                                               \
+        size_t     index_stride = header->index_stride;                                                                                                                                                              \
+        size_t     index_mask   = header->index_mask;                                                                                                                                                                \
+        size_t     hash_mask    = header->index_capacity - 1;                                                                                                                                                        \
+        size_t     counter      = header->index_capacity;                                                                                                                                                            \
+        const u8*  indices      = hashmap_indices_of(header);                                                                                                                                                        \
+        u8*        keys         = hashmap_keys_of(header);                                                                                                                                                           \
+        u8*        values       = hashmap_values_of(header);                                                                                                                                                         \
+                                                                                                                                                                                                                     \
+        size_t index = HASH(&key, sizeof(KEY)) & hash_mask;                                                                                                                                                          \
+        do {                                                                                                                                                                                                         \
+            size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);                                                                                                                               \
+            if (slot == index_mask)                                                                                                                                                                                  \
+                return NULL;                                                                                                                                                                                         \
+            if (slot != index_mask - 1 && COMPARE(&key, &AT(KEY, keys, slot, STEP), sizeof(KEY)) == 0)                                                                                                               \
+                return &AT(VALUE, values, slot, STEP);                                                                                                                                                               \
+            index = (index + 1) & hash_mask;                                                                                                                                                                         \
+        } while (--counter);                                                                                                                                                                                         \
+        return NULL;                                                                                                                                                                                                 \
+    }                                                                                                                                                                                                                \
+    static inline int prefix##_set_##layout(Class** map, HashMapHeader* header, KEY key, VALUE value) {                                                                                                              \
+        size_t index_capacity = header->index_capacity;                                                                                                                                                              \
+        size_t index_stride   = header->index_stride;                                                                                                                                                                \
+        size_t index_mask     = header->index_mask;                                                                                                                                                                  \
+        size_t hash_mask      = index_capacity - 1;                                                                                                                                                                  \
+        size_t counter        = index_capacity;                                                                                                                                                                      \
+        u8*    indices        = hashmap_indices_of(header);                                                                                                                                                          \
+        u8*    keys           = hashmap_keys_of(header);                                                                                                                                                             \
+        u8*    values         = hashmap_values_of(header);                                                                                                                                                           \
+                                                                                                                                                                                                                     \
+        size_t index      = HASH(&key, sizeof(KEY)) & hash_mask;                                                                                                                                                     \
+        size_t free_index = index_capacity;                                                                                                                                                                          \
+        do {                                                                                                                                                                                                         \
+            size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);                                                                                                                               \
+            if (slot >= index_mask - 1) {                                                                                                                                                                            \
+                if (free_index == index_capacity)                                                                                                                                                                    \
+                    free_index = index;                                                                                                                                                                              \
+                if (slot == index_mask)                                                                                                                                                                              \
+                    break;                                                                                                                                                                                           \
+            } else if (COMPARE(&key, &AT(KEY, keys, slot, STEP), sizeof(KEY)) == 0) {                                                                                                                                \
+                AT(VALUE, values, slot, STEP) = value;                                                                                                                                                               \
+                return 0;                                                                                                                                                                                            \
+            }                                                                                                                                                                                                        \
+            index = (index + 1) & hash_mask;                                                                                                                                                                         \
+        } while (--counter);                                                                                                                                                                                         \
+                                                                                                                                                                                                                     \
+        if (hashmap_needs_cleanup(header)) {                                                                                                                                                                         \
+            hashmap_rebuild_indices(header, HASH);                                                                                                                                                                   \
+            return prefix##_set(map, key, value);                                                                                                                                                                    \
+        }                                                                                                                                                                                                            \
+        if (free_index == index_capacity || header->count >= header->capacity) {                                                                                                                                     \
+            hashmap_grow((HashMap**)map, HASH, COMPARE);                                                                                                                                                             \
+            return prefix##_set(map, key, value);                                                                                                                                                                    \
+        }                                                                                                                                                                                                            \
+                                                                                                                                                                                                                     \
+        size_t i = header->count++;                                                                                                                                                                                  \
+        header->tombstones -= (hashmap_load_slot(indices, free_index, index_stride, index_mask) == index_mask - 1);                                                                                                  \
+        memcpy(indices + free_index * index_stride, &i, index_stride);                                                                                                                                               \
+        AT(KEY, keys, i, STEP)     = key;                                                                                                                                                                            \
+        AT(VALUE, values, i, STEP) = value;                                                                                                                                                                          \
+        return 1;                                                                                                                                                                                                    \
+    }                                                                                                                                                                                                                \
+    static inline VALUE* prefix##_del_##layout(HashMapHeader* header, KEY key) {                                                                                                                                     \
+        size_t index_capacity = header->index_capacity;                                                                                                                                                              \
+        size_t index_stride   = header->index_stride;                                                                                                                                                                \
+        size_t index_mask     = header->index_mask;                                                                                                                                                                  \
+        size_t hash_mask      = index_capacity - 1;                                                                                                                                                                  \
+        size_t counter        = index_capacity;                                                                                                                                                                      \
+        u8*    indices        = hashmap_indices_of(header);                                                                                                                                                          \
+        u8*    keys           = hashmap_keys_of(header);                                                                                                                                                             \
+        u8*    values         = hashmap_values_of(header);                                                                                                                                                           \
+                                                                                                                                                                                                                     \
+        size_t index = HASH(&key, sizeof(KEY)) & hash_mask;                                                                                                                                                          \
+        do {                                                                                                                                                                                                         \
+            size_t slot = hashmap_load_slot(indices, index, index_stride, index_mask);                                                                                                                               \
+            if (slot == index_mask)                                                                                                                                                                                  \
+                return NULL;                                                                                                                                                                                         \
+            if (slot != index_mask - 1 && COMPARE(&key, &AT(KEY, keys, slot, STEP), sizeof(KEY)) == 0) {                                                                                                             \
+                size_t last_slot = header->count - 1;                                                                                                                                                                \
+                if (slot != last_slot) {                                                                                                                                                                             \
+                    size_t last_hash  = HASH(&AT(KEY, keys, last_slot, STEP), sizeof(KEY));                                                                                                                          \
+                    size_t last_index = hashmap_find_index_of_slot(indices, index_capacity, index_stride, index_mask, last_hash, last_slot);                                                                         \
+                    memcpy(indices + last_index * index_stride, &slot, index_stride);                                                                                                                                \
+                    VALUE deleted                      = AT(VALUE, values, slot, STEP);                                                                                                                              \
+                    AT(KEY, keys, slot, STEP)          = AT(KEY, keys, last_slot, STEP);                                                                                                                             \
+                    AT(VALUE, values, slot, STEP)      = AT(VALUE, values, last_slot, STEP);                                                                                                                         \
+                    AT(VALUE, values, last_slot, STEP) = deleted;                                                                                                                                                    \
+                }                                                                                                                                                                                                    \
+                size_t deleted_slot = index_mask - 1;                                                                                                                                                                \
+                memcpy(indices + index * index_stride, &deleted_slot, index_stride);                                                                                                                                 \
+                header->tombstones += 1;                                                                                                                                                                             \
+                header->count -= 1;                                                                                                                                                                                  \
+                return &AT(VALUE, values, last_slot, STEP);                                                                                                                                                          \
+            }                                                                                                                                                                                                        \
+            index = (index + 1) & hash_mask;                                                                                                                                                                         \
+        } while (--counter);                                                                                                                                                                                         \
+        return NULL;                                                                                                                                                                                                 \
+    }                                                                                                                                                                                                                \
+
+
+
+#define SET_DEFINE_H(Class, prefix, KEY)                                                                         \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t capacity);                                 \
+    static inline Class*  prefix##_new_with_load_factor(Allocator* allocator, size_t capacity, float factor);  \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t capacity, float factor, HashMapOptions options);  \
+    static inline size_t  prefix##_count(const Class* set);                                                    \
+    static inline size_t  prefix##_capacity(const Class* set);                                                 \
+    static inline KEY*    prefix##_keys(const Class* set);                                                     \
+    static inline KEY*    prefix##_key_at(const Class* set, size_t i);                                         \
+    static inline int     prefix##_has(const Class* set, KEY key);                                             \
+    static inline int     prefix##_add(Class** set, KEY key);                                                  \
+    static inline int     prefix##_del(Class** set, KEY key);                                                  \
+    static inline void    prefix##_grow(Class** set);                                                          \
+    static inline void    prefix##_finish_migration(Class** set);                                              \
+    static inline int     prefix##_reserve(Class** set, size_t count);                                         \
+    static inline int     prefix##_shrink_to_fit(Class** set);                                                 \
+    static inline void    prefix##_clear(Class* set);                                                          \
+    static inline size_t  prefix##_merge(Class** dst, const Class* src);                                       \
+    static inline size_t  prefix##_retain(Class* set, retain_function keep, void* data);                       \
+    static inline size_t  prefix##_add_batch(Class** set, const KEY* keys, size_t count);                      \
+    static inline int     prefix##_set_load_factor(Class* set, float factor);                                  \
+    static inline int     prefix##_set_grow_factor(Class* set, float factor);                                  \
+    static inline void    prefix##_free(Class** set);                                                          \
+
+
+/// Like MAP_DEFINE_C_WITH, but for a set of keys, e.g.
+/// `SET_DEFINE_C_WITH(IdSet, idset, u64, hash_u64, compare_u64)`. The
+/// hashmap has a value stride of 0, so no values are allocated or
+/// copied. Nothing is read from the value, so the key is passed for it.
+/// `_add` and `_del` return 1 if the key was added or deleted.
+#define SET_DEFINE_C_WITH(Class, prefix, KEY, HASH, COMPARE)                                                     \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t capacity)                                  { return (Class*) hashmap_new(allocator, capacity, HASHMAP_DEFAULT_LOAD_FACTOR, sizeof(KEY), 0);  }        \
+    static inline Class*  prefix##_new_with_load_factor(Allocator* allocator, size_t capacity, float factor)   { return (Class*) hashmap_new(allocator, capacity, factor, sizeof(KEY), 0);  }                             \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t capacity, float factor, HashMapOptions options)  { return (Class*) hashmap_new_with_options(allocator, capacity, factor, sizeof(KEY), 0, options);  }  \
+    static inline size_t  prefix##_count(const Class* set)                                                     { return hashmap_count((const HashMap*)set);    }                                                  \
+    static inline size_t  prefix##_capacity(const Class* set)                                                  { return hashmap_capacity((const HashMap*)set); }                                                  \
+    static inline KEY*    prefix##_keys(const Class* set)                                                      { return (KEY*) hashmap_keys((const HashMap*)set);      }                                          \
+    static inline KEY*    prefix##_key_at(const Class* set, size_t i)                                          { return (KEY*) hashmap_key_at((const HashMap*)set, i); }                                          \
+    static inline int     prefix##_has(const Class* set, KEY key)                                              { return hashmap_get((const HashMap*)set, (const void*)&key, HASH, COMPARE) != NULL;  }            \
+    static inline int     prefix##_add(Class** set, KEY key)                                                   { return hashmap_set((HashMap**)set, (const void*)&key, (const void*)&key, HASH, COMPARE);  }      \
+    static inline int     prefix##_del(Class** set, KEY key)                                                   { return hashmap_del((HashMap**)set, (const void*)&key, HASH, COMPARE) != NULL;  }                 \
+    static inline void    prefix##_grow(Class** set)                                                           { hashmap_grow((HashMap**)set, HASH, COMPARE);  }                                                  \
+    static inline void    prefix##_finish_migration(Class** set)                                               { hashmap_finish_migration((HashMap**)set, HASH);  }                                               \
+    static inline int     prefix##_reserve(Class** set, size_t count)                                          { return hashmap_reserve((HashMap**)set, count, HASH, COMPARE);  }                                 \
+    static inline int     prefix##_shrink_to_fit(Class** set)                                                  { return hashmap_shrink_to_fit((HashMap**)set, HASH, COMPARE);  }                                  \
+    static inline void    prefix##_clear(Class* set)                                                           { hashmap_clear((HashMap*)set);  }                                                                 \
+    static inline size_t  prefix##_merge(Class** dst, const Class* src)                                        { return hashmap_merge((HashMap**)dst, (const HashMap*)src, HASH, COMPARE);  }                     \
+    static inline size_t  prefix##_retain(Class* set, retain_function keep, void* data)                        { return hashmap_retain((HashMap*)set, keep, data, HASH);  }                                       \
+    static inline size_t  prefix##_add_batch(Class** set, const KEY* keys, size_t count)                       { return hashmap_set_batch((HashMap**)set, (const void*)keys, (const void*)keys, count, HASH, COMPARE);  }  \
+    static inline int     prefix##_set_load_factor(Class* set, float factor)                                   { return hashmap_set_load_factor((HashMap*)set, factor);  }                                        \
+    static inline int     prefix##_set_grow_factor(Class* set, float factor)                                   { return hashmap_set_grow_factor((HashMap*)set, factor);  }                                        \
+    static inline void    prefix##_free(Class** set)                                                           { hashmap_free((HashMap**)set); }                                                                  \
+
+
+#define SET_DEFINE_C(Class, prefix, KEY)                                                                         \
+    SET_DEFINE_C_WITH(Class, prefix, KEY, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION)                               \
+
@@ -0,0 +1,265 @@
+#ifndef TKB_INCLUDE_MAP_CONCURRENT_H
+#define TKB_INCLUDE_MAP_CONCURRENT_H
+
+// A read-mostly hashmap for many reader threads and serialized writers.
+//
+// Two copies of the hashmap are kept (left-right). Readers look up keys in
+// the active copy without taking any locks, while a writer applies its change
+// to the other one. The writer then publishes it by flipping the active copy,
+// waits for the readers that might still be in the old copy, and applies the
+// same change to it. A grow only ever happens to the copy that no reader can
+// see, so the block is deallocated without any deferred reclamation.
+//
+// Readers register once per thread to get a slot of their own, and wrap
+// their lookups in `hashmap_concurrent_read_begin`/`_end`. A thread that
+// stops reading unregisters, so its slot can be taken by another one. Pointers into the
+// hashmap are only valid until `_end`, so use `hashmap_concurrent_get` to copy
+// the value out.
+//
+// Requires POSIX threads and the GCC/Clang `__atomic` builtins.
+
+#include <pthread.h>
+
+#include "hashmap.h"
+
+/// The maximum number of reader threads.
+#ifndef HASHMAP_CONCURRENT_MAX_READERS
+#define HASHMAP_CONCURRENT_MAX_READERS 64
+#endif
+
+#ifndef HASHMAP_CACHE_LINE
+#define HASHMAP_CACHE_LINE 64
+#endif
+
+/// The slot of a reader thread, padded to a cache line so the
+/// readers don't bounce each other's lines.
+typedef struct ConcurrentHashMapReader {
+    /// Odd while the reader is looking in the hashmap.
+    size_t sequence;
+    /// 1 while a thread has the slot registered.
+    int    owned;
+    u8     padding[HASHMAP_CACHE_LINE - sizeof(size_t) - sizeof(int)];
+} ConcurrentHashMapReader;
+
+/// The readers come first, so they start on a cache line of
+/// their own, as the struct is allocated to be aligned to one.
+/// Nothing the writers touch shares a line with them.
+typedef struct ConcurrentHashMap {
+    ConcurrentHashMapReader readers[HASHMAP_CONCURRENT_MAX_READERS];
+
+    Allocator* allocator;
+
+    /// The allocation, which is a cache line larger than the
+    /// struct so it can be aligned.
+    void* block;
+
+    /// The two copies, of which `maps[active]` is the
+    /// one that is read from.
+    HashMap* maps[2];
+    int      active;
+
+    /// Serializes the writers.
+    pthread_mutex_t lock;
+
+    /// One past the highest slot that was ever registered, so
+    /// the writers only wait on the slots that may be in use.
+    int reader_count;
+} ConcurrentHashMap;
+
+ConcurrentHashMap* hashmap_concurrent_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options);
+void               hashmap_concurrent_free(ConcurrentHashMap** map);
+size_t             hashmap_concurrent_count(ConcurrentHashMap* map);
+
+// Returns the id of the slot for the calling thread, to be passed
+// to the read functions, or -1 if all slots are taken.
+int                hashmap_concurrent_register_reader(ConcurrentHashMap* map);
+
+// Returns the slot to the map. The reader must not be between
+// `hashmap_concurrent_read_begin` and `_end`, nor use the id afterwards.
+void               hashmap_concurrent_unregister_reader(ConcurrentHashMap* map, int reader);
+
+// Returns the copy of the hashmap to read from until the next call to
+// `hashmap_concurrent_read_end`. It must not be modified.
+const HashMap*     hashmap_concurrent_read_begin(ConcurrentHashMap* map, int reader);
+void               hashmap_concurrent_read_end(ConcurrentHashMap* map, int reader);
+
+// Copies the value of the key into `value` and returns 1, or
+// returns 0 if the hashmap doesn't contain the key.
+int                hashmap_concurrent_get(ConcurrentHashMap* map, int reader, const void* key, void* value, hash_function hash_key, compare_function compare_key);
+
+// Same as `hashmap_set` and `hashmap_del`, but takes the writer lock.
+// `hashmap_concurrent_del` returns 1 if the key was deleted. A key that
+// can't be added to both copies is added to neither, and
+// `hashmap_concurrent_set` returns 0 for it.
+int                hashmap_concurrent_set(ConcurrentHashMap* map, const void* key, const void* value, hash_function hash_key, compare_function compare_key);
+int                hashmap_concurrent_del(ConcurrentHashMap* map, const void* key, hash_function hash_key, compare_function compare_key);
+
+#endif  // TKB_INCLUDE_MAP_CONCURRENT_H
+
+
+#if defined(TKB_MAP_IMPLEMENTATION) && !defined(TKB_MAP_CONCURRENT_IMPLEMENTED)
+#define TKB_MAP_CONCURRENT_IMPLEMENTED
+
+#include <sched.h>
+
+ConcurrentHashMap* hashmap_concurrent_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options) {
+    void* block = allocate(allocator, sizeof(ConcurrentHashMap) + HASHMAP_CACHE_LINE);
+    if (block == NULL)
+        return NULL;
+
+    ConcurrentHashMap* map = (ConcurrentHashMap*)(((size_t)block + HASHMAP_CACHE_LINE - 1) & ~(size_t)(HASHMAP_CACHE_LINE - 1));
+    memset(map, 0, sizeof(ConcurrentHashMap));
+    map->allocator = allocator;
+    map->block     = block;
+    map->maps[0]   = hashmap_new_with_options(allocator, capacity, load_factor, key_stride, value_stride, options);
+    map->maps[1]   = hashmap_new_with_options(allocator, capacity, load_factor, key_stride, value_stride, options);
+    if (map->maps[0] == NULL || map->maps[1] == NULL || pthread_mutex_init(&map->lock, NULL) != 0) {
+        if (map->maps[0] != NULL) hashmap_free(&map->maps[0]);
+        if (map->maps[1] != NULL) hashmap_free(&map->maps[1]);
+        deallocate(allocator, block, sizeof(ConcurrentHashMap) + HASHMAP_CACHE_LINE);
+        return NULL;
+    }
+    return map;
+}
+
+void hashmap_concurrent_free(ConcurrentHashMap** map) {
+    ConcurrentHashMap* concurrent = *map;
+    pthread_mutex_destroy(&concurrent->lock);
+    hashmap_free(&concurrent->maps[0]);
+    hashmap_free(&concurrent->maps[1]);
+    deallocate(concurrent->allocator, concurrent->block, sizeof(ConcurrentHashMap) + HASHMAP_CACHE_LINE);
+    *map = NULL;
+}
+
+size_t hashmap_concurrent_count(ConcurrentHashMap* map) {
+    pthread_mutex_lock(&map->lock);
+    size_t count = hashmap_count(map->maps[map->active]);
+    pthread_mutex_unlock(&map->lock);
+    return count;
+}
+
+int hashmap_concurrent_register_reader(ConcurrentHashMap* map) {
+    for (int reader = 0; reader < HASHMAP_CONCURRENT_MAX_READERS; ++reader) {
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&map->readers[reader].owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        // The writers have to see the slot before its first read begins.
+        int count = __atomic_load_n(&map->reader_count, __ATOMIC_RELAXED);
+        while (count <= reader && !__atomic_compare_exchange_n(&map->reader_count, &count, reader + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+        return reader;
+    }
+    return -1;
+}
+
+void hashmap_concurrent_unregister_reader(ConcurrentHashMap* map, int reader) {
+    __atomic_store_n(&map->readers[reader].owned, 0, __ATOMIC_RELEASE);
+}
+
+const HashMap* hashmap_concurrent_read_begin(ConcurrentHashMap* map, int reader) {
+    // The sequence has to be odd before the active copy is read,
+    // so a writer that flips the copy afterwards waits for us.
+    __atomic_fetch_add(&map->readers[reader].sequence, 1, __ATOMIC_SEQ_CST);
+    int active = __atomic_load_n(&map->active, __ATOMIC_SEQ_CST);
+    return map->maps[active];
+}
+
+void hashmap_concurrent_read_end(ConcurrentHashMap* map, int reader) {
+    __atomic_fetch_add(&map->readers[reader].sequence, 1, __ATOMIC_RELEASE);
+}
+
+int hashmap_concurrent_get(ConcurrentHashMap* map, int reader, const void* key, void* value, hash_function hash_key, compare_function compare_key) {
+    const HashMap* snapshot = hashmap_concurrent_read_begin(map, reader);
+    const void*    existing = hashmap_get(snapshot, key, hash_key, compare_key);
+    if (existing != NULL)
+        memcpy(value, existing, hashmap_header(snapshot)->value_stride);
+    hashmap_concurrent_read_end(map, reader);
+    return existing != NULL;
+}
+
+/// Makes the standby copy the active one, and waits until no reader
+/// can be looking in the previously active copy.
+static void hashmap_concurrent_flip(ConcurrentHashMap* map) {
+    __atomic_store_n(&map->active, !map->active, __ATOMIC_SEQ_CST);
+
+    int readers = __atomic_load_n(&map->reader_count, __ATOMIC_SEQ_CST);
+    if (readers > HASHMAP_CONCURRENT_MAX_READERS)
+        readers = HASHMAP_CONCURRENT_MAX_READERS;
+
+    // A reader with an even sequence will see the new active
+    // copy when it begins. One with an odd sequence may have
+    // seen the old one, so wait until it has moved on.
+    for (int i = 0; i < readers; ++i) {
+        size_t sequence = __atomic_load_n(&map->readers[i].sequence, __ATOMIC_SEQ_CST);
+        if ((sequence & 1) == 0)
+            continue;
+        while (__atomic_load_n(&map->readers[i].sequence, __ATOMIC_ACQUIRE) == sequence)
+            sched_yield();
+    }
+}
+
+/// Grows the copy, which no reader may be looking in, if a new key
+/// wouldn't fit, so the set can't fail to grow halfway through.
+/// Returns 0 if it couldn't grow, in which case it's left as it was.
+static int hashmap_concurrent_reserve(HashMap** copy, hash_function hash_key, compare_function compare_key) {
+    const HashMapHeader* header = hashmap_header(*copy);
+    if (header->count < header->capacity)
+        return 1;
+    return hashmap_reserve(copy, hashmap_grow_capacity(header->capacity, header->grow_factor), hash_key, compare_key);
+}
+
+int hashmap_concurrent_set(ConcurrentHashMap* map, const void* key, const void* value, hash_function hash_key, compare_function compare_key) {
+    pthread_mutex_lock(&map->lock);
+
+    int    standby = !map->active;
+    size_t hash    = hash_key(key, hashmap_header(map->maps[standby])->key_stride);
+
+    // Only the standby copy can grow, so the other one makes room after
+    // the flip. A new key that doesn't fit there, or whose string can't
+    // be copied with OWNED_KEYS, is deleted from the first copy again
+    // after flipping back, so both copies always hold the same keys.
+    int added = -1;
+    if (hashmap_concurrent_reserve(&map->maps[standby], hash_key, compare_key))
+        added = hashmap_set_hashed(&map->maps[standby], key, value, hash, hash_key, compare_key);
+    if (added == 0 && (hashmap_header(map->maps[standby])->options & HASHMAP_OPTION_OWNED_KEYS) &&
+        hashmap_get_hashed(map->maps[standby], key, hash, compare_key) == NULL)
+        added = -1;
+
+    if (added == 0) {
+        // Replacing a value never allocates.
+        hashmap_concurrent_flip(map);
+        hashmap_set_hashed(&map->maps[!standby], key, value, hash, hash_key, compare_key);
+    } else if (added == 1) {
+        hashmap_concurrent_flip(map);
+        if (!hashmap_concurrent_reserve(&map->maps[!standby], hash_key, compare_key) ||
+            hashmap_set_hashed(&map->maps[!standby], key, value, hash, hash_key, compare_key) != 1) {
+            hashmap_concurrent_flip(map);
+            hashmap_del_hashed(&map->maps[standby], key, hash, hash_key, compare_key);
+            added = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&map->lock);
+    return added == 1;
+}
+
+int hashmap_concurrent_del(ConcurrentHashMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
+    pthread_mutex_lock(&map->lock);
+
+    int    standby = !map->active;
+    size_t hash    = hash_key(key, hashmap_header(map->maps[standby])->key_stride);
+
+    // Deleting never allocates, so the other copy, which holds the
+    // same keys, deletes the key as well.
+    int result = hashmap_del_hashed(&map->maps[standby], key, hash, hash_key, compare_key) != NULL;
+    if (result) {
+        hashmap_concurrent_flip(map);
+        hashmap_del_hashed(&map->maps[!standby], key, hash, hash_key, compare_key);
+    }
+
+    pthread_mutex_unlock(&map->lock);
+    return result;
+}
+
+#endif  // TKB_MAP_IMPLEMENTATION
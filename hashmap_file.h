@@ -0,0 +1,318 @@
+#ifndef TKB_INCLUDE_MAP_FILE_H
+#define TKB_INCLUDE_MAP_FILE_H
+
+// Saves a hashmap to a file that can be mapped back into memory and used
+// as a read-only hashmap, without parsing or rebuilding anything.
+//
+// The file is a small versioned header followed by the block of the hashmap,
+// laid out exactly as in memory, and a pool with the strings of the keys.
+// Keys that are strings are saved with their pointer replaced by the offset
+// from the key to its string in the pool. The offset is relative to the key
+// itself, so it stays valid wherever the file is mapped. Lookups on an opened
+// map use `compare_string_saved` or `compare_string_key_saved` instead of
+// `compare_string` and `compare_string_key`, with the same hash function as
+// when the map was filled.
+//
+// The file is in the byte order and the `HashMapHeader` layout of the
+// machine that saved it; opening it anywhere else fails on the version
+// and header size checks. Values are saved as they are, so they must not
+// hold pointers.
+//
+// Requires POSIX mmap.
+
+#include <stddef.h>
+
+#include "hashmap.h"
+
+#define HASHMAP_FILE_VERSION 1
+
+/// How the keys of the hashmap are saved.
+typedef enum HashMapFileKeys {
+    /// The keys are saved as they are, e.g. integers or structs
+    /// without pointers.
+    HASHMAP_FILE_KEYS_BYTES      = 0,
+
+    /// The keys are `const char*` to NUL-terminated strings,
+    /// as used with `hash_string`.
+    HASHMAP_FILE_KEYS_STRING     = 1,
+
+    /// The keys are `StringKey`.
+    HASHMAP_FILE_KEYS_STRING_KEY = 2,
+} HashMapFileKeys;
+
+typedef struct HashMapFileHeader {
+    char magic[8];
+    u32  version;
+
+    /// The `HashMapFileKeys` the keys were saved with.
+    u16  keys;
+
+    /// `sizeof(HashMapHeader)` when saved, which changes with
+    /// TKB_MAP_STATS and the width of `size_t`.
+    u16  header_size;
+
+    /// The size of the block, from the `HashMapHeader` to the
+    /// end of the control bytes, and of the string pool after it.
+    u64  block_size;
+    u64  pool_size;
+
+    /// `hashmap_hash_bytes` of everything after this header.
+    u64  checksum;
+} HashMapFileHeader;
+
+// Writes the hashmap to `path` and returns 1, or returns 0 if the file
+// couldn't be written or the key stride doesn't match `keys`. A hashmap
+// that is still migrating an incremental grow finishes it first, which
+// is why `hash_key` is needed.
+int            hashmap_save(HashMap* map, const char* path, HashMapFileKeys keys, hash_function hash_key);
+
+// Maps the file at `path` and returns it as a hashmap, or NULL if it's
+// not a valid file for this build. With `verify`, the checksum is checked
+// too, which reads the whole file. The hashmap must not be modified, and
+// must be closed with `hashmap_close_mmap` instead of `hashmap_free`.
+const HashMap* hashmap_open_mmap(const char* path, int verify);
+void           hashmap_close_mmap(const HashMap** map);
+
+// Returns the string of a key saved with `HASHMAP_FILE_KEYS_STRING`, or
+// `HASHMAP_FILE_KEYS_STRING_KEY`, e.g. from `hashmap_key_at`.
+static inline const char* hashmap_saved_string(const void* key) {
+    ptrdiff_t offset;
+    memcpy(&offset, key, sizeof(offset));
+    return (const char*)key + offset;
+}
+
+// Compares a `const char*` or `StringKey` with a key of an opened map.
+static inline int compare_string_saved(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    return strcmp(*(const char**)key, hashmap_saved_string(candidate)) != 0;
+}
+
+static inline int compare_string_key_saved(const void* key, const void* candidate, size_t stride) {
+    (void)stride;
+    const StringKey* a = (const StringKey*)key;
+    const StringKey* b = (const StringKey*)candidate;
+    if (a->length != b->length || a->hash != b->hash)
+        return 1;
+    return memcmp(a->data, hashmap_saved_string(candidate), a->length) != 0;
+}
+
+#endif  // TKB_INCLUDE_MAP_FILE_H
+
+
+#if defined(TKB_MAP_IMPLEMENTATION) && !defined(TKB_MAP_FILE_IMPLEMENTED)
+#define TKB_MAP_FILE_IMPLEMENTED
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char HASHMAP_FILE_MAGIC[8] = "TKBHMAP";
+
+typedef struct HashMapFileWriter {
+    FILE*  file;
+    size_t offset;
+    int    failed;
+} HashMapFileWriter;
+
+static inline void hashmap_file_write(HashMapFileWriter* writer, const void* data, size_t size) {
+    if (!writer->failed && fwrite(data, 1, size, writer->file) != size)
+        writer->failed = 1;
+    writer->offset += size;
+}
+
+/// Writes zeros up to the file offset, which is where the
+/// next array of the block starts.
+static void hashmap_file_pad(HashMapFileWriter* writer, size_t offset) {
+    static const u8 zeros[256] = { 0 };
+    while (writer->offset < offset) {
+        size_t size = offset - writer->offset;
+        hashmap_file_write(writer, zeros, (size < sizeof(zeros)) ? size : sizeof(zeros));
+    }
+}
+
+/// Returns the string of the key, and its length without the NUL.
+static inline const char* hashmap_file_string_of(const u8* key, HashMapFileKeys keys, size_t* length) {
+    if (keys == HASHMAP_FILE_KEYS_STRING) {
+        const char* data = *(const char* const*)key;
+        *length = strlen(data);
+        return data;
+    }
+    const StringKey* string = (const StringKey*)key;
+    *length = string->length;
+    return string->data;
+}
+
+/// Writes the keys with their strings replaced by the offset to where
+/// they will be in the pool. Returns the size of the pool.
+static size_t hashmap_file_write_keys(HashMapFileWriter* writer, const HashMapHeader* header, HashMapFileKeys keys, size_t pool_offset) {
+    size_t key_stride = header->key_stride;
+    size_t pool_size  = 0;
+    u8     key[sizeof(StringKey)];
+
+    for (size_t slot = 0; slot < header->count; ++slot) {
+        const u8* source = hashmap_slot_key(header, slot);
+        if (keys == HASHMAP_FILE_KEYS_BYTES) {
+            hashmap_file_write(writer, source, key_stride);
+            continue;
+        }
+
+        size_t length;
+        hashmap_file_string_of(source, keys, &length);
+        ptrdiff_t offset = (ptrdiff_t)(pool_offset + pool_size) - (ptrdiff_t)writer->offset;
+
+        memcpy(key, source, key_stride);
+        memcpy(key, &offset, sizeof(offset));
+        hashmap_file_write(writer, key, key_stride);
+        pool_size += length + 1;
+    }
+    return pool_size;
+}
+
+static void hashmap_file_write_pool(HashMapFileWriter* writer, const HashMapHeader* header, HashMapFileKeys keys) {
+    for (size_t slot = 0; slot < header->count; ++slot) {
+        size_t      length;
+        const char* data = hashmap_file_string_of(hashmap_slot_key(header, slot), keys, &length);
+        hashmap_file_write(writer, data, length);
+        hashmap_file_write(writer, "", 1);
+    }
+}
+
+int hashmap_save(HashMap* map, const char* path, HashMapFileKeys keys, hash_function hash_key) {
+    HashMapHeader* header = hashmap_header(map);
+    if ((keys == HASHMAP_FILE_KEYS_STRING     && header->key_stride != sizeof(const char*)) ||
+        (keys == HASHMAP_FILE_KEYS_STRING_KEY && header->key_stride != sizeof(StringKey)))
+        return 0;
+
+    if (header->previous != NULL)
+        hashmap_migrate(header, header->previous->index_capacity, hash_key);
+
+    // The saved block is always dense and not interleaved, with
+    // the entries of the chunks copied in after the indices.
+    HashMapHeader saved = *header;
+    saved.allocator   = NULL;
+    saved.chunks      = NULL;
+    saved.strings     = NULL;
+    saved.filter      = NULL;
+    saved.filter_mask = 0;
+    saved.options     = (u16)(header->options & ~(HASHMAP_OPTION_STABLE | HASHMAP_OPTION_OWNED_KEYS | HASHMAP_OPTION_FILTER | HASHMAP_OPTION_INTERLEAVED));
+    HASHMAP_STATS_BLOCK(memset(&saved.stats, 0, sizeof(saved.stats));)
+
+    size_t capacity     = saved.capacity;
+    size_t block_size   = hashmap_header_total_size(&saved);
+    size_t block_offset = sizeof(HashMapFileHeader);
+    size_t indices      = block_offset + sizeof(HashMapHeader);
+    size_t pool_offset  = block_offset + block_size;
+
+    FILE* file = fopen(path, "w+b");
+    if (file == NULL)
+        return 0;
+
+    HashMapFileWriter writer = { file, 0, 0 };
+    HashMapFileHeader file_header = {
+        .version     = HASHMAP_FILE_VERSION,
+        .keys        = (u16)keys,
+        .header_size = (u16)sizeof(HashMapHeader),
+        .block_size  = block_size,
+    };
+    memcpy(file_header.magic, HASHMAP_FILE_MAGIC, sizeof(file_header.magic));
+
+    hashmap_file_write(&writer, &file_header, sizeof(file_header));
+    hashmap_file_write(&writer, &saved, sizeof(saved));
+    hashmap_file_write(&writer, hashmap_indices_of(header), saved.index_capacity * saved.index_stride);
+
+    hashmap_file_pad(&writer, indices + hashmap_keys_offset(saved.index_capacity, saved.index_stride));
+    size_t pool_size = hashmap_file_write_keys(&writer, header, keys, pool_offset);
+
+    hashmap_file_pad(&writer, indices + hashmap_values_offset(capacity, saved.index_capacity, saved.index_stride, saved.key_stride, saved.value_stride, saved.options));
+    for (size_t slot = 0; slot < header->count; ++slot)
+        hashmap_file_write(&writer, hashmap_slot_value(header, slot), saved.value_stride);
+
+    hashmap_file_pad(&writer, indices + hashmap_hashes_offset(capacity, saved.index_capacity, saved.index_stride, saved.key_stride, saved.value_stride, saved.options));
+    if (saved.options & HASHMAP_OPTION_STORE_HASH) {
+        for (size_t slot = 0; slot < header->count; ++slot)
+            hashmap_file_write(&writer, hashmap_slot_hash(header, slot), sizeof(size_t));
+    }
+
+    hashmap_file_pad(&writer, indices + hashmap_control_offset(capacity, saved.index_capacity, saved.index_stride, saved.key_stride, saved.value_stride, saved.options));
+    if (saved.options & HASHMAP_OPTION_GROUPS)
+        hashmap_file_write(&writer, hashmap_control_of(header), saved.index_capacity + HASHMAP_GROUP_WIDTH);
+
+    hashmap_file_pad(&writer, pool_offset);
+    if (keys != HASHMAP_FILE_KEYS_BYTES)
+        hashmap_file_write_pool(&writer, header, keys);
+
+    // The checksum is computed over the written file, so it's
+    // the same as when the file is opened.
+    if (!writer.failed && fflush(file) == 0) {
+        u8* data = mmap(NULL, writer.offset, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (data != MAP_FAILED) {
+            file_header.pool_size = pool_size;
+            file_header.checksum  = hashmap_hash_bytes(data + block_offset, writer.offset - block_offset, HASHMAP_FILE_VERSION);
+            munmap(data, writer.offset);
+
+            rewind(file);
+            writer.offset = 0;
+            hashmap_file_write(&writer, &file_header, sizeof(file_header));
+        } else {
+            writer.failed = 1;
+        }
+    }
+
+    if (fclose(file) != 0)
+        writer.failed = 1;
+    return !writer.failed;
+}
+
+const HashMap* hashmap_open_mmap(const char* path, int verify) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0)
+        return NULL;
+
+    struct stat info;
+    if (fstat(descriptor, &info) != 0 || (size_t)info.st_size < sizeof(HashMapFileHeader) + sizeof(HashMapHeader)) {
+        close(descriptor);
+        return NULL;
+    }
+
+    // The stats are counted in the header on every lookup,
+    // so the pages need to be writable (and private) then.
+    size_t size = (size_t)info.st_size;
+    int    prot = HASHMAP_STATS_ENABLED ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    u8*    data = mmap(NULL, size, prot, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    const HashMapFileHeader* file_header = (const HashMapFileHeader*)data;
+    const HashMapHeader*     header      = (const HashMapHeader*)(file_header + 1);
+
+    int valid =
+        memcmp(file_header->magic, HASHMAP_FILE_MAGIC, sizeof(file_header->magic)) == 0 &&
+        file_header->version     == HASHMAP_FILE_VERSION &&
+        file_header->header_size == sizeof(HashMapHeader) &&
+        file_header->block_size  >= sizeof(HashMapHeader) &&
+        sizeof(HashMapFileHeader) + file_header->block_size + file_header->pool_size == size &&
+        hashmap_header_total_size(header) == file_header->block_size &&
+        header->count <= header->capacity &&
+        !(header->options & HASHMAP_OPTION_STABLE);
+
+    if (valid && verify)
+        valid = hashmap_hash_bytes(data + sizeof(HashMapFileHeader), size - sizeof(HashMapFileHeader), HASHMAP_FILE_VERSION) == file_header->checksum;
+
+    if (!valid) {
+        munmap(data, size);
+        return NULL;
+    }
+    return (const HashMap*)(header + 1);
+}
+
+void hashmap_close_mmap(const HashMap** map) {
+    const HashMapFileHeader* file_header = (const HashMapFileHeader*)hashmap_header(*map) - 1;
+    size_t size = sizeof(HashMapFileHeader) + file_header->block_size + file_header->pool_size;
+    munmap((void*)file_header, size);
+    *map = NULL;
+}
+
+#endif  // TKB_MAP_IMPLEMENTATION
@@ -0,0 +1,255 @@
+#ifndef TKB_INCLUDE_MAP_MULTI_H
+#define TKB_INCLUDE_MAP_MULTI_H
+
+// A hashmap that holds any number of values for each key.
+//
+// The distinct keys are kept in a regular hashmap, whose value is the
+// chain of entries of the key. The entries are dense in an array of their
+// own, each holding its value and the position of the next entry of the
+// same key, so the values of a key are found by following the chain
+// through the array, in the order they were added.
+//
+// Deleting a key puts its whole chain on a free list in one step, and the
+// following adds reuse those entries before the array grows. Positions of
+// entries stay the same until they're deleted.
+
+#include "hashmap.h"
+
+/// The position after the last entry of a chain.
+#define HASHMAP_MULTI_END ((size_t)-1)
+
+/// The value of a key in `MultiMap.keys`.
+typedef struct MultiMapChain {
+    size_t first;
+    size_t last;
+    size_t count;
+} MultiMapChain;
+
+typedef struct MultiMap {
+    Allocator* allocator;
+
+    /// The distinct keys, with a MultiMapChain as value.
+    HashMap* keys;
+
+    /// The entries, each the position of the next entry
+    /// of the same key followed by the value.
+    u8*    entries;
+    size_t entry_stride;
+    size_t value_stride;
+
+    /// The number of values in the multimap.
+    size_t count;
+
+    /// How many entries have ever been used, and how many
+    /// there is room for.
+    size_t used;
+    size_t capacity;
+
+    /// The first entry of the free list, or HASHMAP_MULTI_END.
+    size_t free;
+} MultiMap;
+
+MultiMap* hashmap_multi_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options);
+void      hashmap_multi_free(MultiMap** map);
+size_t    hashmap_multi_count(const MultiMap* map);
+size_t    hashmap_multi_key_count(const MultiMap* map);
+
+// Adds the value to the values of the key. Returns 0 if
+// the entries or the key couldn't be allocated.
+int       hashmap_multi_add(MultiMap* map, const void* key, const void* value, hash_function hash_key, compare_function compare_key);
+
+// Returns the first entry of the key, or HASHMAP_MULTI_END if the
+// multimap doesn't contain it. The rest of the values are reached
+// with `hashmap_multi_next`, like
+// `for (size_t e = hashmap_multi_first(...); e != HASHMAP_MULTI_END; e = hashmap_multi_next(map, e))`.
+size_t    hashmap_multi_first(const MultiMap* map, const void* key, hash_function hash_key, compare_function compare_key);
+size_t    hashmap_multi_next(const MultiMap* map, size_t entry);
+void*     hashmap_multi_value(const MultiMap* map, size_t entry);
+
+// Returns the number of values of the key.
+size_t    hashmap_multi_count_of(const MultiMap* map, const void* key, hash_function hash_key, compare_function compare_key);
+
+// Deletes the key and all of its values, and returns how many
+// values were deleted.
+size_t    hashmap_multi_del(MultiMap* map, const void* key, hash_function hash_key, compare_function compare_key);
+
+#endif  // TKB_INCLUDE_MAP_MULTI_H
+
+
+#if defined(TKB_MAP_IMPLEMENTATION) && !defined(TKB_MAP_MULTI_IMPLEMENTED)
+#define TKB_MAP_MULTI_IMPLEMENTED
+
+static inline size_t* hashmap_multi_link(const MultiMap* map, size_t entry) {
+    return (size_t*)(map->entries + entry * map->entry_stride);
+}
+
+MultiMap* hashmap_multi_new(Allocator* allocator, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options) {
+    if (capacity == 0)
+        return NULL;
+
+    MultiMap* map = allocate(allocator, sizeof(MultiMap));
+    if (map == NULL)
+        return NULL;
+
+    *map = (MultiMap) {
+        .allocator    = allocator,
+        .keys         = hashmap_new_with_options(allocator, capacity, load_factor, key_stride, sizeof(MultiMapChain), options),
+        .entries      = NULL,
+        .entry_stride = hashmap_align(sizeof(size_t) + value_stride),
+        .value_stride = value_stride,
+        .count        = 0,
+        .used         = 0,
+        .capacity     = capacity,
+        .free         = HASHMAP_MULTI_END,
+    };
+    if (map->keys != NULL)
+        map->entries = allocate(allocator, capacity * map->entry_stride);
+
+    if (map->keys == NULL || map->entries == NULL) {
+        if (map->keys != NULL)
+            hashmap_free(&map->keys);
+        deallocate(allocator, map, sizeof(MultiMap));
+        return NULL;
+    }
+    return map;
+}
+
+void hashmap_multi_free(MultiMap** map) {
+    MultiMap* multi = *map;
+    hashmap_free(&multi->keys);
+    deallocate(multi->allocator, multi->entries, multi->capacity * multi->entry_stride);
+    deallocate(multi->allocator, multi, sizeof(MultiMap));
+    *map = NULL;
+}
+
+size_t hashmap_multi_count(const MultiMap* map) {
+    return map->count;
+}
+
+size_t hashmap_multi_key_count(const MultiMap* map) {
+    return hashmap_count(map->keys);
+}
+
+/// Takes an entry from the free list, or from the end of the entries,
+/// growing them by the grow factor of the keys if they're full.
+/// Returns HASHMAP_MULTI_END if they couldn't be grown.
+static size_t hashmap_multi_take(MultiMap* map) {
+    size_t entry = map->free;
+    if (entry != HASHMAP_MULTI_END) {
+        map->free = *hashmap_multi_link(map, entry);
+        return entry;
+    }
+
+    if (map->used == map->capacity) {
+        float  grow     = hashmap_header(map->keys)->grow_factor / 100.0f;
+        size_t capacity = map->capacity + (size_t)((float)map->capacity * grow);
+        if (capacity <= map->capacity)
+            capacity = map->capacity + 1;
+
+        u8* entries = reallocate(map->allocator, capacity * map->entry_stride, map->entries, map->capacity * map->entry_stride);
+        if (entries == NULL)
+            return HASHMAP_MULTI_END;
+        map->entries  = entries;
+        map->capacity = capacity;
+    }
+    return map->used++;
+}
+
+int hashmap_multi_add(MultiMap* map, const void* key, const void* value, hash_function hash_key, compare_function compare_key) {
+    size_t entry = hashmap_multi_take(map);
+    if (entry == HASHMAP_MULTI_END)
+        return 0;
+
+    *hashmap_multi_link(map, entry) = HASHMAP_MULTI_END;
+    memcpy(hashmap_multi_value(map, entry), value, map->value_stride);
+
+    MultiMapChain* chain = hashmap_get(map->keys, key, hash_key, compare_key);
+    if (chain != NULL) {
+        *hashmap_multi_link(map, chain->last) = entry;
+        chain->last   = entry;
+        chain->count += 1;
+    } else {
+        MultiMapChain added = { .first = entry, .last = entry, .count = 1 };
+        if (!hashmap_set(&map->keys, key, &added, hash_key, compare_key)) {
+            *hashmap_multi_link(map, entry) = map->free;
+            map->free = entry;
+            return 0;
+        }
+    }
+
+    map->count += 1;
+    return 1;
+}
+
+size_t hashmap_multi_first(const MultiMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
+    const MultiMapChain* chain = hashmap_get(map->keys, key, hash_key, compare_key);
+    return (chain != NULL) ? chain->first : HASHMAP_MULTI_END;
+}
+
+size_t hashmap_multi_next(const MultiMap* map, size_t entry) {
+    return *hashmap_multi_link(map, entry);
+}
+
+void* hashmap_multi_value(const MultiMap* map, size_t entry) {
+    return map->entries + entry * map->entry_stride + sizeof(size_t);
+}
+
+size_t hashmap_multi_count_of(const MultiMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
+    const MultiMapChain* chain = hashmap_get(map->keys, key, hash_key, compare_key);
+    return (chain != NULL) ? chain->count : 0;
+}
+
+size_t hashmap_multi_del(MultiMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
+    const MultiMapChain* chain = hashmap_del(&map->keys, key, hash_key, compare_key);
+    if (chain == NULL)
+        return 0;
+
+    // The chain ends at its last entry, so the whole chain
+    // can be put in front of the free list.
+    *hashmap_multi_link(map, chain->last) = map->free;
+    map->free   = chain->first;
+    map->count -= chain->count;
+    return chain->count;
+}
+
+#endif  // TKB_MAP_IMPLEMENTATION
+
+
+#define MULTIMAP_DEFINE_H(Class, prefix, KEY, VALUE)                                                                                 \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t capacity);                                                      \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t capacity, float factor, HashMapOptions options);   \
+    static inline size_t  prefix##_count(const Class* map);                                                                         \
+    static inline size_t  prefix##_key_count(const Class* map);                                                                     \
+    static inline KEY*    prefix##_key_at(const Class* map, size_t i);                                                              \
+    static inline size_t  prefix##_first_at(const Class* map, size_t i);                                                            \
+    static inline int     prefix##_add(Class* map, KEY key, VALUE value);                                                           \
+    static inline size_t  prefix##_first(const Class* map, KEY key);                                                                \
+    static inline size_t  prefix##_next(const Class* map, size_t entry);                                                            \
+    static inline VALUE*  prefix##_value(const Class* map, size_t entry);                                                           \
+    static inline size_t  prefix##_count_of(const Class* map, KEY key);                                                             \
+    static inline size_t  prefix##_del(Class* map, KEY key);                                                                        \
+    static inline void    prefix##_free(Class** map);                                                                               \
+
+
+/// Like MAP_DEFINE_C_WITH, but for a multimap, e.g.
+/// `MULTIMAP_DEFINE_C_WITH(Groups, groups, u64, int, hash_u64, compare_u64)`.
+/// `_key_at` and `_first_at` go through the distinct keys, to visit every
+/// group once.
+#define MULTIMAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                             \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t capacity)                                                       { return (Class*) hashmap_multi_new(allocator, capacity, HASHMAP_DEFAULT_LOAD_FACTOR, sizeof(KEY), sizeof(VALUE), HASHMAP_OPTION_NONE);  }  \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t capacity, float factor, HashMapOptions options)    { return (Class*) hashmap_multi_new(allocator, capacity, factor, sizeof(KEY), sizeof(VALUE), options);  }                   \
+    static inline size_t  prefix##_count(const Class* map)                                                                          { return hashmap_multi_count((const MultiMap*)map);  }                                                          \
+    static inline size_t  prefix##_key_count(const Class* map)                                                                      { return hashmap_multi_key_count((const MultiMap*)map);  }                                                      \
+    static inline KEY*    prefix##_key_at(const Class* map, size_t i)                                                               { return (KEY*) hashmap_key_at(((const MultiMap*)map)->keys, i);  }                                             \
+    static inline size_t  prefix##_first_at(const Class* map, size_t i)                                                             { return ((const MultiMapChain*)hashmap_value_at(((const MultiMap*)map)->keys, i))->first;  }                  \
+    static inline int     prefix##_add(Class* map, KEY key, VALUE value)                                                            { return hashmap_multi_add((MultiMap*)map, (const void*)&key, (const void*)&value, HASH, COMPARE);  }           \
+    static inline size_t  prefix##_first(const Class* map, KEY key)                                                                 { return hashmap_multi_first((const MultiMap*)map, (const void*)&key, HASH, COMPARE);  }                        \
+    static inline size_t  prefix##_next(const Class* map, size_t entry)                                                             { return hashmap_multi_next((const MultiMap*)map, entry);  }                                                   \
+    static inline VALUE*  prefix##_value(const Class* map, size_t entry)                                                            { return (VALUE*) hashmap_multi_value((const MultiMap*)map, entry);  }                                         \
+    static inline size_t  prefix##_count_of(const Class* map, KEY key)                                                              { return hashmap_multi_count_of((const MultiMap*)map, (const void*)&key, HASH, COMPARE);  }                     \
+    static inline size_t  prefix##_del(Class* map, KEY key)                                                                         { return hashmap_multi_del((MultiMap*)map, (const void*)&key, HASH, COMPARE);  }                                \
+    static inline void    prefix##_free(Class** map)                                                                                { hashmap_multi_free((MultiMap**)map);  }                                                                      \
+
+
+#define MULTIMAP_DEFINE_C(Class, prefix, KEY, VALUE)                                                                                 \
+    MULTIMAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION)
@@ -0,0 +1,91 @@
+#ifndef TKB_INCLUDE_MAP_PERFECT_H
+#define TKB_INCLUDE_MAP_PERFECT_H
+
+// A read-only hashmap over a fixed set of keys, with a perfect hash.
+//
+// The tables are generated ahead of time by `map_perfect` (perfect.c) from
+// a list of keys and values, and compiled in as `static const` arrays, so
+// nothing is allocated and they're shared by forked processes. There's one
+// slot for every key. Each key is hashed into a bucket, and the bucket has
+// a seed that was searched for when generating, which puts every key of
+// the bucket into a slot of its own (hash and displace). A lookup reads
+// the seed and compares the key in its slot, and that's all.
+//
+// The hash of the key has to be the same when generating as when looking
+// up, so the generated tables are only valid for the same `size_t` width.
+
+#include "hashmap.h"
+
+typedef struct PerfectMap {
+    /// The number of keys and values, which is also
+    /// the number of slots.
+    size_t count;
+
+    /// The number of seeds.
+    size_t bucket_count;
+
+    const u32*  seeds;
+    const void* keys;
+    const void* values;
+} PerfectMap;
+
+#endif  // TKB_INCLUDE_MAP_PERFECT_H
+
+
+#if defined(TKB_MAP_IMPLEMENTATION) && !defined(TKB_MAP_PERFECT_IMPLEMENTED)
+#define TKB_MAP_PERFECT_IMPLEMENTED
+
+/// Maps 32 random bits to [0, count) without a division.
+static inline size_t hashmap_perfect_range(u64 bits, size_t count) {
+    return (size_t)(((bits & 0xFFFFFFFFULL) * (u64)count) >> 32);
+}
+
+/// Picks the bucket from the high bits of the mixed hash, so
+/// it doesn't depend on the same bits as the slot.
+static inline size_t hashmap_perfect_bucket(size_t hash, size_t bucket_count) {
+    u64 mixed = ((u64)hash ^ ((u64)hash >> 32)) * 0xD6E8FEB86659FD93ULL;
+    return hashmap_perfect_range(mixed >> 32, bucket_count);
+}
+
+/// Picks the slot from the hash and the seed of its bucket.
+static inline size_t hashmap_perfect_slot(size_t hash, u32 seed, size_t count) {
+    u64 mixed = (u64)hash ^ ((u64)seed * 0x9E3779B97F4A7C15ULL);
+    mixed ^= mixed >> 31;
+    mixed *= 0xBF58476D1CE4E5B9ULL;
+    mixed ^= mixed >> 29;
+    return hashmap_perfect_range(mixed >> 32, count);
+}
+
+/// Returns the only slot the key can be in.
+static inline size_t hashmap_perfect_find(const PerfectMap* map, size_t hash) {
+    u32 seed = map->seeds[hashmap_perfect_bucket(hash, map->bucket_count)];
+    return hashmap_perfect_slot(hash, seed, map->count);
+}
+
+#endif  // TKB_MAP_IMPLEMENTATION
+
+
+#define PERFECT_MAP_DEFINE_H(Class, prefix, KEY, VALUE)                                                  \
+    static inline size_t        prefix##_count(const Class* map);                                       \
+    static inline const KEY*    prefix##_keys(const Class* map);                                        \
+    static inline const VALUE*  prefix##_values(const Class* map);                                      \
+    static inline const VALUE*  prefix##_get(const Class* map, KEY key);                                \
+
+
+/// Like MAP_DEFINE_C_WITH, but for the tables generated by `map_perfect`,
+/// which emits this line, along with the tables and a `prefix##_map`
+/// pointer to them. HASH has to be the hash the tables were generated
+/// with, and is called directly, so it can be inlined.
+#define PERFECT_MAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, HASH, COMPARE)                              \
+    static inline size_t        prefix##_count(const Class* map)   { return ((const PerfectMap*)map)->count;  }                 \
+    static inline const KEY*    prefix##_keys(const Class* map)    { return (const KEY*)   ((const PerfectMap*)map)->keys;  }   \
+    static inline const VALUE*  prefix##_values(const Class* map)  { return (const VALUE*) ((const PerfectMap*)map)->values; } \
+    static inline const VALUE*  prefix##_get(const Class* map, KEY key) {                                \
+        const PerfectMap* perfect = (const PerfectMap*)map;                                              \
+        size_t            slot    = hashmap_perfect_find(perfect, HASH(&key, sizeof(KEY)));              \
+        const KEY*        keys    = (const KEY*)perfect->keys;                                           \
+        if (COMPARE(&key, &keys[slot], sizeof(KEY)) != 0)                                                \
+            return NULL;                                                                                 \
+        return &((const VALUE*)perfect->values)[slot];                                                   \
+    }                                                                                                    \
+
@@ -0,0 +1,235 @@
+#ifndef TKB_INCLUDE_MAP_SHARDED_H
+#define TKB_INCLUDE_MAP_SHARDED_H
+
+// A hashmap split into independent shards for many writer threads.
+//
+// Each key is routed to a shard by the high bits of its hash, and every
+// shard is a regular hashmap with its own lock. Writers to different shards
+// don't contend, and each shard grows on its own, so a grow only pauses the
+// threads that touch that shard, and only for a fraction of the entries.
+//
+// As a shard may grow as soon as its lock is released, values are copied
+// out instead of returning pointers into the shard.
+//
+// Requires POSIX threads.
+
+#include <pthread.h>
+
+#include "hashmap.h"
+
+#ifndef HASHMAP_CACHE_LINE
+#define HASHMAP_CACHE_LINE 64
+#endif
+
+typedef struct HashMapShard {
+    pthread_mutex_t lock;
+    HashMap*        map;
+} HashMapShard;
+
+/// A shard padded to whole cache lines, so that threads working
+/// on neighbouring shards don't bounce each other's lines.
+typedef union HashMapShardSlot {
+    HashMapShard shard;
+    u8           padding[(sizeof(HashMapShard) + HASHMAP_CACHE_LINE - 1) / HASHMAP_CACHE_LINE * HASHMAP_CACHE_LINE];
+} HashMapShardSlot;
+
+typedef struct ShardedMap {
+    Allocator* allocator;
+
+    /// The allocation, which is a cache line larger than the
+    /// map so it can be aligned.
+    void* block;
+
+    /// The number of shards is `1 << shard_bits`.
+    size_t shard_bits;
+    size_t key_stride;
+    size_t value_stride;
+
+    // Following this header, from the next cache line, is:
+    // shards[1 << shard_bits]
+} ShardedMap;
+
+// Creates `shard_count` shards (rounded up to a power of 2), with the
+// capacity split evenly between them.
+ShardedMap* hashmap_sharded_new(Allocator* allocator, size_t shard_count, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options);
+void        hashmap_sharded_free(ShardedMap** map);
+size_t      hashmap_sharded_count(ShardedMap* map);
+size_t      hashmap_sharded_shard_count(const ShardedMap* map);
+
+// Copies the value of the key into `value` and returns 1, or
+// returns 0 if the hashmap doesn't contain the key.
+int         hashmap_sharded_get(ShardedMap* map, const void* key, void* value, hash_function hash_key, compare_function compare_key);
+
+// Same as `hashmap_set` and `hashmap_del`, but only locks the shard of
+// the key. `hashmap_sharded_del` returns 1 if the key was deleted.
+int         hashmap_sharded_set(ShardedMap* map, const void* key, const void* value, hash_function hash_key, compare_function compare_key);
+int         hashmap_sharded_del(ShardedMap* map, const void* key, hash_function hash_key, compare_function compare_key);
+
+#endif  // TKB_INCLUDE_MAP_SHARDED_H
+
+
+#if defined(TKB_MAP_IMPLEMENTATION) && !defined(TKB_MAP_SHARDED_IMPLEMENTED)
+#define TKB_MAP_SHARDED_IMPLEMENTED
+
+/// The offset of the shards, rounded up so they start on a cache
+/// line when the map does.
+#define HASHMAP_SHARDS_OFFSET ((sizeof(ShardedMap) + HASHMAP_CACHE_LINE - 1) / HASHMAP_CACHE_LINE * HASHMAP_CACHE_LINE)
+
+/// The size of the allocation, with a line to spare for aligning it.
+static inline size_t hashmap_sharded_total_size(size_t shard_count) {
+    return HASHMAP_SHARDS_OFFSET + shard_count * sizeof(HashMapShardSlot) + HASHMAP_CACHE_LINE;
+}
+
+static inline HashMapShard* hashmap_shard_at(const ShardedMap* map, size_t i) {
+    return &((HashMapShardSlot*)((const u8*)map + HASHMAP_SHARDS_OFFSET))[i].shard;
+}
+
+/// Picks the shard from the high bits of the mixed hash. The
+/// shards use the low bits for their index and the groups use
+/// the top bits of a different mix for their tags, so neither
+/// loses any bits to the sharding.
+static inline HashMapShard* hashmap_shard_of(const ShardedMap* map, size_t hash) {
+    if (map->shard_bits == 0)
+        return hashmap_shard_at(map, 0);
+
+    u64 mixed = ((u64)hash ^ ((u64)hash >> 32)) * 0xD6E8FEB86659FD93ULL;
+    return hashmap_shard_at(map, (size_t)(mixed >> (64 - map->shard_bits)));
+}
+
+ShardedMap* hashmap_sharded_new(Allocator* allocator, size_t shard_count, size_t capacity, float load_factor, size_t key_stride, size_t value_stride, HashMapOptions options) {
+    if (shard_count == 0 || shard_count > ((size_t)1 << 16))
+        return NULL;
+
+    size_t shard_bits = 0;
+    while (((size_t)1 << shard_bits) < shard_count)
+        ++shard_bits;
+    shard_count = (size_t)1 << shard_bits;
+
+    size_t total_size = hashmap_sharded_total_size(shard_count);
+    void*  block      = allocate(allocator, total_size);
+    if (block == NULL)
+        return NULL;
+
+    ShardedMap* map = (ShardedMap*)(((size_t)block + HASHMAP_CACHE_LINE - 1) & ~(size_t)(HASHMAP_CACHE_LINE - 1));
+    *map = (ShardedMap) {
+        .allocator    = allocator,
+        .block        = block,
+        .shard_bits   = shard_bits,
+        .key_stride   = key_stride,
+        .value_stride = value_stride,
+    };
+
+    size_t shard_capacity = (capacity + shard_count - 1) / shard_count;
+    if (shard_capacity == 0)
+        shard_capacity = 1;
+
+    for (size_t i = 0; i < shard_count; ++i) {
+        HashMapShard* shard = hashmap_shard_at(map, i);
+        shard->map = hashmap_new_with_options(allocator, shard_capacity, load_factor, key_stride, value_stride, options);
+        if (shard->map == NULL || pthread_mutex_init(&shard->lock, NULL) != 0) {
+            if (shard->map != NULL)
+                hashmap_free(&shard->map);
+            while (i-- > 0) {
+                shard = hashmap_shard_at(map, i);
+                pthread_mutex_destroy(&shard->lock);
+                hashmap_free(&shard->map);
+            }
+            deallocate(allocator, block, total_size);
+            return NULL;
+        }
+    }
+
+    return map;
+}
+
+void hashmap_sharded_free(ShardedMap** map) {
+    ShardedMap* sharded = *map;
+    size_t      count   = hashmap_sharded_shard_count(sharded);
+
+    for (size_t i = 0; i < count; ++i) {
+        HashMapShard* shard = hashmap_shard_at(sharded, i);
+        pthread_mutex_destroy(&shard->lock);
+        hashmap_free(&shard->map);
+    }
+    deallocate(sharded->allocator, sharded->block, hashmap_sharded_total_size(count));
+    *map = NULL;
+}
+
+size_t hashmap_sharded_shard_count(const ShardedMap* map) {
+    return (size_t)1 << map->shard_bits;
+}
+
+size_t hashmap_sharded_count(ShardedMap* map) {
+    size_t total = 0;
+    size_t count = hashmap_sharded_shard_count(map);
+    for (size_t i = 0; i < count; ++i) {
+        HashMapShard* shard = hashmap_shard_at(map, i);
+        pthread_mutex_lock(&shard->lock);
+        total += hashmap_count(shard->map);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return total;
+}
+
+int hashmap_sharded_get(ShardedMap* map, const void* key, void* value, hash_function hash_key, compare_function compare_key) {
+    size_t        hash  = hash_key(key, map->key_stride);
+    HashMapShard* shard = hashmap_shard_of(map, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    const void* existing = hashmap_get_hashed(shard->map, key, hash, compare_key);
+    if (existing != NULL)
+        memcpy(value, existing, map->value_stride);
+    pthread_mutex_unlock(&shard->lock);
+
+    return existing != NULL;
+}
+
+int hashmap_sharded_set(ShardedMap* map, const void* key, const void* value, hash_function hash_key, compare_function compare_key) {
+    size_t        hash  = hash_key(key, map->key_stride);
+    HashMapShard* shard = hashmap_shard_of(map, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int result = hashmap_set_hashed(&shard->map, key, value, hash, hash_key, compare_key);
+    pthread_mutex_unlock(&shard->lock);
+
+    return result;
+}
+
+int hashmap_sharded_del(ShardedMap* map, const void* key, hash_function hash_key, compare_function compare_key) {
+    size_t        hash  = hash_key(key, map->key_stride);
+    HashMapShard* shard = hashmap_shard_of(map, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int result = hashmap_del_hashed(&shard->map, key, hash, hash_key, compare_key) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    return result;
+}
+
+#endif  // TKB_MAP_IMPLEMENTATION
+
+
+#define SHARDED_MAP_DEFINE_H(Class, prefix, KEY, VALUE)                                                                              \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t shard_count, size_t capacity);                                   \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t shard_count, size_t capacity, float factor, HashMapOptions options);  \
+    static inline size_t  prefix##_count(Class* map);                                                                                \
+    static inline int     prefix##_get(Class* map, KEY key, VALUE* value);                                                           \
+    static inline int     prefix##_set(Class* map, KEY key, VALUE value);                                                            \
+    static inline int     prefix##_del(Class* map, KEY key);                                                                         \
+    static inline void    prefix##_free(Class** map);                                                                                \
+
+
+/// Like MAP_DEFINE_C_WITH, but for a sharded map, e.g.
+/// `SHARDED_MAP_DEFINE_C_WITH(IdShards, idshards, u64, int, hash_u64, compare_u64)`.
+#define SHARDED_MAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, HASH, COMPARE)                                                          \
+    static inline Class*  prefix##_new(Allocator* allocator, size_t shard_count, size_t capacity)                                    { return (Class*) hashmap_sharded_new(allocator, shard_count, capacity, HASHMAP_DEFAULT_LOAD_FACTOR, sizeof(KEY), sizeof(VALUE), HASHMAP_OPTION_NONE);  }  \
+    static inline Class*  prefix##_new_with_options(Allocator* allocator, size_t shard_count, size_t capacity, float factor, HashMapOptions options)  { return (Class*) hashmap_sharded_new(allocator, shard_count, capacity, factor, sizeof(KEY), sizeof(VALUE), options);  }  \
+    static inline size_t  prefix##_count(Class* map)                                                                                 { return hashmap_sharded_count((ShardedMap*)map);  }                                                                    \
+    static inline int     prefix##_get(Class* map, KEY key, VALUE* value)                                                            { return hashmap_sharded_get((ShardedMap*)map, (const void*)&key, (void*)value, HASH, COMPARE);  }                       \
+    static inline int     prefix##_set(Class* map, KEY key, VALUE value)                                                             { return hashmap_sharded_set((ShardedMap*)map, (const void*)&key, (const void*)&value, HASH, COMPARE);  }                \
+    static inline int     prefix##_del(Class* map, KEY key)                                                                          { return hashmap_sharded_del((ShardedMap*)map, (const void*)&key, HASH, COMPARE);  }                                    \
+    static inline void    prefix##_free(Class** map)                                                                                 { hashmap_sharded_free((ShardedMap**)map);  }                                                                           \
+
+
+#define SHARDED_MAP_DEFINE_C(Class, prefix, KEY, VALUE)                                                                              \
+    SHARDED_MAP_DEFINE_C_WITH(Class, prefix, KEY, VALUE, MAP_HASH_FUNCTION, MAP_COMPARE_FUNCTION)
@@ -0,0 +1,391 @@
+// Generates the tables of a PerfectMap (see hashmap_perfect.h) from a list
+// of keys and values, as a header to include where the hashmap is
+// implemented.
+//
+//     map_perfect -n Class -p prefix -v value_type [-k string|u32|u64] [-o output.h] input
+//
+// Each line of the input is a key and its value, separated by whitespace.
+// The value is the rest of the line, and is copied into the header as the
+// initializer of a `value_type`, e.g. `add  OP_ADD` or `7  { 1, "seven" }`.
+// Empty lines, and lines starting with '#', are skipped. String keys can't
+// contain whitespace, and integer keys are parsed like C literals.
+//
+// The header defines `prefix##_get` and the rest of PERFECT_MAP_DEFINE_C_WITH
+// on the tables, and a `prefix##_map` pointer to pass to them.
+
+#include <ctype.h>
+#include <stdio.h>
+
+#define TKB_MAP_IMPLEMENTATION
+#include "hashmap.h"
+#include "hashmap_perfect.h"
+
+/// The average number of keys in a bucket. Fewer means fewer
+/// seeds to search for, but more of them to store.
+#define PERFECT_BUCKET_SIZE 4
+
+/// How many seeds to try for a bucket before retrying with
+/// more buckets.
+#define PERFECT_MAX_SEED   (1u << 20)
+#define PERFECT_MAX_RETRY  8
+
+typedef struct PerfectKind {
+    const char*   name;
+    const char*   type;
+    const char*   hash;
+    const char*   compare;
+    hash_function hash_key;
+} PerfectKind;
+
+static const PerfectKind perfect_kinds[] = {
+    { "string", "const char*", "hash_string", "compare_string", hash_string },
+    { "u32",    "u32",         "hash_u32",    "compare_u32",    hash_u32    },
+    { "u64",    "u64",         "hash_u64",    "compare_u64",    hash_u64    },
+};
+
+typedef struct PerfectEntry {
+    const char* key;
+    const char* value;
+    u64         number;
+    size_t      hash;
+    size_t      bucket;
+    size_t      slot;
+    size_t      line;
+} PerfectEntry;
+
+typedef struct PerfectInput {
+    char*         text;
+    PerfectEntry* entries;
+    size_t        count;
+} PerfectInput;
+
+static char* perfect_read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    size_t size = 0, capacity = 4096;
+    char*  text = malloc(capacity);
+    size_t read;
+    while (text != NULL && (read = fread(text + size, 1, capacity - size - 1, file)) > 0) {
+        size += read;
+        if (capacity - size - 1 == 0) {
+            char* grown = realloc(text, capacity * 2);
+            if (grown == NULL)
+                free(text);
+            text      = grown;
+            capacity *= 2;
+        }
+    }
+    fclose(file);
+
+    if (text != NULL)
+        text[size] = '\0';
+    return text;
+}
+
+/// Splits the text into entries in place, and hashes their keys.
+static int perfect_parse(PerfectInput* input, const PerfectKind* kind) {
+    size_t capacity = 64;
+    input->entries = malloc(capacity * sizeof(PerfectEntry));
+    input->count   = 0;
+
+    size_t line = 0;
+    for (char* cursor = input->text; input->entries != NULL && *cursor != '\0'; ) {
+        char* start = cursor;
+        char* end   = strchr(cursor, '\n');
+        cursor = (end != NULL) ? end + 1 : start + strlen(start);
+        if (end == NULL)
+            end = cursor;
+        line += 1;
+
+        while (start < end && isspace((unsigned char)*start))
+            ++start;
+        while (end > start && isspace((unsigned char)end[-1]))
+            --end;
+        if (start == end || *start == '#')
+            continue;
+        *end = '\0';
+
+        char* key = start;
+        while (*start != '\0' && !isspace((unsigned char)*start))
+            ++start;
+        if (*start == '\0') {
+            fprintf(stderr, "line %zu: '%s' has no value\n", line, key);
+            return 0;
+        }
+        *start++ = '\0';
+        while (isspace((unsigned char)*start))
+            ++start;
+
+        PerfectEntry entry = { .key = key, .value = start, .line = line };
+        if (kind->hash_key == hash_string) {
+            entry.hash = hash_string(&entry.key, sizeof(entry.key));
+        } else {
+            char* rest;
+            entry.number = strtoull(key, &rest, 0);
+            if (*rest != '\0' || (kind->hash_key == hash_u32 && entry.number > 0xFFFFFFFFULL)) {
+                fprintf(stderr, "line %zu: '%s' isn't a %s\n", line, key, kind->name);
+                return 0;
+            }
+            u32 small = (u32)entry.number;
+            entry.hash = (kind->hash_key == hash_u32) ? hash_u32(&small, sizeof(small)) : hash_u64(&entry.number, sizeof(entry.number));
+        }
+
+        if (input->count == capacity) {
+            PerfectEntry* grown = realloc(input->entries, capacity * 2 * sizeof(PerfectEntry));
+            if (grown == NULL)
+                free(input->entries);
+            input->entries = grown;
+            capacity      *= 2;
+            if (grown == NULL)
+                break;
+        }
+        input->entries[input->count++] = entry;
+    }
+
+    if (input->entries == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+    return 1;
+}
+
+static int perfect_compare_hash(const void* a, const void* b) {
+    size_t x = ((const PerfectEntry*)a)->hash;
+    size_t y = ((const PerfectEntry*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/// Keys with the same hash can never be told apart by a seed,
+/// so they're either duplicates, or the hash isn't good enough.
+static int perfect_check_hashes(PerfectInput* input, const PerfectKind* kind) {
+    qsort(input->entries, input->count, sizeof(PerfectEntry), perfect_compare_hash);
+    for (size_t i = 1; i < input->count; ++i) {
+        const PerfectEntry* a = &input->entries[i - 1];
+        const PerfectEntry* b = &input->entries[i];
+        if (a->hash != b->hash)
+            continue;
+        if ((kind->hash_key == hash_string) ? strcmp(a->key, b->key) == 0 : a->number == b->number)
+            fprintf(stderr, "line %zu: '%s' is a duplicate of line %zu\n", b->line, b->key, a->line);
+        else
+            fprintf(stderr, "line %zu: '%s' has the same hash as '%s' on line %zu\n", b->line, b->key, a->key, a->line);
+        return 0;
+    }
+    return 1;
+}
+
+static const size_t* perfect_bucket_sizes = NULL;
+
+/// Orders the entries by the size of their bucket, largest first,
+/// so the buckets with the most keys get to pick among the most
+/// free slots.
+static int perfect_compare_bucket(const void* a, const void* b) {
+    const PerfectEntry* x = a;
+    const PerfectEntry* y = b;
+    size_t x_size = perfect_bucket_sizes[x->bucket];
+    size_t y_size = perfect_bucket_sizes[y->bucket];
+    if (x_size != y_size)
+        return (x_size < y_size) - (x_size > y_size);
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+/// Searches for the seed of every bucket, and writes the slot of
+/// every entry. Returns 0 if some bucket had no seed that fit.
+static int perfect_search(PerfectInput* input, u32* seeds, size_t bucket_count) {
+    size_t  count = input->count;
+    size_t* sizes = calloc(bucket_count, sizeof(size_t));
+    u8*     taken = calloc(count, 1);
+    size_t* slots = malloc(count * sizeof(size_t));
+    int     found = (sizes != NULL && taken != NULL && slots != NULL);
+
+    for (size_t i = 0; found && i < count; ++i) {
+        input->entries[i].bucket = hashmap_perfect_bucket(input->entries[i].hash, bucket_count);
+        sizes[input->entries[i].bucket] += 1;
+    }
+    perfect_bucket_sizes = sizes;
+    if (found)
+        qsort(input->entries, count, sizeof(PerfectEntry), perfect_compare_bucket);
+
+    for (size_t first = 0; found && first < count; ) {
+        PerfectEntry* bucket = &input->entries[first];
+        size_t        size   = sizes[bucket->bucket];
+
+        found = 0;
+        for (u32 seed = 0; seed < PERFECT_MAX_SEED && !found; ++seed) {
+            found = 1;
+            for (size_t i = 0; i < size && found; ++i) {
+                slots[i] = hashmap_perfect_slot(bucket[i].hash, seed, count);
+                found = !taken[slots[i]];
+                for (size_t j = 0; j < i && found; ++j)
+                    found = (slots[j] != slots[i]);
+            }
+            if (found)
+                seeds[bucket->bucket] = seed;
+        }
+
+        for (size_t i = 0; i < size && found; ++i) {
+            bucket[i].slot    = slots[i];
+            taken[slots[i]] = 1;
+        }
+        first += size;
+    }
+
+    free(sizes);
+    free(taken);
+    free(slots);
+    return found;
+}
+
+static int perfect_compare_slot(const void* a, const void* b) {
+    size_t x = ((const PerfectEntry*)a)->slot;
+    size_t y = ((const PerfectEntry*)b)->slot;
+    return (x > y) - (x < y);
+}
+
+static void perfect_write_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (; *text != '\0'; ++text) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (isprint(c) && c != '?')
+            fputc(c, file);
+        else
+            fprintf(file, "\\%03o", c);
+    }
+    fputc('"', file);
+}
+
+static void perfect_write(FILE* file, const char* source, const PerfectInput* input, const u32* seeds, size_t bucket_count,
+                          const PerfectKind* kind, const char* class_name, const char* prefix, const char* value_type) {
+    fprintf(file, "// Generated by map_perfect from %s, do not edit.\n", source);
+    fprintf(file, "#ifndef TKB_PERFECT_MAP_");
+    for (const char* c = prefix; *c != '\0'; ++c)
+        fputc(toupper((unsigned char)*c), file);
+    fprintf(file, "_H\n#define TKB_PERFECT_MAP_");
+    for (const char* c = prefix; *c != '\0'; ++c)
+        fputc(toupper((unsigned char)*c), file);
+    fprintf(file, "_H\n\n#include \"hashmap_perfect.h\"\n\n");
+
+    fprintf(file, "typedef struct %s %s;\n", class_name, class_name);
+    fprintf(file, "PERFECT_MAP_DEFINE_H(%s, %s, %s, %s)\n", class_name, prefix, kind->type, value_type);
+    fprintf(file, "PERFECT_MAP_DEFINE_C_WITH(%s, %s, %s, %s, %s, %s)\n\n", class_name, prefix, kind->type, value_type, kind->hash, kind->compare);
+
+    fprintf(file, "static u32 const %s_table_seeds[%zu] = {", prefix, bucket_count);
+    for (size_t i = 0; i < bucket_count; ++i)
+        fprintf(file, "%s%lu,", (i % 16 == 0) ? "\n    " : " ", (unsigned long)seeds[i]);
+    fprintf(file, "\n};\n\n");
+
+    fprintf(file, "static %s const %s_table_keys[%zu] = {\n", kind->type, prefix, input->count);
+    for (size_t i = 0; i < input->count; ++i) {
+        const PerfectEntry* entry = &input->entries[i];
+        fprintf(file, "    ");
+        if (kind->hash_key == hash_string)
+            perfect_write_string(file, entry->key);
+        else if (kind->hash_key == hash_u32)
+            fprintf(file, "0x%08lXU", (unsigned long)entry->number);
+        else
+            fprintf(file, "0x%016llXULL", (unsigned long long)entry->number);
+        fprintf(file, ",\n");
+    }
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "static %s const %s_table_values[%zu] = {\n", value_type, prefix, input->count);
+    for (size_t i = 0; i < input->count; ++i)
+        fprintf(file, "    %s,\n", input->entries[i].value);
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "static const PerfectMap %s_table = {\n", prefix);
+    fprintf(file, "    .count        = %zu,\n", input->count);
+    fprintf(file, "    .bucket_count = %zu,\n", bucket_count);
+    fprintf(file, "    .seeds        = %s_table_seeds,\n", prefix);
+    fprintf(file, "    .keys         = %s_table_keys,\n", prefix);
+    fprintf(file, "    .values       = %s_table_values,\n", prefix);
+    fprintf(file, "};\n");
+    fprintf(file, "static const %s* const %s_map = (const %s*)&%s_table;\n\n", class_name, prefix, class_name, prefix);
+    fprintf(file, "#endif\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* class_name = NULL;
+    const char* prefix     = NULL;
+    const char* value_type = NULL;
+    const char* kind_name  = "string";
+    const char* output     = NULL;
+    const char* source     = NULL;
+
+    int usage = 0;
+    for (int i = 1; i < argc && !usage; ++i) {
+        if (argv[i][0] != '-') {
+            usage  = (source != NULL);
+            source = argv[i];
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage = 1;
+            break;
+        }
+
+        if      (strcmp(argv[i], "-n") == 0) class_name = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0) prefix     = argv[++i];
+        else if (strcmp(argv[i], "-v") == 0) value_type = argv[++i];
+        else if (strcmp(argv[i], "-k") == 0) kind_name  = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0) output     = argv[++i];
+        else usage = 1;
+    }
+
+    const PerfectKind* kind = NULL;
+    for (size_t i = 0; i < sizeof(perfect_kinds) / sizeof(*perfect_kinds); ++i)
+        if (strcmp(perfect_kinds[i].name, kind_name) == 0)
+            kind = &perfect_kinds[i];
+
+    if (usage || class_name == NULL || prefix == NULL || value_type == NULL || source == NULL || kind == NULL) {
+        fprintf(stderr, "usage: %s -n Class -p prefix -v value_type [-k string|u32|u64] [-o output.h] input\n", argv[0]);
+        return 1;
+    }
+
+    PerfectInput input = { .text = perfect_read_file(source) };
+    if (input.text == NULL) {
+        fprintf(stderr, "Failed to read '%s'\n", source);
+        return 1;
+    }
+    if (!perfect_parse(&input, kind) || !perfect_check_hashes(&input, kind))
+        return 1;
+    if (input.count == 0 || input.count > 0xFFFFFFFFULL) {
+        fprintf(stderr, "'%s' has %zu keys, it needs at least 1 and at most 2^32 - 1\n", source, input.count);
+        return 1;
+    }
+
+    // A bucket that no seed fits is rare, and a few more
+    // buckets to spread the keys over is enough to fix it.
+    size_t bucket_count = (input.count + PERFECT_BUCKET_SIZE - 1) / PERFECT_BUCKET_SIZE;
+    u32*   seeds        = NULL;
+    int    found        = 0;
+    for (int retry = 0; retry < PERFECT_MAX_RETRY && !found; ++retry) {
+        free(seeds);
+        seeds = calloc(bucket_count, sizeof(u32));
+        found = (seeds != NULL) && perfect_search(&input, seeds, bucket_count);
+        if (!found)
+            bucket_count += bucket_count / 4 + 1;
+    }
+    if (!found) {
+        fprintf(stderr, "Failed to find a perfect hash for '%s'\n", source);
+        return 1;
+    }
+    qsort(input.entries, input.count, sizeof(PerfectEntry), perfect_compare_slot);
+
+    FILE* file = (output != NULL) ? fopen(output, "w") : stdout;
+    if (file == NULL) {
+        fprintf(stderr, "Failed to write '%s'\n", output);
+        return 1;
+    }
+    perfect_write(file, source, &input, seeds, bucket_count, kind, class_name, prefix, value_type);
+    if (output != NULL)
+        fclose(file);
+
+    free(seeds);
+    free(input.entries);
+    free(input.text);
+    return 0;
+}
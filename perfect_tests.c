@@ -0,0 +1,52 @@
+// Looks up every key of perfect_tests.txt in the tables map_perfect
+// generated from it, and a key that isn't there, run by ctest.
+
+#include <stdio.h>
+
+#define TKB_MAP_IMPLEMENTATION
+#include "hashmap.h"
+#include "perfect_tests_map.h"
+
+/// The keys of perfect_tests.txt, in the order of their values.
+static const char* const perfect_test_keys[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do",
+    "double", "else", "enum", "extern", "float", "for", "goto", "if",
+    "inline", "int", "long", "register", "restrict", "return", "short", "signed",
+    "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void",
+    "volatile", "while",
+};
+
+#define PERFECT_TEST_KEY_COUNT (sizeof(perfect_test_keys) / sizeof(*perfect_test_keys))
+
+int main(void) {
+    int failures = 0;
+    if (perfect_keywords_count(perfect_keywords_map) != PERFECT_TEST_KEY_COUNT) {
+        fprintf(stderr, "the tables have %zu keys instead of %zu\n", perfect_keywords_count(perfect_keywords_map), PERFECT_TEST_KEY_COUNT);
+        ++failures;
+    }
+
+    for (size_t i = 0; i < PERFECT_TEST_KEY_COUNT; ++i) {
+        const int* value = perfect_keywords_get(perfect_keywords_map, perfect_test_keys[i]);
+        if (value == NULL || *value != (int)i) {
+            fprintf(stderr, "'%s' wasn't found with %zu\n", perfect_test_keys[i], i);
+            ++failures;
+        }
+    }
+
+    // Every key lands in the slot of one of the keywords, so the
+    // ones that aren't keywords are only told apart by the compare.
+    static const char* const missing[] = { "whale", "", "intt", "Auto" };
+    for (size_t i = 0; i < sizeof(missing) / sizeof(*missing); ++i) {
+        if (perfect_keywords_get(perfect_keywords_map, missing[i]) != NULL) {
+            fprintf(stderr, "'%s' was found\n", missing[i]);
+            ++failures;
+        }
+    }
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("All tests passed");
+    return 0;
+}
@@ -31,12 +31,12 @@ enum LogId {
     LOG_ID_ALL       = 0xFFFF
 };
 
-#define infof(id, ...)         ((log_filter_passes(LOG_INFO,   id))             && logf_impl(LOG_INFO,   NULL,  __FILE__, __LINE__, __VA_ARGS__))
-#define warnf(id, ...)         ((log_filter_passes(LOG_WARN,   id))             && logf_impl(LOG_WARN,   NULL,  __FILE__, __LINE__, __VA_ARGS__))
-#define errorf(id, ...)        ((log_filter_passes(LOG_ERROR,  id))             && logf_impl(LOG_ERROR,  NULL,  __FILE__, __LINE__, __VA_ARGS__))
-#define assertf(id, cond, ...) ((log_filter_passes(LOG_ASSERT, id) && !(cond))  && logf_impl(LOG_ASSERT, #cond, __FILE__, __LINE__, __VA_ARGS__))
+#define infof(id, ...)         ((void)((log_filter_passes(LOG_INFO,   id))             && logf_impl(LOG_INFO,   NULL,  __FILE__, __LINE__, __VA_ARGS__)))
+#define warnf(id, ...)         ((void)((log_filter_passes(LOG_WARN,   id))             && logf_impl(LOG_WARN,   NULL,  __FILE__, __LINE__, __VA_ARGS__)))
+#define errorf(id, ...)        ((void)((log_filter_passes(LOG_ERROR,  id))             && logf_impl(LOG_ERROR,  NULL,  __FILE__, __LINE__, __VA_ARGS__)))
+#define assertf(id, cond, ...) ((void)((log_filter_passes(LOG_ASSERT, id) && !(cond))  && logf_impl(LOG_ASSERT, #cond, __FILE__, __LINE__, __VA_ARGS__)))
 
-#define logf_at_source(group, id, file, line, ...) (log_filter_passes(group, id) && logf_impl(group, NULL, file, line, __VA_ARGS__))
+#define logf_at_source(group, id, file, line, ...) ((void)(log_filter_passes(group, id) && logf_impl(group, NULL, file, line, __VA_ARGS__)))
 
 
 static /* __thread */ enum LogId log_filter[LOG_COUNT] = {
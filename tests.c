@@ -0,0 +1,1185 @@
+// Regression tests for the hashmap, run by ctest. Each test returns the
+// number of failed checks, and main returns nonzero if any of them failed.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+// Builds and rebuilds the indices on several threads, already from a few
+// thousand entries, so the tests reach the parallel fill.
+#define TKB_MAP_THREADS
+#define HASHMAP_PARALLEL_REBUILD_COUNT 4096
+
+#define TKB_MAP_IMPLEMENTATION
+#include "hashmap.h"
+#include "hashmap_concurrent.h"
+#include "hashmap_file.h"
+#include "hashmap_multi.h"
+#include "hashmap_sharded.h"
+
+/// Counts and prints a failed check, without stopping the test,
+/// and is left in with NDEBUG, unlike assert.
+#define TEST_CHECK(condition)                                                       \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                             \
+        }                                                                           \
+    } while (0)
+
+static const HashMapOptions test_options[] = {
+    HASHMAP_OPTION_NONE,
+    HASHMAP_OPTION_STORE_HASH,
+    HASHMAP_OPTION_GROUPS,
+    HASHMAP_OPTION_INCREMENTAL,
+    HASHMAP_OPTION_STABLE,
+    HASHMAP_OPTION_ROBIN_HOOD,
+    HASHMAP_OPTION_SMALL,
+    HASHMAP_OPTION_FILTER,
+    HASHMAP_OPTION_INTERLEAVED,
+    HASHMAP_OPTION_STORE_HASH | HASHMAP_OPTION_GROUPS | HASHMAP_OPTION_INCREMENTAL,
+};
+
+#define TEST_OPTION_COUNT (sizeof(test_options) / sizeof(*test_options))
+
+
+/// Lowering the load factor doubles the indices, and shrinking to fit
+/// cuts the capacity, so when the block is resized in place the keys
+/// move up over where the values were, while the values move down.
+static int test_shrink_after_load_factor(void) {
+    int failures = 0;
+    for (size_t o = 0; o < TEST_OPTION_COUNT; ++o) {
+        HashMap* map = hashmap_new_with_options(&allocator_system, 1000, 1.0f, sizeof(u64), sizeof(u64), test_options[o]);
+        for (u64 key = 0; key < 1000; ++key) {
+            u64 value = key * 3 + 1;
+            hashmap_set(&map, &key, &value, hash_u64, compare_u64);
+        }
+        for (u64 key = 800; key < 1000; ++key)
+            hashmap_del(&map, &key, hash_u64, compare_u64);
+
+        TEST_CHECK(hashmap_set_load_factor(map, 0.5f));
+        TEST_CHECK(hashmap_shrink_to_fit(&map, hash_u64, compare_u64));
+
+        TEST_CHECK(hashmap_count(map) == 800);
+        for (u64 key = 0; key < 1000; ++key) {
+            const u64* value = hashmap_get(map, &key, hash_u64, compare_u64);
+            TEST_CHECK((value != NULL) == (key < 800));
+            if (value != NULL && *value != key * 3 + 1) {
+                fprintf(stderr, "options %d: key %llu has value %llu\n", (int)test_options[o], key, *value);
+                ++failures;
+                break;
+            }
+        }
+        hashmap_free(&map);
+    }
+    return failures;
+}
+
+
+/// An incremental grow leaves the entries in the old block, and copies
+/// them a step at a time, while sets, deletes and lookups go on.
+static int test_incremental_grow(void) {
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_INCREMENTAL,
+        HASHMAP_OPTION_INCREMENTAL | HASHMAP_OPTION_STORE_HASH,
+        HASHMAP_OPTION_INCREMENTAL | HASHMAP_OPTION_GROUPS,
+        HASHMAP_OPTION_INCREMENTAL | HASHMAP_OPTION_INTERLEAVED,
+    };
+
+    int failures = 0;
+    for (size_t o = 0; o < sizeof(options) / sizeof(*options); ++o) {
+        HashMap* map = hashmap_new_with_options(&allocator_system, 1024, 0.75f, sizeof(u64), sizeof(u64), options[o]);
+        u64 key = 0;
+        while (hashmap_capacity(map) == 1024) {
+            u64 value = key * 3 + 1;
+            hashmap_set(&map, &key, &value, hash_u64, compare_u64);
+            ++key;
+        }
+
+        // Only the first step has been copied by the insert that grew.
+        const HashMapHeader* header = hashmap_header(map);
+        TEST_CHECK(header->previous != NULL);
+        TEST_CHECK(header->copied < header->previous->count);
+
+        // The entries can't be handed out as one array until
+        // they have all been copied.
+        const HashMap* readonly = map;
+        TEST_CHECK(hashmap_values_strided(readonly).data == NULL);
+        TEST_CHECK(hashmap_keys(readonly) == NULL);
+
+        // Deleting moves the last entries, which are in both blocks.
+        for (u64 k = 0; k < key; k += 3)
+            hashmap_del(&map, &k, hash_u64, compare_u64);
+        for (u64 k = 0; k < key; ++k) {
+            const u64* value = hashmap_get(map, &k, hash_u64, compare_u64);
+            TEST_CHECK((value != NULL) == (k % 3 != 0));
+            TEST_CHECK(value == NULL || *value == k * 3 + 1);
+        }
+
+        hashmap_finish_migration(&map, hash_u64);
+        TEST_CHECK(hashmap_header(map)->previous == NULL);
+
+        HashMapStrided values = hashmap_values_strided(map);
+        TEST_CHECK(values.data != NULL && values.count == hashmap_count(map));
+        for (size_t i = 0; i < values.count; ++i) {
+            u64 k = *(const u64*)hashmap_key_at(map, i);
+            TEST_CHECK(*(const u64*)(values.data + i * values.stride) == k * 3 + 1);
+        }
+        hashmap_free(&map);
+    }
+    return failures;
+}
+
+
+static int test_keep_odd(const void* key, void* value, void* data) {
+    (void)value;
+    (void)data;
+    return (*(const u64*)key & 1) != 0;
+}
+
+/// Retaining with `HASHMAP_OPTION_STABLE` fills each hole with the last
+/// entry, so the pointers to the entries that aren't moved stay valid.
+static int test_retain_stable(void) {
+    enum { KEYS = 1000 };
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_STABLE,
+        HASHMAP_OPTION_STABLE | HASHMAP_OPTION_STORE_HASH,
+        HASHMAP_OPTION_STABLE | HASHMAP_OPTION_FILTER,
+    };
+
+    int failures = 0;
+    for (size_t o = 0; o < sizeof(options) / sizeof(*options); ++o) {
+        HashMap* map = hashmap_new_with_options(&allocator_system, 16, 0.75f, sizeof(u64), sizeof(u64), options[o]);
+        for (u64 key = 0; key < KEYS; ++key) {
+            u64 value = key * 3 + 1;
+            hashmap_set(&map, &key, &value, hash_u64, compare_u64);
+        }
+
+        // The odd keys in the first half of the slots are never moved,
+        // as there are enough removed keys after them to fill every hole.
+        const u64* pointers[KEYS / 2];
+        for (u64 key = 1; key < KEYS / 2; key += 2)
+            pointers[key] = hashmap_get(map, &key, hash_u64, compare_u64);
+
+        TEST_CHECK(hashmap_retain(map, test_keep_odd, NULL, hash_u64) == KEYS / 2);
+        TEST_CHECK(hashmap_count(map) == KEYS / 2);
+        for (u64 key = 0; key < KEYS; ++key) {
+            const u64* value = hashmap_get(map, &key, hash_u64, compare_u64);
+            TEST_CHECK((value != NULL) == ((key & 1) != 0));
+            TEST_CHECK(value == NULL || *value == key * 3 + 1);
+            if (value != NULL && key < KEYS / 2)
+                TEST_CHECK(value == pointers[key]);
+        }
+        hashmap_free(&map);
+    }
+    return failures;
+}
+
+
+/// Setting keys that are already there, one batch or one merge at a
+/// time, mustn't grow the hashmap.
+static int test_batch_existing_keys(void) {
+    enum { KEYS = 900 };
+    u64 keys[KEYS];
+    u64 values[KEYS];
+    for (u64 i = 0; i < KEYS; ++i) {
+        keys[i]   = i * 7;
+        values[i] = i * 3 + 1;
+    }
+
+    int failures = 0;
+    for (size_t o = 0; o < TEST_OPTION_COUNT; ++o) {
+        HashMap* map   = hashmap_new_with_options(&allocator_system, 1000, 0.75f, sizeof(u64), sizeof(u64), test_options[o]);
+        HashMap* other = hashmap_new_with_options(&allocator_system, 1000, 0.75f, sizeof(u64), sizeof(u64), test_options[o]);
+        TEST_CHECK(hashmap_set_batch(&map, keys, values, KEYS, hash_u64, compare_u64) == KEYS);
+        TEST_CHECK(hashmap_set_batch(&other, keys, values, KEYS, hash_u64, compare_u64) == KEYS);
+
+        size_t capacity = hashmap_capacity(map);
+        TEST_CHECK(hashmap_set_batch(&map, keys, values, KEYS, hash_u64, compare_u64) == 0);
+        TEST_CHECK(hashmap_merge(&map, other, hash_u64, compare_u64) == 0);
+        TEST_CHECK(hashmap_capacity(map) == capacity);
+        TEST_CHECK(hashmap_count(map) == KEYS);
+        for (u64 i = 0; i < KEYS; ++i) {
+            const u64* value = hashmap_get(map, &keys[i], hash_u64, compare_u64);
+            TEST_CHECK(value != NULL && *value == values[i]);
+        }
+        hashmap_free(&map);
+        hashmap_free(&other);
+    }
+    return failures;
+}
+
+
+/// Deleting and setting new keys at the same count turns the empty
+/// indices into tombstones, which have to be cleared before they fill
+/// the whole table and every probe walks all of it.
+static int test_churn_tombstones(void) {
+    enum { KEYS = 3000, OPS = 50000 };
+
+    int failures = 0;
+    for (size_t o = 0; o < TEST_OPTION_COUNT; ++o) {
+        HashMap* map = hashmap_new_with_options(&allocator_system, 4000, 0.75f, sizeof(u64), sizeof(u64), test_options[o]);
+        for (u64 key = 0; key < KEYS; ++key) {
+            u64 value = key * 3 + 1;
+            hashmap_set(&map, &key, &value, hash_u64, compare_u64);
+        }
+
+        size_t capacity = hashmap_capacity(map);
+        for (u64 key = 0; key < OPS; ++key) {
+            u64 added = key + KEYS;
+            u64 value = added * 3 + 1;
+            TEST_CHECK(hashmap_del(&map, &key, hash_u64, compare_u64) != NULL);
+            TEST_CHECK(hashmap_set(&map, &added, &value, hash_u64, compare_u64) == 1);
+
+            const HashMapHeader* header = hashmap_header(map);
+            TEST_CHECK(hashmap_is_small(header) || header->count + header->tombstones < header->index_capacity);
+        }
+        TEST_CHECK(hashmap_capacity(map) == capacity);
+        TEST_CHECK(hashmap_count(map) == KEYS);
+
+        for (u64 key = 0; key < OPS + KEYS; ++key) {
+            const u64* value = hashmap_get(map, &key, hash_u64, compare_u64);
+            TEST_CHECK((value != NULL) == (key >= OPS));
+            TEST_CHECK(value == NULL || *value == key * 3 + 1);
+        }
+        if (failures != 0) {
+            fprintf(stderr, "options %d failed\n", (int)test_options[o]);
+            hashmap_free(&map);
+            break;
+        }
+        hashmap_free(&map);
+    }
+    return failures;
+}
+
+
+/// Builds hashmaps from keys where some are given again later, which
+/// have to keep their last value and their first position, on one
+/// thread and on several. The map then grows, which rebuilds the
+/// indices on several threads too, and shrinks again.
+static int test_build_from(void) {
+    enum { KEYS = 15000, TOTAL = 20000 };
+    static u64 keys[TOTAL];
+    static u64 values[TOTAL];
+    static u64 expected[KEYS];
+    static const size_t threads[] = { 1, 4 };
+
+    // The first KEYS keys are a permutation of all of them,
+    // and the rest repeat some of them.
+    for (u64 i = 0; i < TOTAL; ++i) {
+        keys[i]   = (i < KEYS) ? (i * 7919) % KEYS : keys[(i * 13) % KEYS];
+        values[i] = i * 3 + 1;
+        expected[keys[i]] = values[i];
+    }
+
+    int failures = 0;
+    for (size_t o = 0; o < TEST_OPTION_COUNT; ++o) {
+        for (size_t t = 0; t < sizeof(threads) / sizeof(*threads); ++t) {
+            HashMap* map = hashmap_build_from(&allocator_system, keys, values, TOTAL, 0.75f, sizeof(u64), sizeof(u64), test_options[o], threads[t], hash_u64, compare_u64);
+            TEST_CHECK(map != NULL);
+            if (map == NULL)
+                return failures;
+
+            TEST_CHECK(hashmap_count(map) == KEYS);
+            for (size_t i = 0; i < hashmap_count(map); ++i)
+                TEST_CHECK(*(const u64*)hashmap_key_at(map, i) == keys[i]);
+            for (u64 key = 0; key < KEYS + 100; ++key) {
+                const u64* value = hashmap_get(map, &key, hash_u64, compare_u64);
+                TEST_CHECK((value != NULL) == (key < KEYS));
+                TEST_CHECK(value == NULL || *value == expected[key]);
+            }
+
+            for (u64 key = KEYS; key < 3 * KEYS; ++key) {
+                u64 value = key * 3 + 1;
+                TEST_CHECK(hashmap_set(&map, &key, &value, hash_u64, compare_u64) == 1);
+            }
+            for (u64 key = KEYS; key < 3 * KEYS; ++key)
+                TEST_CHECK(hashmap_del(&map, &key, hash_u64, compare_u64) != NULL);
+            TEST_CHECK(hashmap_shrink_to_fit(&map, hash_u64, compare_u64));
+            TEST_CHECK(hashmap_count(map) == KEYS);
+            for (u64 key = 0; key < 3 * KEYS; ++key) {
+                const u64* value = hashmap_get(map, &key, hash_u64, compare_u64);
+                TEST_CHECK((value != NULL) == (key < KEYS));
+                TEST_CHECK(value == NULL || *value == expected[key]);
+            }
+
+            if (failures != 0) {
+                fprintf(stderr, "options %d, %d threads failed\n", (int)test_options[o], (int)threads[t]);
+                hashmap_free(&map);
+                return failures;
+            }
+            hashmap_free(&map);
+        }
+    }
+    return failures;
+}
+
+
+/// The keys of the owned key and file tests, one of each `HashMapFileKeys`.
+typedef union TestFileKey {
+    u64         bytes;
+    const char* string;
+    StringKey   string_key;
+} TestFileKey;
+
+/// A key with padding between its fields. `hash_bytes` and
+/// `compare_bytes` read the padding too, so it's cleared first, and
+/// the key is filled in place, as copying a struct may not copy it.
+typedef struct TestPaddedKey {
+    u8  kind;
+    u32 id;
+    u16 tag;
+} TestPaddedKey;
+
+static void test_padded_key(TestPaddedKey* key, u64 i) {
+    memset(key, 0, sizeof(*key));
+    key->kind = (u8)(i % 3);
+    key->id   = (u32)(i / 3);
+    key->tag  = (u16)(i * 31);
+}
+
+/// Sets padded struct keys with `hash_bytes` and `compare_bytes`, and
+/// pointer keys with `hash_ptr` and `compare_ptr`, looks them up from
+/// other copies, and checks that keys that differ in any field differ.
+static int test_fixed_size_keys(void) {
+    enum { KEYS = 3000 };
+    static u64 targets[KEYS];
+
+    int failures = 0;
+    TestPaddedKey a, b;
+    test_padded_key(&a, 7);
+    test_padded_key(&b, 7);
+    TEST_CHECK(sizeof(TestPaddedKey) > sizeof(u8) + sizeof(u32) + sizeof(u16));
+    TEST_CHECK(compare_bytes(&a, &b, sizeof(a)) == 0);
+    TEST_CHECK(hash_bytes(&a, sizeof(a)) == hash_bytes(&b, sizeof(b)));
+    b.kind += 1;
+    TEST_CHECK(compare_bytes(&a, &b, sizeof(a)) != 0);
+    test_padded_key(&b, 7);
+    b.tag += 1;
+    TEST_CHECK(compare_bytes(&a, &b, sizeof(a)) != 0);
+    TEST_CHECK(hash_bytes(&a, sizeof(a)) != hash_bytes(&b, sizeof(b)));
+
+    HashMap* padded   = hashmap_new(&allocator_system, 16, 0.75f, sizeof(TestPaddedKey), sizeof(u64));
+    HashMap* pointers = hashmap_new(&allocator_system, 16, 0.75f, sizeof(const u64*), sizeof(u64));
+    for (u64 i = 0; i < KEYS; ++i) {
+        TestPaddedKey key;
+        const u64*    pointer = &targets[i];
+        test_padded_key(&key, i);
+        TEST_CHECK(hashmap_set(&padded, &key, &i, hash_bytes, compare_bytes) == 1);
+        TEST_CHECK(hashmap_set(&pointers, &pointer, &i, hash_ptr, compare_ptr) == 1);
+    }
+    for (u64 i = 0; i < KEYS + 10; ++i) {
+        TestPaddedKey key;
+        const u64*    pointer = &targets[i % KEYS];
+        test_padded_key(&key, i);
+        const u64*    value   = hashmap_get(padded, &key, hash_bytes, compare_bytes);
+        TEST_CHECK((value != NULL) == (i < KEYS));
+        TEST_CHECK(value == NULL || *value == i);
+        value = hashmap_get(pointers, &pointer, hash_ptr, compare_ptr);
+        TEST_CHECK(value != NULL && *value == i % KEYS);
+    }
+    static u64 not_a_target;
+    const u64* outside = &not_a_target;
+    TEST_CHECK(hashmap_get(pointers, &outside, hash_ptr, compare_ptr) == NULL);
+    hashmap_free(&padded);
+    hashmap_free(&pointers);
+    return failures;
+}
+
+
+/// A key that is a prefix of another one has to compare unequal to it,
+/// both as a `const char*` and as a StringKey, and a StringKey of a
+/// slice of a longer string has to equal one of the same bytes.
+static int test_string_keys(void) {
+    enum { LENGTH = 600 };
+    static const char* const words[] = { "", "a", "ab", "abc", "abcd", "b", "ba" };
+    static char text[LENGTH + 1];
+    static char copy[LENGTH + 1];
+
+    int failures = 0;
+    const char* ab     = "ab";
+    const char* abc    = "abc";
+    char        same[] = "ab";
+    const char* ab_too = same;
+    TEST_CHECK(compare_string(&ab, &abc, sizeof(ab)) != 0);
+    TEST_CHECK(compare_string(&abc, &ab, sizeof(ab)) != 0);
+    TEST_CHECK(compare_string(&ab, &ab_too, sizeof(ab)) == 0);
+
+    StringKey ab_key   = string_key("ab");
+    StringKey abc_key  = string_key("abc");
+    StringKey ab_slice = string_key_n("abcd", 2);
+    TEST_CHECK(compare_string_key(&ab_key, &abc_key, sizeof(StringKey)) != 0);
+    TEST_CHECK(compare_string_key(&abc_key, &ab_key, sizeof(StringKey)) != 0);
+    TEST_CHECK(compare_string_key(&ab_key, &ab_slice, sizeof(StringKey)) == 0);
+    TEST_CHECK(hash_string_key(&ab_key, sizeof(StringKey)) == hash_string_key(&ab_slice, sizeof(StringKey)));
+
+    HashMap* strings = hashmap_new(&allocator_system, 4, 0.75f, sizeof(const char*), sizeof(u64));
+    for (u64 i = 0; i < sizeof(words) / sizeof(*words); ++i)
+        TEST_CHECK(hashmap_set(&strings, &words[i], &i, hash_string, compare_string) == 1);
+    for (u64 i = 0; i < sizeof(words) / sizeof(*words); ++i) {
+        const u64* value = hashmap_get(strings, &words[i], hash_string, compare_string);
+        TEST_CHECK(value != NULL && *value == i);
+    }
+    const char* missing = "abcde";
+    TEST_CHECK(hashmap_get(strings, &missing, hash_string, compare_string) == NULL);
+    hashmap_free(&strings);
+
+    // Every prefix of the text is a key of its own, and is found
+    // again from a copy of it that ends where the prefix does.
+    for (size_t i = 0; i < LENGTH; ++i)
+        text[i] = (char)('a' + (i * 7 + i / 26) % 26);
+    HashMap* keys = hashmap_new(&allocator_system, 16, 0.75f, sizeof(StringKey), sizeof(u64));
+    for (u64 length = 0; length < LENGTH; ++length) {
+        StringKey key = string_key_n(text, length);
+        TEST_CHECK(hashmap_set(&keys, &key, &length, hash_string_key, compare_string_key) == 1);
+    }
+    TEST_CHECK(hashmap_count(keys) == LENGTH);
+    for (u64 length = 0; length <= LENGTH; ++length) {
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+        StringKey  key   = string_key(copy);
+        const u64* value = hashmap_get(keys, &key, hash_string_key, compare_string_key);
+        TEST_CHECK((value != NULL) == (length < LENGTH));
+        TEST_CHECK(value == NULL || *value == length);
+    }
+    hashmap_free(&keys);
+    return failures;
+}
+
+
+/// Writes the name of the key to `buffer`, and returns a key of either
+/// kind pointing to it, `const char*` or `StringKey`.
+static TestFileKey test_owned_key(int string_key_kind, u64 i, char* buffer, size_t size) {
+    TestFileKey key;
+    snprintf(buffer, size, "owned-%llu", i * 7919);
+    if (string_key_kind)
+        key.string_key = string_key(buffer);
+    else
+        key.string = buffer;
+    return key;
+}
+
+/// Sets string keys from one stack buffer that is written over for each
+/// key, so only the copies the hashmap owns are left, then deletes and
+/// shrinks, which copies the rest of the strings into one chunk. The
+/// keys are also built from an array of names that is cleared after.
+static int test_owned_keys(void) {
+    enum { KEYS = 2000, TOTAL = 2500 };
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_OWNED_KEYS,
+        HASHMAP_OPTION_OWNED_KEYS | HASHMAP_OPTION_GROUPS,
+        HASHMAP_OPTION_OWNED_KEYS | HASHMAP_OPTION_STABLE,
+        HASHMAP_OPTION_OWNED_KEYS | HASHMAP_OPTION_INTERLEAVED,
+    };
+    static const size_t           strides[]  = { sizeof(const char*), sizeof(StringKey) };
+    static const hash_function    hashes[]   = { hash_string, hash_string_key };
+    static const compare_function compares[] = { compare_string, compare_string_key };
+    static char        names[TOTAL][24];
+    static u8          keys[TOTAL * sizeof(StringKey)];
+    static u64         values[TOTAL];
+
+    int failures = 0;
+    for (size_t o = 0; o < sizeof(options) / sizeof(*options); ++o) {
+        for (int k = 0; k < 2; ++k) {
+            char     buffer[24];
+            HashMap* map = hashmap_new_with_options(&allocator_system, 16, 0.75f, strides[k], sizeof(u64), options[o]);
+            TEST_CHECK(map != NULL);
+            if (map == NULL)
+                return failures;
+
+            for (u64 i = 0; i < KEYS; ++i) {
+                TestFileKey key   = test_owned_key(k, i, buffer, sizeof(buffer));
+                u64         value = i * 3 + 1;
+                TEST_CHECK(hashmap_set(&map, &key, &value, hashes[k], compares[k]) == 1);
+            }
+            memset(buffer, 'x', sizeof(buffer) - 1);
+            for (size_t i = 0; i < hashmap_count(map); ++i) {
+                const char* string;
+                memcpy(&string, hashmap_key_at(map, i), sizeof(string));
+                TEST_CHECK(string != buffer && strncmp(string, "owned-", 6) == 0);
+            }
+
+            for (u64 i = 0; i < KEYS; i += 2) {
+                TestFileKey key = test_owned_key(k, i, buffer, sizeof(buffer));
+                TEST_CHECK(hashmap_del(&map, &key, hashes[k], compares[k]) != NULL);
+            }
+            TEST_CHECK(hashmap_shrink_to_fit(&map, hashes[k], compares[k]));
+
+            // Only the strings of the keys that are left are kept.
+            const HashMapHeader* header = hashmap_header(map);
+            size_t               total  = 0;
+            for (size_t i = 0; i < hashmap_count(map); ++i) {
+                const char* string;
+                memcpy(&string, hashmap_key_at(map, i), sizeof(string));
+                total += strlen(string) + 1;
+            }
+            TEST_CHECK(header->strings != NULL && header->strings->next == NULL && header->strings->used == total);
+
+            for (u64 i = 0; i < KEYS + 10; ++i) {
+                TestFileKey key   = test_owned_key(k, i, buffer, sizeof(buffer));
+                const u64*  value = hashmap_get(map, &key, hashes[k], compares[k]);
+                TEST_CHECK((value != NULL) == (i % 2 == 1 && i < KEYS));
+                TEST_CHECK(value == NULL || *value == i * 3 + 1);
+            }
+            hashmap_free(&map);
+
+            // The names after KEYS repeat earlier ones, whose strings
+            // are only copied once.
+            for (u64 i = 0; i < TOTAL; ++i) {
+                TestFileKey key = test_owned_key(k, (i < KEYS) ? i : i - KEYS, names[i], sizeof(names[i]));
+                memcpy(keys + i * strides[k], &key, strides[k]);
+                values[i] = i;
+            }
+            map = hashmap_build_from(&allocator_system, keys, values, TOTAL, 0.75f, strides[k], sizeof(u64), options[o], 4, hashes[k], compares[k]);
+            TEST_CHECK(map != NULL);
+            if (map == NULL)
+                return failures;
+            memset(names, 0, sizeof(names));
+
+            TEST_CHECK(hashmap_count(map) == KEYS);
+            for (u64 i = 0; i < KEYS; ++i) {
+                TestFileKey key   = test_owned_key(k, i, buffer, sizeof(buffer));
+                const u64*  value = hashmap_get(map, &key, hashes[k], compares[k]);
+                TEST_CHECK(value != NULL && *value == ((i < TOTAL - KEYS) ? i + KEYS : i));
+            }
+
+            if (failures != 0) {
+                fprintf(stderr, "options %d, keys %d failed\n", (int)options[o], k);
+                hashmap_free(&map);
+                return failures;
+            }
+            hashmap_free(&map);
+        }
+    }
+    return failures;
+}
+
+
+static const char* const test_file_path = "map_tests_file.tmp";
+
+static TestFileKey test_file_key(HashMapFileKeys keys, u64 i, char* name, size_t size) {
+    TestFileKey key;
+    snprintf(name, size, "key-%llu", i * 7919);
+    if (keys == HASHMAP_FILE_KEYS_BYTES)
+        key.bytes = i * 7919;
+    else if (keys == HASHMAP_FILE_KEYS_STRING)
+        key.string = name;
+    else
+        key.string_key = string_key(name);
+    return key;
+}
+
+/// Rewrites the file with only its first `size` bytes, and with the
+/// byte at `flip` inverted if it's less than `size`. Returns 0 if the
+/// file couldn't be read or written.
+static int test_file_rewrite(const char* path, size_t size, size_t flip) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+    u8*    data = malloc(size);
+    size_t read = (data != NULL) ? fread(data, 1, size, file) : 0;
+    fclose(file);
+    if (read != size) {
+        free(data);
+        return 0;
+    }
+
+    if (flip < size)
+        data[flip] ^= 0xFF;
+    file = fopen(path, "wb");
+    int written = file != NULL && fwrite(data, 1, size, file) == size;
+    if (file != NULL && fclose(file) != 0)
+        written = 0;
+    free(data);
+    return written;
+}
+
+/// Saves a hashmap of each kind of key and each layout, maps it back
+/// and looks up every key, then checks that a truncated file and one
+/// with a flipped byte are both rejected.
+static int test_file_round_trip(void) {
+    enum { KEYS = 1000 };
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_NONE,
+        HASHMAP_OPTION_STORE_HASH,
+        HASHMAP_OPTION_GROUPS,
+        HASHMAP_OPTION_ROBIN_HOOD,
+        HASHMAP_OPTION_INTERLEAVED,
+        HASHMAP_OPTION_STABLE,
+    };
+    static const size_t           strides[]  = { sizeof(u64), sizeof(const char*), sizeof(StringKey) };
+    static const hash_function    hashes[]   = { hash_u64, hash_string, hash_string_key };
+    static const compare_function compares[] = { compare_u64, compare_string, compare_string_key };
+    static const compare_function saved[]    = { compare_u64, compare_string_saved, compare_string_key_saved };
+    static char names[KEYS][24];
+
+    int failures = 0;
+    for (size_t o = 0; o < sizeof(options) / sizeof(*options); ++o) {
+        for (int k = HASHMAP_FILE_KEYS_BYTES; k <= HASHMAP_FILE_KEYS_STRING_KEY; ++k) {
+            HashMapFileKeys keys = (HashMapFileKeys)k;
+            HashMap* map = hashmap_new_with_options(&allocator_system, 16, 0.75f, strides[k], sizeof(u64), options[o]);
+            for (u64 i = 0; i < KEYS; ++i) {
+                TestFileKey key   = test_file_key(keys, i, names[i], sizeof(names[i]));
+                u64         value = i * 3 + 1;
+                hashmap_set(&map, &key, &value, hashes[k], compares[k]);
+            }
+            for (u64 i = 0; i < KEYS; i += 3) {
+                TestFileKey key = test_file_key(keys, i, names[i], sizeof(names[i]));
+                hashmap_del(&map, &key, hashes[k], compares[k]);
+            }
+            TEST_CHECK(hashmap_save(map, test_file_path, keys, hashes[k]));
+
+            const HashMap* opened = hashmap_open_mmap(test_file_path, 1);
+            TEST_CHECK(opened != NULL);
+            if (opened != NULL) {
+                TEST_CHECK(hashmap_count(opened) == hashmap_count(map));
+                for (u64 i = 0; i < KEYS; ++i) {
+                    TestFileKey key   = test_file_key(keys, i, names[i], sizeof(names[i]));
+                    const u64*  value = hashmap_get(opened, &key, hashes[k], saved[k]);
+                    TEST_CHECK((value != NULL) == (i % 3 != 0));
+                    TEST_CHECK(value == NULL || *value == i * 3 + 1);
+                }
+                hashmap_close_mmap(&opened);
+            }
+
+            FILE* file = fopen(test_file_path, "rb");
+            long  size = -1;
+            if (file != NULL && fseek(file, 0, SEEK_END) == 0)
+                size = ftell(file);
+            if (file != NULL)
+                fclose(file);
+            TEST_CHECK(size > 0);
+
+            if (size > 0) {
+                TEST_CHECK(test_file_rewrite(test_file_path, (size_t)size, (size_t)size / 2));
+                TEST_CHECK(hashmap_open_mmap(test_file_path, 1) == NULL);
+                TEST_CHECK(test_file_rewrite(test_file_path, (size_t)size - 1, (size_t)size));
+                TEST_CHECK(hashmap_open_mmap(test_file_path, 0) == NULL);
+            }
+            remove(test_file_path);
+
+            if (failures != 0) {
+                fprintf(stderr, "options %d, keys %d failed\n", (int)options[o], k);
+                hashmap_free(&map);
+                return failures;
+            }
+            hashmap_free(&map);
+        }
+    }
+    return failures;
+}
+
+
+/// Adds a chain of values to each key, deletes every third key, and
+/// adds as many values again, which have to reuse the freed entries
+/// instead of growing the array.
+static int test_multimap(void) {
+    enum { KEYS = 300 };
+
+    int failures = 0;
+    MultiMap* map = hashmap_multi_new(&allocator_system, 16, 0.75f, sizeof(u64), sizeof(u64), HASHMAP_OPTION_NONE);
+    TEST_CHECK(map != NULL);
+    if (map == NULL)
+        return failures;
+
+    size_t total = 0;
+    for (u64 key = 0; key < KEYS; ++key) {
+        for (u64 j = 0; j <= key % 5; ++j) {
+            u64 value = key * 100 + j;
+            TEST_CHECK(hashmap_multi_add(map, &key, &value, hash_u64, compare_u64));
+            ++total;
+        }
+    }
+    TEST_CHECK(hashmap_multi_count(map) == total);
+    TEST_CHECK(hashmap_multi_key_count(map) == KEYS);
+
+    size_t deleted = 0;
+    for (u64 key = 0; key < KEYS; key += 3) {
+        TEST_CHECK(hashmap_multi_del(map, &key, hash_u64, compare_u64) == key % 5 + 1);
+        TEST_CHECK(hashmap_multi_del(map, &key, hash_u64, compare_u64) == 0);
+        deleted += key % 5 + 1;
+    }
+    TEST_CHECK(hashmap_multi_count(map) == total - deleted);
+
+    // The deleted keys come back with one value each.
+    size_t used     = map->used;
+    size_t capacity = map->capacity;
+    for (u64 key = 0; key < KEYS; key += 3) {
+        for (u64 j = 0; j <= key % 5 && deleted > 0; ++j, --deleted) {
+            u64 value = key * 100 + 50 + j;
+            TEST_CHECK(hashmap_multi_add(map, &key, &value, hash_u64, compare_u64));
+        }
+    }
+    TEST_CHECK(map->used == used);
+    TEST_CHECK(map->capacity == capacity);
+    TEST_CHECK(hashmap_multi_count(map) == total);
+
+    // Every chain holds its values in the order they were added.
+    for (u64 key = 0; key < KEYS + 10; ++key) {
+        size_t count = 0;
+        u64    base  = key * 100 + ((key % 3 == 0) ? 50 : 0);
+        for (size_t e = hashmap_multi_first(map, &key, hash_u64, compare_u64); e != HASHMAP_MULTI_END; e = hashmap_multi_next(map, e)) {
+            TEST_CHECK(*(const u64*)hashmap_multi_value(map, e) == base + count);
+            ++count;
+        }
+        TEST_CHECK(count == ((key < KEYS) ? key % 5 + 1 : 0));
+        TEST_CHECK(hashmap_multi_count_of(map, &key, hash_u64, compare_u64) == count);
+    }
+
+    hashmap_multi_free(&map);
+    return failures;
+}
+
+
+typedef struct TestShardedWriter {
+    ShardedMap* map;
+    u64         first;
+    int         failures;
+} TestShardedWriter;
+
+enum { TEST_SHARDED_KEYS = 5000 };
+
+/// Sets a range of keys of its own, deletes the even ones, and
+/// replaces the values of the odd ones.
+static void* test_sharded_write(void* data) {
+    TestShardedWriter* writer   = (TestShardedWriter*)data;
+    int                failures = 0;
+    for (u64 key = writer->first; key < writer->first + TEST_SHARDED_KEYS; ++key) {
+        u64 value = key * 3 + 1;
+        TEST_CHECK(hashmap_sharded_set(writer->map, &key, &value, hash_u64, compare_u64) == 1);
+    }
+    for (u64 key = writer->first; key < writer->first + TEST_SHARDED_KEYS; ++key) {
+        u64 value = key * 5 + 2;
+        if (key % 2 == 0)
+            TEST_CHECK(hashmap_sharded_del(writer->map, &key, hash_u64, compare_u64) == 1);
+        else
+            TEST_CHECK(hashmap_sharded_set(writer->map, &key, &value, hash_u64, compare_u64) == 0);
+    }
+    writer->failures = failures;
+    return NULL;
+}
+
+/// Writes disjoint ranges of keys from several threads, one shard per
+/// key, and checks every key afterwards.
+static int test_sharded(void) {
+    enum { WRITERS = 4 };
+
+    int failures = 0;
+    ShardedMap* map = hashmap_sharded_new(&allocator_system, 6, 16, 0.75f, sizeof(u64), sizeof(u64), HASHMAP_OPTION_NONE);
+    TEST_CHECK(map != NULL);
+    if (map == NULL)
+        return failures;
+    TEST_CHECK(hashmap_sharded_shard_count(map) == 8);
+
+    TestShardedWriter writers[WRITERS];
+    pthread_t         threads[WRITERS];
+    for (size_t i = 0; i < WRITERS; ++i) {
+        writers[i] = (TestShardedWriter) { map, (u64)i * 1000000, 0 };
+        TEST_CHECK(pthread_create(&threads[i], NULL, test_sharded_write, &writers[i]) == 0);
+    }
+    for (size_t i = 0; i < WRITERS; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += writers[i].failures;
+    }
+
+    TEST_CHECK(hashmap_sharded_count(map) == WRITERS * TEST_SHARDED_KEYS / 2);
+    for (size_t i = 0; i < WRITERS; ++i) {
+        for (u64 key = writers[i].first; key < writers[i].first + TEST_SHARDED_KEYS + 10; ++key) {
+            u64 value = 0;
+            int found = hashmap_sharded_get(map, &key, &value, hash_u64, compare_u64);
+            TEST_CHECK(found == (key % 2 == 1 && key < writers[i].first + TEST_SHARDED_KEYS));
+            TEST_CHECK(!found || value == key * 5 + 2);
+        }
+    }
+    u64 missing = WRITERS * 1000000;
+    TEST_CHECK(hashmap_sharded_del(map, &missing, hash_u64, compare_u64) == 0);
+
+    hashmap_sharded_free(&map);
+    return failures;
+}
+
+
+typedef struct TestConcurrentReader {
+    ConcurrentHashMap* map;
+    const int*         done;
+    int                failures;
+} TestConcurrentReader;
+
+enum { TEST_CONCURRENT_KEYS = 3000 };
+
+/// Looks up every key over and over until the writer is done. A key
+/// that is found has either the value it was set to or the one it
+/// was replaced with.
+static void* test_concurrent_read(void* data) {
+    TestConcurrentReader* reader   = (TestConcurrentReader*)data;
+    int                   failures = 0;
+    int                   id       = hashmap_concurrent_register_reader(reader->map);
+    TEST_CHECK(id >= 0);
+    while (id >= 0 && !__atomic_load_n(reader->done, __ATOMIC_ACQUIRE)) {
+        for (u64 key = 0; key < TEST_CONCURRENT_KEYS; ++key) {
+            u64 value = 0;
+            if (hashmap_concurrent_get(reader->map, id, &key, &value, hash_u64, compare_u64))
+                TEST_CHECK(value == key * 3 + 1 || value == key * 5 + 2);
+        }
+    }
+    if (id >= 0)
+        hashmap_concurrent_unregister_reader(reader->map, id);
+    reader->failures = failures;
+    return NULL;
+}
+
+/// Sets, replaces and deletes keys from one thread while others read
+/// them, which grows both copies many times, and checks that both
+/// copies end up with the same keys and values.
+static int test_concurrent(void) {
+    enum { READERS = 3 };
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_NONE,
+        HASHMAP_OPTION_GROUPS,
+        HASHMAP_OPTION_INCREMENTAL,
+        HASHMAP_OPTION_STABLE | HASHMAP_OPTION_STORE_HASH,
+    };
+
+    int failures = 0;
+    for (size_t o = 0; o < sizeof(options) / sizeof(*options); ++o) {
+        ConcurrentHashMap* map = hashmap_concurrent_new(&allocator_system, 16, 0.75f, sizeof(u64), sizeof(u64), options[o]);
+        TEST_CHECK(map != NULL);
+        if (map == NULL)
+            return failures;
+
+        int                  done = 0;
+        TestConcurrentReader readers[READERS];
+        pthread_t            threads[READERS];
+        for (size_t i = 0; i < READERS; ++i) {
+            readers[i] = (TestConcurrentReader) { map, &done, 0 };
+            TEST_CHECK(pthread_create(&threads[i], NULL, test_concurrent_read, &readers[i]) == 0);
+        }
+
+        for (u64 key = 0; key < TEST_CONCURRENT_KEYS; ++key) {
+            u64 value = key * 3 + 1;
+            TEST_CHECK(hashmap_concurrent_set(map, &key, &value, hash_u64, compare_u64) == 1);
+        }
+        for (u64 key = 0; key < TEST_CONCURRENT_KEYS; ++key) {
+            u64 value = key * 5 + 2;
+            if (key % 3 == 0)
+                TEST_CHECK(hashmap_concurrent_del(map, &key, hash_u64, compare_u64) == 1);
+            else if (key % 3 == 1)
+                TEST_CHECK(hashmap_concurrent_set(map, &key, &value, hash_u64, compare_u64) == 0);
+        }
+        u64 missing = TEST_CONCURRENT_KEYS;
+        TEST_CHECK(hashmap_concurrent_del(map, &missing, hash_u64, compare_u64) == 0);
+
+        __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < READERS; ++i) {
+            pthread_join(threads[i], NULL);
+            failures += readers[i].failures;
+        }
+
+        // Both copies have to agree, as the next writes flip between them.
+        size_t expected = TEST_CONCURRENT_KEYS - (TEST_CONCURRENT_KEYS + 2) / 3;
+        TEST_CHECK(hashmap_concurrent_count(map) == expected);
+        for (int copy = 0; copy < 2; ++copy) {
+            TEST_CHECK(hashmap_count(map->maps[copy]) == expected);
+            for (u64 key = 0; key < TEST_CONCURRENT_KEYS + 10; ++key) {
+                const u64* value = hashmap_get(map->maps[copy], &key, hash_u64, compare_u64);
+                TEST_CHECK((value != NULL) == (key % 3 != 0 && key < TEST_CONCURRENT_KEYS));
+                TEST_CHECK(value == NULL || *value == ((key % 3 == 1) ? key * 5 + 2 : key * 3 + 1));
+            }
+        }
+
+        hashmap_concurrent_free(&map);
+        if (failures != 0) {
+            fprintf(stderr, "options %d failed\n", (int)options[o]);
+            break;
+        }
+    }
+    return failures;
+}
+
+
+static u64 test_random(u64* state) {
+    u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/// Runs random sets, deletes, resizes and load factor changes, and
+/// compares every key with an array of the expected values.
+static int test_random_ops(void) {
+    enum { KEYS = 512, OPS = 20000 };
+    static const float load_factors[] = { 0.25f, 0.5f, 0.75f, 1.0f };
+
+    int failures = 0;
+    for (size_t o = 0; o < TEST_OPTION_COUNT; ++o) {
+        u64  state = 0x5EED + o;
+        u64  expected[KEYS];
+        u8   present[KEYS] = { 0 };
+        HashMap* map = hashmap_new_with_options(&allocator_system, 16, 0.75f, sizeof(u64), sizeof(u64), test_options[o]);
+
+        for (size_t i = 0; i < OPS && failures == 0; ++i) {
+            u64 key       = test_random(&state) % KEYS;
+            u64 operation = test_random(&state) % 100;
+            if (operation < 45) {
+                u64 value = test_random(&state);
+                TEST_CHECK(hashmap_set(&map, &key, &value, hash_u64, compare_u64) == !present[key]);
+                expected[key] = value;
+                present[key]  = 1;
+            } else if (operation < 90) {
+                const u64* value = hashmap_del(&map, &key, hash_u64, compare_u64);
+                TEST_CHECK((value != NULL) == present[key]);
+                TEST_CHECK(value == NULL || *value == expected[key]);
+                present[key] = 0;
+            } else if (operation < 95) {
+                TEST_CHECK(hashmap_shrink_to_fit(&map, hash_u64, compare_u64));
+            } else if (operation < 98) {
+                TEST_CHECK(hashmap_set_load_factor(map, load_factors[test_random(&state) % 4]));
+            } else {
+                TEST_CHECK(hashmap_reserve(&map, hashmap_count(map) + test_random(&state) % 256, hash_u64, compare_u64));
+            }
+
+            for (u64 k = 0; k < KEYS; ++k) {
+                const u64* value = hashmap_get(map, &k, hash_u64, compare_u64);
+                TEST_CHECK((value != NULL) == present[k]);
+                TEST_CHECK(value == NULL || *value == expected[k]);
+            }
+        }
+        if (failures != 0)
+            fprintf(stderr, "options %d failed\n", (int)test_options[o]);
+        hashmap_free(&map);
+    }
+    return failures;
+}
+
+
+typedef struct TestSet TestSet;
+SET_DEFINE_H(TestSet, test_set, u64)
+SET_DEFINE_C_WITH(TestSet, test_set, u64, hash_u64, compare_u64)
+
+/// Adds keys one at a time and in batches, some of them twice, and
+/// deletes some, through SET_DEFINE with every option. The set has
+/// no values, so its block has no value array, and its interleaved
+/// entries are only their keys.
+static int test_set_define(void) {
+    enum { KEYS = 2000 };
+    static u64 batch[KEYS];
+
+    int failures = 0;
+    for (size_t o = 0; o < TEST_OPTION_COUNT; ++o) {
+        TestSet* set = test_set_new_with_options(&allocator_system, 16, 0.75f, test_options[o]);
+        TEST_CHECK(set != NULL);
+        if (set == NULL)
+            return failures;
+
+        const HashMapHeader* header = hashmap_header((const HashMap*)set);
+        TEST_CHECK(header->value_stride == 0 && hashmap_values_row(header->value_stride, header->options) == 0);
+        TEST_CHECK(hashmap_key_step(header) == sizeof(u64));
+
+        // The even keys one at a time, and then every key in a batch,
+        // of which only the odd ones are new.
+        for (u64 key = 0; key < KEYS; key += 2)
+            TEST_CHECK(test_set_add(&set, key) == 1);
+        TEST_CHECK(test_set_add(&set, 0) == 0);
+        for (u64 i = 0; i < KEYS; ++i)
+            batch[i] = i;
+        TEST_CHECK(test_set_add_batch(&set, batch, KEYS) == KEYS / 2);
+        TEST_CHECK(test_set_count(set) == KEYS);
+
+        for (u64 key = 0; key < KEYS; key += 3)
+            TEST_CHECK(test_set_del(&set, key) == 1);
+        TEST_CHECK(test_set_del(&set, 0) == 0);
+        TEST_CHECK(test_set_del(&set, KEYS) == 0);
+
+        header = hashmap_header((const HashMap*)set);
+        TEST_CHECK(header->value_stride == 0);
+        TEST_CHECK(test_set_count(set) == KEYS - (KEYS + 2) / 3);
+        for (u64 key = 0; key < KEYS + 10; ++key)
+            TEST_CHECK(test_set_has(set, key) == (key % 3 != 0 && key < KEYS));
+        for (size_t i = 0; i < test_set_count(set); ++i)
+            TEST_CHECK(*test_set_key_at(set, i) % 3 != 0);
+
+        if (failures != 0) {
+            fprintf(stderr, "options %d failed\n", (int)test_options[o]);
+            test_set_free(&set);
+            break;
+        }
+        test_set_free(&set);
+    }
+    return failures;
+}
+
+
+typedef struct TestTypedMap TestTypedMap;
+MAP_DEFINE_H(TestTypedMap, test_typed, u32, u64)
+MAP_DEFINE_C_EX(TestTypedMap, test_typed, u32, u64, hash_u32, compare_u32)
+
+/// Runs random sets and deletes through the probe loops that
+/// MAP_DEFINE_C_EX generates, which grow the map and clear its
+/// tombstones, and compares every key with an array of the
+/// expected values. The value is wider than the key, so the
+/// interleaved entries are padded.
+static int test_typed_map(void) {
+    enum { KEYS = 700, OPS = 40000 };
+    static const HashMapOptions options[] = {
+        HASHMAP_OPTION_NONE,
+        HASHMAP_OPTION_INTERLEAVED,
+    };
+
+    int failures = 0;
+    for (size_t o = 0; o < sizeof(options) / sizeof(*options); ++o) {
+        u64  state = 0x7E57 + o;
+        u64  expected[KEYS];
+        u8   present[KEYS] = { 0 };
+        size_t count = 0;
+        TestTypedMap* map = test_typed_new_with_options(&allocator_system, 16, 0.75f, options[o]);
+        TEST_CHECK(map != NULL);
+        if (map == NULL)
+            return failures;
+
+        for (size_t i = 0; i < OPS && failures == 0; ++i) {
+            u32 key = (u32)(test_random(&state) % KEYS);
+            if (test_random(&state) % 100 < 50) {
+                u64 value = test_random(&state);
+                TEST_CHECK(test_typed_set(&map, key, value) == !present[key]);
+                count += !present[key];
+                expected[key] = value;
+                present[key]  = 1;
+            } else {
+                const u64* value = test_typed_del(&map, key);
+                TEST_CHECK((value != NULL) == present[key]);
+                TEST_CHECK(value == NULL || *value == expected[key]);
+                count -= present[key];
+                present[key] = 0;
+            }
+
+            const HashMapHeader* header = hashmap_header((const HashMap*)map);
+            TEST_CHECK(header->count + header->tombstones < header->index_capacity);
+            if (i % 97 != 0)
+                continue;
+            TEST_CHECK(test_typed_count(map) == count);
+            for (u32 k = 0; k < KEYS + 10; ++k) {
+                const u64* value = test_typed_get(map, k);
+                TEST_CHECK((value != NULL) == (k < KEYS && present[k]));
+                TEST_CHECK(value == NULL || *value == expected[k]);
+            }
+        }
+        if (failures != 0)
+            fprintf(stderr, "options %d failed\n", (int)options[o]);
+        test_typed_free(&map);
+    }
+    return failures;
+}
+
+
+#ifdef TKB_MAP_STATS
+/// Hashes a u64 key to itself, so the test knows
+/// which index each key starts probing at.
+static size_t test_hash_identity(const void* key, size_t stride) {
+    (void)stride;
+    return (size_t)*(const u64*)key;
+}
+
+static u64 test_stats_total(const u64* histogram) {
+    u64 total = 0;
+    for (size_t i = 0; i < HASHMAP_STATS_BUCKETS; ++i)
+        total += histogram[i];
+    return total;
+}
+
+/// Runs a known sequence of operations, built with TKB_MAP_STATS,
+/// and checks the probe lengths and counters it leaves.
+static int test_stats(void) {
+    int failures = 0;
+    HashMap* map = hashmap_new_with_options(&allocator_system, 64, 0.5f, sizeof(u64), sizeof(u64), HASHMAP_OPTION_NONE);
+    const HashMapStats* stats = hashmap_stats_of(map);
+    const u64 index_capacity  = hashmap_header(map)->index_capacity;
+    TEST_CHECK(index_capacity >= 32);
+
+    // Keys 0 to 9 take their own index, and a key that starts at
+    // index 0 then probes past all of them, to index 10.
+    for (u64 key = 0; key < 10; ++key)
+        hashmap_set(&map, &key, &key, test_hash_identity, compare_u64);
+    u64 collision = index_capacity;
+    hashmap_set(&map, &collision, &collision, test_hash_identity, compare_u64);
+    u64 replaced = 3;
+    TEST_CHECK(hashmap_set(&map, &replaced, &collision, test_hash_identity, compare_u64) == 0);
+
+    TEST_CHECK(stats->set_probes[0] == 11);
+    TEST_CHECK(stats->set_probes[4] == 1);
+    TEST_CHECK(test_stats_total(stats->set_probes) == 12);
+
+    for (u64 key = 0; key < 10; ++key)
+        TEST_CHECK(hashmap_get(map, &key, test_hash_identity, compare_u64) != NULL);
+    TEST_CHECK(hashmap_get(map, &collision, test_hash_identity, compare_u64) != NULL);
+    for (u64 key = 20; key < 23; ++key)
+        TEST_CHECK(hashmap_get(map, &key, test_hash_identity, compare_u64) == NULL);
+
+    TEST_CHECK(stats->get_probes[0] == 10);
+    TEST_CHECK(stats->get_probes[4] == 1);
+    TEST_CHECK(test_stats_total(stats->get_probes) == 11);
+    TEST_CHECK(stats->get_misses == 3);
+
+    u64 deleted = 5;
+    TEST_CHECK(hashmap_del(&map, &deleted, test_hash_identity, compare_u64) != NULL);
+    TEST_CHECK(hashmap_del(&map, &deleted, test_hash_identity, compare_u64) == NULL);
+    TEST_CHECK(stats->del_probes[0] == 1);
+    TEST_CHECK(test_stats_total(stats->del_probes) == 1);
+    TEST_CHECK(stats->del_misses == 1);
+    TEST_CHECK(hashmap_header(map)->tombstones == 1);
+    TEST_CHECK(stats->grows == 0);
+
+    // Filling the capacity grows once, and the counters
+    // are carried over to the new block.
+    size_t capacity = hashmap_capacity(map);
+    u64    sets     = 12;
+    for (u64 key = 1000; hashmap_capacity(map) == capacity; ++key, ++sets)
+        hashmap_set(&map, &key, &key, test_hash_identity, compare_u64);
+    stats = hashmap_stats_of(map);
+    TEST_CHECK(stats->grows == 1);
+    TEST_CHECK(stats->full_probes == 0);
+    TEST_CHECK(stats->grow_max_nanoseconds <= stats->grow_nanoseconds);
+    TEST_CHECK(test_stats_total(stats->set_probes) == sets);
+    TEST_CHECK(stats->get_misses == 3 && stats->del_misses == 1);
+
+    FILE* file = tmpfile();
+    TEST_CHECK(file != NULL);
+    if (file != NULL) {
+        hashmap_stats(map, file);
+        TEST_CHECK(ftell(file) > 0);
+        fclose(file);
+    }
+    hashmap_free(&map);
+    return failures;
+}
+#endif
+
+
+int main(void) {
+    int failures = 0;
+    failures += test_shrink_after_load_factor();
+    failures += test_incremental_grow();
+    failures += test_retain_stable();
+    failures += test_batch_existing_keys();
+    failures += test_churn_tombstones();
+    failures += test_build_from();
+    failures += test_fixed_size_keys();
+    failures += test_string_keys();
+    failures += test_owned_keys();
+    failures += test_file_round_trip();
+    failures += test_multimap();
+    failures += test_sharded();
+    failures += test_concurrent();
+    failures += test_random_ops();
+    failures += test_typed_map();
+    failures += test_set_define();
+#ifdef TKB_MAP_STATS
+    failures += test_stats();
+#endif
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("All tests passed");
+    return 0;
+}